@@ -2,12 +2,60 @@
 #define __DISK_H__
 #include <string.h>
 #define BLOCKSIZE 512
+#define MAX_RANGE 64 // max sectors moved by a single range/vector command
 
+// how writes reach the backing file, see set_sync_mode
+enum {
+    SYNC_FULL,   // msync the whole image after every write
+    SYNC_RANGE,  // msync only the pages a write touched
+    SYNC_GROUP,  // group commit: sync the dirty range every N writes or N ms
+    SYNC_ASYNC,  // leave writeback to the kernel until a flush
+};
+
+// how the image file is accessed, see set_disk_engine
+enum {
+    DISK_ENGINE_MAP,    // mmap 64 MB regions of the image as they are first touched
+    DISK_ENGINE_PREAD,  // pread/pwrite, nothing mapped
+    DISK_ENGINE_URING,  // batches on an io_uring, falls back to pread without one
+};
+
+int set_disk_engine(int engine); // before init_disk
+int set_disk_direct(int on);     // O_DIRECT for the uring engine, before init_disk
+int disk_engine();               // the engine in use, after a fallback the one actually serving
 int init_disk(char* filename, int ncyl, int nsec, int ttd);
 int cmd_i(int *ncyl, int *nsec);
+int disk_head();
 int cmd_r(int cyl, int sec, char *buf);
 int cmd_w(int cyl, int sec, int len, char *data);
+int cmd_rr(int cyl, int sec, int count, char *buf);
+int cmd_wr(int cyl, int sec, int count, char *data);
+// discard count blocks, they read back as zeros and give their space back to the host
+int cmd_d(int cyl, int sec, int count);
+int cmd_flush();
+int set_sync_mode(int mode, int group_ms, int group_writes);
 void close_disk();
-void diskDelay(int c1, int c2);
+
+// timing model of the simulated disk, see set_disk_timing; ttd is given to init_disk
+typedef struct {
+    int rpm;            // spindle speed, 0 leaves out rotational latency
+    int settle_us;      // added to every seek that moves the head
+    int xfer_kbs;       // transfer rate, 0 transfers at the media rate (one track per revolution)
+    int track_cache;    // cylinders kept in the on-disk read cache, 0 disables it
+    int virtual_clock;  // only advance the simulated clock instead of sleeping
+} disk_timing;
+
+typedef struct {
+    long accesses;
+    long cache_hits;
+    long seek_us, rot_us, xfer_us;
+    long clock_us;  // simulated service time so far
+} disk_timing_stat;
+
+int set_disk_timing(const disk_timing *t);
+void get_disk_timing(disk_timing *t, disk_timing_stat *st);
+// wall-clock delay owed for the calling thread's last access, 0 on the virtual clock
+long disk_last_delay_us();
+// with deferred delays the cmd functions do not sleep, the caller charges disk_last_delay_us
+void disk_defer_delay(int on);
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef __DISK_SCHED_H__
+#define __DISK_SCHED_H__
+#include <time.h>
+
+// policies for ordering the pending requests of the disk
+enum {
+    SCHED_FCFS,      // arrival order
+    SCHED_SSTF,      // shortest seek first
+    SCHED_SCAN,      // elevator, sweeps up and down
+    SCHED_CSCAN,     // circular elevator, sweeps up then jumps back to the lowest cylinder
+    SCHED_DEADLINE,  // C-SCAN, but requests older than the deadline go first
+    SCHED_NPOLICY,
+};
+
+enum {
+    DREQ_READ,
+    DREQ_WRITE,
+    DREQ_DISCARD,  // count blocks, no data
+};
+
+typedef struct disk_req {
+    int op;      // DREQ_READ, DREQ_WRITE or DREQ_DISCARD
+    int cyl, sec;
+    int count;   // consecutive sectors
+    int len;     // bytes of data for a single sector write, may be less than BLOCKSIZE
+    char *buf;   // destination of a read, source of a write
+    int result;  // return value of the disk command
+    struct timespec arrival;
+    int finished;
+    void (*done)(struct disk_req *r);  // completion, called once the simulated access is over
+    void *arg;                         // for the owner of the request
+    struct disk_req *next;
+} disk_req;
+
+typedef struct {
+    long requests;       // requests served under the policy
+    long seek_distance;  // cylinders travelled by the head
+    long wait_us;        // total time spent queued
+    long max_wait_us;
+} sched_stat;
+
+int sched_init(int policy);
+void sched_stop();
+int sched_set_policy(int policy);
+int sched_policy();
+const char *sched_policy_name(int policy);
+int sched_policy_from_name(const char *name);
+
+// queue n requests, each one's done callback fires from the timer thread when it completes
+void sched_submit(disk_req *reqs, int n);
+// queue n requests and wait until all of them are served, returns 0 if all succeeded
+int sched_run(disk_req *reqs, int n);
+
+// the index in q of the request to serve next, dir is the sweep direction (+1/-1) and is updated
+int sched_pick(int policy, disk_req **q, int n, int head, int *dir, const struct timespec *now);
+
+void sched_get_stats(int policy, sched_stat *out);
+void sched_reset_stats();
+
+#endif
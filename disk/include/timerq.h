@@ -0,0 +1,17 @@
+#ifndef __TIMERQ_H__
+#define __TIMERQ_H__
+#include <time.h>
+
+// callbacks fired by a single timer thread once their CLOCK_MONOTONIC deadline has passed
+typedef void (*timer_fn)(void *arg);
+
+int timerq_start();
+// stop the timer thread, whatever is still pending fires right away
+void timerq_stop();
+void timerq_add(const struct timespec *due, timer_fn fn, void *arg);
+int timerq_pending();
+
+void timespec_add_us(struct timespec *t, long us);
+long timespec_diff_us(const struct timespec *from, const struct timespec *to);
+
+#endif
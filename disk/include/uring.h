@@ -0,0 +1,31 @@
+#ifndef __URING_H__
+#define __URING_H__
+#include <sys/types.h>
+
+// operations the uring engine of disk.c needs
+enum {
+    URING_READ,
+    URING_WRITE,
+    URING_PUNCH,  // punch a hole over [off, off + len), the file keeps its size
+};
+
+typedef struct {
+    int op;
+    int fd;
+    char *buf;  // unused by URING_PUNCH
+    long len;
+    off_t off;
+    long res;   // set by uring_run: bytes moved, 0 for a punch, or -errno
+} uring_io;
+
+/*
+ * One io_uring shared by every thread, set up with raw syscalls so nothing
+ * beyond the kernel headers is needed. uring_run submits a whole batch with a
+ * single io_uring_enter and reaps all of its completions before returning.
+ */
+int uring_init(unsigned entries);  // 0 on success, -1 when the kernel has no io_uring for us
+void uring_exit();
+int uring_ready();
+int uring_run(uring_io *ios, int n); // 0 when every operation completed in full
+
+#endif
@@ -14,12 +14,12 @@ int main(int argc, char *argv[]) {
     }
     int port = atoi(argv[1]);
     tcp_client client = client_init("localhost", port);
-    static char buf[4096];
+    static char buf[TCP_BUF_SIZE];
     while (1) {
         fgets(buf, sizeof(buf), stdin);
         if (feof(stdin)) break;
         client_send(client, buf, strlen(buf) + 1);
-        int n = client_recv(client, buf, sizeof(buf));
+        int n = client_recv(client, buf, sizeof(buf) - 1);
         buf[n] = 0;
         printf("%s\n", buf);
         if (strcmp(buf, "Bye!") == 0) break;
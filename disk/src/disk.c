@@ -1,61 +1,418 @@
+#define _GNU_SOURCE // fallocate
 #include "../include/disk.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../include/uring.h"
+#include "../../include/bds_proto.h"
 #include "../../include/log.h"
 
 // global variables
 int _ncyl, _nsec, ttd;
-char *diskFile;
-int fd;
-int FILE_SIZE = 0; //n bytes
-int lastCyl = 0; // last cylinder accessed
-int init_disk(char *filename, int ncyl, int nsec, int ttd) {
+int fd = -1;
+off_t FILE_SIZE = 0; //n bytes
+
+/*
+ * Backing store. The image is created sparse and reached through one of three
+ * engines: DISK_ENGINE_MAP maps REGION_SIZE windows of it the first time they
+ * are touched, so a large image costs neither address space nor startup time
+ * up front, DISK_ENGINE_PREAD goes through pread/pwrite and maps nothing, and
+ * DISK_ENGINE_URING hands every storage call to io_uring as one batch, through
+ * O_DIRECT when asked for. Sectors written as all zeros are punched out of the file.
+ */
+#define REGION_SHIFT 26 // 64 MB
+#define REGION_SIZE (1L << REGION_SHIFT)
+static int engine = DISK_ENGINE_MAP;
+static const char *engine_names[] = {"map", "pread", "uring"};
+static int want_direct = 0;  // set_disk_direct, only the uring engine uses it
+static int direct = 0;       // the image is open with O_DIRECT
+static __thread char *bounce = NULL; // aligned copy of a request's data under O_DIRECT
+static char **regions = NULL;
+static long nregions = 0;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+static int can_punch = 1; // cleared when the file system does not support hole punching
+int lastCyl = 0; // last cylinder accessed, only touched with __atomic builtins
+
+// durability state, dirty_lo/dirty_hi is the byte range written since the last sync
+static int sync_mode = SYNC_RANGE;
+static int group_ms = 10, group_writes = 32;
+static long dirty_lo = -1, dirty_hi = -1;
+static int pending_writes = 0;
+static struct timespec last_sync;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static int flusher_running = 0;
+static int disk_written(long off, long len);
+
+static long region_len(long idx) {
+    off_t left = FILE_SIZE - ((off_t)idx << REGION_SHIFT);
+    return left < REGION_SIZE ? left : REGION_SIZE;
+}
+
+// the mapping of region idx, created on first use
+static char *region(long idx) {
+    char *p = __atomic_load_n(&regions[idx], __ATOMIC_ACQUIRE);
+    if (p) return p;
+    pthread_mutex_lock(&region_lock);
+    p = regions[idx];
+    if (!p) {
+        p = mmap(NULL, region_len(idx), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd,
+                 (off_t)idx << REGION_SHIFT);
+        if (p == MAP_FAILED) {
+            Error("disk: cannot map region %ld", idx);
+            p = NULL;
+        } else {
+            __atomic_store_n(&regions[idx], p, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&region_lock);
+    return p;
+}
+
+#define DIRECT_ALIGN 4096
+
+// run a batch covering [base, base + span) on the ring, through the bounce buffer under O_DIRECT
+static int uring_batch(uring_io *ios, int n, off_t base, long span) {
+    char *orig[MAX_RANGE];
+    int orig_set = direct;
+    if (direct) {
+        if (span > MAX_RANGE * BLOCKSIZE || n > MAX_RANGE) return -1;
+        if (!bounce && posix_memalign((void **)&bounce, DIRECT_ALIGN, MAX_RANGE * BLOCKSIZE) != 0) {
+            bounce = NULL;
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            orig[i] = ios[i].buf;
+            if (ios[i].op == URING_PUNCH) continue;
+            ios[i].buf = bounce + (ios[i].off - base);
+            if (ios[i].op == URING_WRITE) memcpy(ios[i].buf, orig[i], ios[i].len);
+        }
+    }
+    int res = uring_run(ios, n);
+    if (res != 0 && !uring_ready() && direct) {
+        // the ring is gone, the pread path takes over and cannot keep the alignment
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        direct = 0;
+    }
+    for (int i = 0; orig_set && i < n; i++) {
+        if (ios[i].op == URING_READ && res == 0) memcpy(orig[i], ios[i].buf, ios[i].len);
+        ios[i].buf = orig[i];
+    }
+    return res;
+}
+
+// copy len bytes between buf and the image at off, returns 0 on success
+static int storage_io(char *buf, off_t off, long len, int write) {
+    if (engine == DISK_ENGINE_URING && uring_ready()) {
+        uring_io io = {.op = write ? URING_WRITE : URING_READ, .fd = fd, .buf = buf, .len = len, .off = off};
+        if (uring_batch(&io, 1, off, len) == 0) return 0;
+        Error("disk: uring %s failed at %lld", write ? "write" : "read", (long long)off);
+        return -1;
+    }
+    if (engine != DISK_ENGINE_MAP) {
+        while (len > 0) {
+            ssize_t n = write ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+            if (n <= 0) {
+                Error("disk: %s failed at %lld", write ? "pwrite" : "pread", (long long)off);
+                return -1;
+            }
+            buf += n;
+            off += n;
+            len -= n;
+        }
+        return 0;
+    }
+    while (len > 0) {
+        long idx = off >> REGION_SHIFT, in = off & (REGION_SIZE - 1);
+        long piece = region_len(idx) - in < len ? region_len(idx) - in : len;
+        char *p = region(idx);
+        if (!p) return -1;
+        if (write) memcpy(p + in, buf, piece);
+        else memcpy(buf, p + in, piece);
+        buf += piece;
+        off += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+static int all_zero(const char *buf, long len) {
+    for (long i = 0; i < len; i++) {
+        if (buf[i]) return 0;
+    }
+    return 1;
+}
+
+// zero len bytes at off by punching a hole, or by writing zeros where that is not supported
+static int storage_zero(off_t off, long len) {
+    if (can_punch && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) return 0;
+    if (can_punch) Warn("disk: cannot punch holes, writing zeros instead");
+    can_punch = 0;
+    char zero[BLOCKSIZE] = {0};
+    for (long done = 0; done < len; done += BLOCKSIZE) {
+        if (storage_io(zero, off + done, len - done < BLOCKSIZE ? len - done : BLOCKSIZE, 1) != 0) return -1;
+    }
+    return 0;
+}
+
+// storage_write on the ring: the data runs and the holes between them go out as one batch
+static int uring_write(const char *data, off_t off, long len) {
+    uring_io ios[MAX_RANGE];
+    int n = 0;
+    for (long done = 0; done < len; done += BLOCKSIZE) {
+        int op = can_punch && all_zero(data + done, BLOCKSIZE) ? URING_PUNCH : URING_WRITE;
+        if (n > 0 && ios[n - 1].op == op) {
+            ios[n - 1].len += BLOCKSIZE; // the sectors before were the same kind, extend their run
+            continue;
+        }
+        ios[n++] = (uring_io){.op = op, .fd = fd, .buf = (char *)data + done, .len = BLOCKSIZE, .off = off + done};
+    }
+    if (uring_batch(ios, n, off, len) == 0) return 0;
+    for (int i = 0; i < n; i++) {
+        if (ios[i].res >= 0) continue;
+        // a hole the file system would not punch goes through storage_zero, which writes zeros
+        if (ios[i].op != URING_PUNCH || storage_zero(ios[i].off, ios[i].len) != 0) {
+            Error("disk: uring write failed at %lld", (long long)ios[i].off);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// write data, sectors that are entirely zero become holes
+static int storage_write(const char *data, off_t off, long len) {
+    if (engine == DISK_ENGINE_URING && uring_ready() && len <= MAX_RANGE * BLOCKSIZE) {
+        return uring_write(data, off, len);
+    }
+    long run = 0; // zero sectors in a row not yet punched
+    for (long done = 0; done < len; done += BLOCKSIZE) {
+        if (can_punch && all_zero(data + done, BLOCKSIZE)) {
+            run++;
+            continue;
+        }
+        if (run && storage_zero(off + done - run * BLOCKSIZE, run * BLOCKSIZE) != 0) return -1;
+        run = 0;
+        if (storage_io((char *)data + done, off + done, BLOCKSIZE, 1) != 0) return -1;
+    }
+    if (run) return storage_zero(off + len - run * BLOCKSIZE, run * BLOCKSIZE);
+    return 0;
+}
+
+int set_disk_engine(int e) {
+    if (e != DISK_ENGINE_MAP && e != DISK_ENGINE_PREAD && e != DISK_ENGINE_URING) return 1;
+    if (fd >= 0) {
+        Log("The engine of an open disk cannot change");
+        return 1;
+    }
+    engine = e;
+    return 0;
+}
+
+int set_disk_direct(int on) {
+    if (fd >= 0) {
+        Log("O_DIRECT cannot change on an open disk");
+        return 1;
+    }
+    want_direct = on;
+    return 0;
+}
+
+int disk_engine(void) {
+    return engine;
+}
+
+// when set, the cmd functions do not sleep and the caller charges disk_last_delay_us itself
+static int defer_delay = 0;
+
+/*
+ * Timing model. A seek costs settle_us plus ttd per cylinder, then the head
+ * waits for the target sector to come round (the platter angle follows the
+ * simulated clock) and transfers count sectors at the media rate, or at
+ * xfer_kbs when given. Reads fill a track cache of whole cylinders, a read
+ * served from it costs only the transfer. All of it is protected by timing_lock.
+ */
+static disk_timing timing;
+static disk_timing_stat tstat; // tstat.clock_us is the simulated clock
+static int *cache_cyl = NULL;   // cached cylinders, -1 for an empty entry
+static long *cache_used = NULL; // LRU stamps
+static long cache_stamp = 0;
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long last_delay_us = 0;
+
+static void reset_timing(void) {
+    memset(&tstat, 0, sizeof(tstat));
+    for (int i = 0; i < timing.track_cache; i++) cache_cyl[i] = -1;
+}
+
+int set_disk_timing(const disk_timing *t) {
+    if (t->rpm < 0 || t->settle_us < 0 || t->xfer_kbs < 0 || t->track_cache < 0) {
+        Log("Invalid disk timing");
+        return 1;
+    }
+    pthread_mutex_lock(&timing_lock);
+    timing = *t;
+    cache_cyl = realloc(cache_cyl, (t->track_cache + 1) * sizeof(int));
+    cache_used = realloc(cache_used, (t->track_cache + 1) * sizeof(long));
+    reset_timing();
+    pthread_mutex_unlock(&timing_lock);
+    Log("Disk timing: %d rpm, settle %d us, transfer %d KB/s, %d cached tracks, %s clock", t->rpm,
+        t->settle_us, t->xfer_kbs, t->track_cache, t->virtual_clock ? "virtual" : "real");
+    return 0;
+}
+
+void get_disk_timing(disk_timing *t, disk_timing_stat *st) {
+    pthread_mutex_lock(&timing_lock);
+    if (t) *t = timing;
+    if (st) *st = tstat;
+    pthread_mutex_unlock(&timing_lock);
+}
+
+// the cache slot holding cyl, or -1, caller holds timing_lock
+static int cache_find(int cyl) {
+    for (int i = 0; i < timing.track_cache; i++) {
+        if (cache_cyl[i] == cyl) return i;
+    }
+    return -1;
+}
+
+static void cache_fill(int cyl) {
+    int slot = cache_find(cyl);
+    if (slot < 0) {
+        slot = 0;
+        for (int i = 1; i < timing.track_cache; i++) {
+            if (cache_used[i] < cache_used[slot]) slot = i;
+        }
+        cache_cyl[slot] = cyl;
+    }
+    cache_used[slot] = ++cache_stamp;
+}
+
+// service time of count sectors at (cyl, sec) with the head coming from cylinder from
+static long service_time(int from, int cyl, int sec, int count, int write) {
+    int endCyl = (cyl * _nsec + sec + count - 1) / _nsec;
+    pthread_mutex_lock(&timing_lock);
+    long rev_us = timing.rpm ? 60000000L / timing.rpm : 0;
+    long sec_us = timing.xfer_kbs ? (long)BLOCKSIZE * 1000000 / (timing.xfer_kbs * 1024L) : rev_us / _nsec;
+    long seek = 0, rot = 0, xfer = 0;
+
+    int hit = !write && timing.track_cache > 0;
+    for (int c = cyl; hit && c <= endCyl; c++) hit = cache_find(c) >= 0;
+    if (hit) {
+        // served from the track cache at the interface rate, the head does not move
+        xfer = timing.xfer_kbs ? count * sec_us : 0;
+        tstat.cache_hits++;
+    } else {
+        if (from != cyl) seek = timing.settle_us + (long)ttd * abs(from - cyl);
+        seek += (long)ttd * (endCyl - cyl); // track-to-track while streaming a range
+        if (rev_us) {
+            // wait for the start of sec to reach the head once the seek is over
+            long angle = (tstat.clock_us + seek) % rev_us;
+            rot = ((long)sec * rev_us / _nsec - angle + rev_us) % rev_us;
+        }
+        xfer = count * sec_us;
+        for (int c = cyl; !write && timing.track_cache > 0 && c <= endCyl; c++) cache_fill(c);
+    }
+    long cost = seek + rot + xfer;
+    tstat.accesses++;
+    tstat.seek_us += seek;
+    tstat.rot_us += rot;
+    tstat.xfer_us += xfer;
+    tstat.clock_us += cost;
+    int virt = timing.virtual_clock;
+    pthread_mutex_unlock(&timing_lock);
+    return virt ? 0 : cost;
+}
+
+// move the head for an access, the seek is charged from wherever the previous request left it
+static void access_disk(int cyl, int sec, int count, int write) {
+    int endCyl = (cyl * _nsec + sec + count - 1) / _nsec;
+    int from = __atomic_exchange_n(&lastCyl, endCyl, __ATOMIC_ACQ_REL);
+    last_delay_us = service_time(from, cyl, sec, count, write);
+    if (__atomic_load_n(&defer_delay, __ATOMIC_RELAXED) || last_delay_us == 0) return;
+    usleep(last_delay_us);
+}
+
+void disk_defer_delay(int on) {
+    __atomic_store_n(&defer_delay, on, __ATOMIC_RELAXED);
+}
+
+long disk_last_delay_us(void) {
+    return last_delay_us;
+}
+
+int init_disk(char *filename, int ncyl, int nsec, int _ttd) {
+    if (fd >= 0) close_disk(); // reopening, let go of the old image first
     _ncyl = ncyl;
     _nsec = nsec;
-    ttd = ttd;
-    lastCyl = 0;
-    FILE_SIZE = ncyl * nsec * BLOCKSIZE;
-    int fd = open(filename , O_RDWR | O_CREAT, 0644);
+    ttd = _ttd;
+    __atomic_store_n(&lastCyl, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&timing_lock);
+    reset_timing(); // a new platter, nothing cached and the clock starts over
+    pthread_mutex_unlock(&timing_lock);
+    FILE_SIZE = (off_t)ncyl * nsec * BLOCKSIZE;
+    if (engine == DISK_ENGINE_URING && uring_init(2 * MAX_RANGE) != 0) {
+        Warn("disk: no io_uring, using the pread engine");
+        engine = DISK_ENGINE_PREAD;
+    }
+    direct = engine == DISK_ENGINE_URING && want_direct;
+    fd = open(filename , O_RDWR | O_CREAT | (direct ? O_DIRECT : 0), 0644);
+    if (fd == -1 && direct) {
+        Warn("disk: %s cannot be opened with O_DIRECT, going through the page cache", filename);
+        direct = 0;
+        fd = open(filename, O_RDWR | O_CREAT, 0644);
+    }
     if(fd == -1){
         Log("Error opening file");
-        close(fd);
         return -1;
     }
     // open file
-    int result = lseek(fd, FILE_SIZE - 1, SEEK_SET); // expand the file to the size of the disk
-    if(result == -1){
-        Log("error when stretching file with lseek\n");
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size < FILE_SIZE && ftruncate(fd, FILE_SIZE) == -1)) {
+        Log("error when stretching file\n");
         close(fd);
+        fd = -1;
         return -1;
     }
-    
-    result = write(fd, "", 1); // write a byte at the end of the file
-    if(result < 0){
-        Log("error when writing to file at the begining\n");
-        close(fd);
-        return -1;
+    // stretch the file, the new part is a hole that takes no space
+
+    if (direct) {
+        // O_DIRECT needs sector-sized transfers at least as large as the device's logical block
+        char *probe = NULL;
+        if (posix_memalign((void **)&probe, DIRECT_ALIGN, BLOCKSIZE) != 0 || pread(fd, probe, BLOCKSIZE, 0) != BLOCKSIZE) {
+            Warn("disk: %s takes no %d byte O_DIRECT transfers, going through the page cache", filename, BLOCKSIZE);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            direct = 0;
+        }
+        free(probe);
     }
-    // stretch the file
 
-    diskFile = mmap(NULL,FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(diskFile == MAP_FAILED){
-        Log("error when mapping file to memory\n");
-        close(fd);
-        return -1;
+    if (engine == DISK_ENGINE_MAP) {
+        nregions = (FILE_SIZE + REGION_SIZE - 1) >> REGION_SHIFT;
+        regions = calloc(nregions, sizeof(char *));
     }
-    // mmap
+    can_punch = 1;
+    // regions are mapped when first touched
 
-    Log("Disk initialized: %s, %d Cylinders, %d Sectors per cylinder", filename, ncyl, nsec);
+    Log("Disk initialized: %s, %d Cylinders, %d Sectors per cylinder, %s engine%s", filename, ncyl, nsec,
+        engine_names[engine], direct ? " with O_DIRECT" : "");
     return 0;
 }
 
-// all cmd functions return 0 on success
+/*
+ * All cmd functions return 0 on success. The BDS runs them one at a time on
+ * the scheduler's dispatcher thread, so they take no lock over the data; the
+ * mapping, the head, the timing and the sync state stay safe to share, and a
+ * caller that drives the disk from several threads itself must keep them on
+ * different sectors.
+ */
 int cmd_i(int *ncyl, int *nsec) {
     // get the disk info
     *ncyl = _ncyl;
@@ -63,20 +420,24 @@ int cmd_i(int *ncyl, int *nsec) {
     return 0;
 }
 
+// cylinder the head is resting on
+int disk_head(void) {
+    return __atomic_load_n(&lastCyl, __ATOMIC_ACQUIRE);
+}
+
 int cmd_r(int cyl, int sec, char *buf) {
     // read data from disk, store it in buf
     if (cyl >= _ncyl || sec >= _nsec || cyl < 0 || sec < 0) {
         Log("Invalid cylinder or sector");
         return 1;
     }
-    int start = (cyl * _nsec + sec) ;
-    if (start*BLOCKSIZE + BLOCKSIZE > FILE_SIZE) {
+    off_t start = ((off_t)cyl * _nsec + sec) * BLOCKSIZE;
+    if (start + BLOCKSIZE > FILE_SIZE) {
         Log("Invalid read");
         return 1; //read a block each time
     }
-    memcpy(buf, diskFile + start*BLOCKSIZE, BLOCKSIZE);
-    diskDelay(lastCyl, cyl); // simulate the delay between cylinders
-    lastCyl = cyl; // update the last cylinder accessed
+    if (storage_io(buf, start, BLOCKSIZE, 0) != 0) return 1;
+    access_disk(cyl, sec, 1, 0); // simulate the delay between cylinders
 
     return 0;
 }
@@ -105,43 +466,196 @@ int cmd_w(int cyl, int sec, int len, char *data) {
         }
     }
 
-    int start = cyl * _nsec + sec;
-    memcpy(diskFile + start*BLOCKSIZE, buf, BLOCKSIZE);
-    if(diskFile){
-        int FILE_SIZE = _ncyl * _nsec * BLOCKSIZE;
-        int res = msync(diskFile, FILE_SIZE, MS_SYNC| MS_INVALIDATE);
-        if(res < 0){
-            Error("disk: cmd_w: error when syncing data to disk");
-            free(buf);
-            return -1;
-        }
+    off_t start = ((off_t)cyl * _nsec + sec) * BLOCKSIZE;
+    if(storage_write(buf, start, BLOCKSIZE) != 0 || disk_written(start, BLOCKSIZE) < 0){
+        free(buf);
+        return -1;
     }
     
     free(buf);
     // write data to disk
 
-    diskDelay(lastCyl, cyl); // simulate the delay between cylinders
-    lastCyl = cyl; // update the last cylinder accessed
+    access_disk(cyl, sec, 1, 1); // simulate the delay between cylinders
+    return 0;
+}
+
+// check that count sectors starting at (cyl, sec) lie on the disk, at most max of them
+static int range_ok(int cyl, int sec, int count, int max) {
+    if (cyl >= _ncyl || sec >= _nsec || cyl < 0 || sec < 0) {
+        Log("Invalid cylinder or sector");
+        return 0;
+    }
+    if (count <= 0 || count > max) {
+        Log("Invalid sector count %d", count);
+        return 0;
+    }
+    if (((off_t)cyl * _nsec + sec + count) * BLOCKSIZE > FILE_SIZE) {
+        Log("Range runs past the end of disk");
+        return 0;
+    }
+    return 1;
+}
+
+int cmd_rr(int cyl, int sec, int count, char *buf) {
+    // read count consecutive sectors, wrapping onto the following cylinders
+    if (!range_ok(cyl, sec, count, MAX_RANGE)) return 1;
+    long start = (long)cyl * _nsec + sec;
+    if (storage_io(buf, start * BLOCKSIZE, (long)count * BLOCKSIZE, 0) != 0) return 1;
+
+    access_disk(cyl, sec, count, 0);
+    return 0;
+}
+
+int cmd_wr(int cyl, int sec, int count, char *data) {
+    if (!range_ok(cyl, sec, count, MAX_RANGE)) return 1;
+    long start = (long)cyl * _nsec + sec;
+    if(storage_write(data, start * BLOCKSIZE, (long)count * BLOCKSIZE) != 0 || disk_written(start * BLOCKSIZE, (long)count * BLOCKSIZE) < 0) return -1;
+
+    access_disk(cyl, sec, count, 1);
+    return 0;
+}
+
+int cmd_d(int cyl, int sec, int count) {
+    // no data moves, so a discard is bounded by the protocol rather than by MAX_RANGE
+    if (!range_ok(cyl, sec, count, BDS_MAX_DISCARD)) return 1;
+    long start = (long)cyl * _nsec + sec;
+    if(storage_zero(start * BLOCKSIZE, (long)count * BLOCKSIZE) != 0 || disk_written(start * BLOCKSIZE, (long)count * BLOCKSIZE) < 0) return -1;
+
+    last_delay_us = 0; // only the mapping changes, the head stays where it is
+    return 0;
+}
+
+static long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// msync [lo, hi) rounded out to whole pages, caller holds sync_lock
+static int sync_range(long lo, long hi) {
+    long page = sysconf(_SC_PAGESIZE);
+    lo = lo / page * page;
+    hi = (hi + page - 1) / page * page;
+    if (hi > FILE_SIZE) hi = FILE_SIZE;
+    if (lo >= hi) return 0;
+    if (engine != DISK_ENGINE_MAP) return fdatasync(fd);
+    int res = 0;
+    for (long idx = lo >> REGION_SHIFT; idx <= (hi - 1) >> REGION_SHIFT; idx++) {
+        char *p = __atomic_load_n(&regions[idx], __ATOMIC_ACQUIRE);
+        if (!p) continue; // never mapped, nothing written through it
+        off_t base = (off_t)idx << REGION_SHIFT;
+        long from = lo > base ? lo - base : 0;
+        long to = hi - base < region_len(idx) ? hi - base : region_len(idx);
+        if (msync(p + from, to - from, MS_SYNC) < 0) res = -1;
+    }
+    return res;
+}
+
+// write back everything written since the last sync, caller holds sync_lock
+static int sync_dirty(void) {
+    int res = 0;
+    if (dirty_lo >= 0) res = sync_range(dirty_lo, dirty_hi);
+    dirty_lo = dirty_hi = -1;
+    pending_writes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    return res;
+}
+
+// called after len bytes at off have been copied into the mapping
+static int disk_written(long off, long len) {
+    int res = 0;
+    pthread_mutex_lock(&sync_lock);
+    switch (sync_mode) {
+        case SYNC_FULL:
+            res = sync_range(0, FILE_SIZE);
+            break;
+        case SYNC_RANGE:
+            res = sync_range(off, off + len);
+            break;
+        default:
+            if (dirty_lo < 0 || off < dirty_lo) dirty_lo = off;
+            if (off + len > dirty_hi) dirty_hi = off + len;
+            pending_writes++;
+            if (sync_mode == SYNC_GROUP &&
+                (pending_writes >= group_writes || elapsed_ms(&last_sync) >= group_ms)) {
+                res = sync_dirty();
+            }
+            break;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    if (res < 0) Error("disk: error when syncing data to disk");
+    return res;
+}
+
+// group commit also has to cover writes that are followed by silence
+static void *flusher_main(void *arg) {
+    while (1) {
+        usleep(group_ms * 1000);
+        pthread_mutex_lock(&sync_lock);
+        if (!flusher_running) {
+            pthread_mutex_unlock(&sync_lock);
+            break;
+        }
+        if (dirty_lo >= 0 && elapsed_ms(&last_sync) >= group_ms) sync_dirty();
+        pthread_mutex_unlock(&sync_lock);
+    }
+    return NULL;
+}
+
+static void stop_flusher(void) {
+    pthread_mutex_lock(&sync_lock);
+    int running = flusher_running;
+    flusher_running = 0;
+    pthread_mutex_unlock(&sync_lock);
+    if (running) pthread_join(flusher, NULL);
+}
+
+int set_sync_mode(int mode, int ms, int writes) {
+    if (mode < SYNC_FULL || mode > SYNC_ASYNC || ms <= 0 || writes <= 0) {
+        Log("Invalid sync mode %d (%d ms, %d writes)", mode, ms, writes);
+        return 1;
+    }
+    stop_flusher();
+    pthread_mutex_lock(&sync_lock);
+    if (fd >= 0) sync_dirty(); // nothing written under the old mode stays unsynced
+    sync_mode = mode;
+    group_ms = ms;
+    group_writes = writes;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    if (mode == SYNC_GROUP) {
+        flusher_running = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    Log("Sync mode %d, group commit every %d ms / %d writes", mode, ms, writes);
+    return 0;
+}
+
+// flush/barrier: every write acknowledged before this call is on stable storage after it
+int cmd_flush(void) {
+    pthread_mutex_lock(&sync_lock);
+    int res = sync_dirty();
+    pthread_mutex_unlock(&sync_lock);
+    if (res < 0) {
+        Error("disk: cmd_flush: error when syncing data to disk");
+        return 1;
+    }
     return 0;
 }
 
 void close_disk(void) {
-    close(fd);
-    if (diskFile != NULL) {
-        munmap(diskFile, FILE_SIZE); // unmap the file
-        diskFile = NULL;
+    stop_flusher();
+    if (fd >= 0) cmd_flush();
+    for (long idx = 0; idx < nregions; idx++) {
+        if (regions[idx]) munmap(regions[idx], region_len(idx)); // unmap the file
     }
+    free(regions);
+    regions = NULL;
+    nregions = 0;
+    if (fd >= 0) close(fd);
+    uring_exit();
+    direct = 0;
     fd = -1; // set fd to -1 to indicate that the file is closed
     FILE_SIZE = 0; // set FILE_SIZE to 0 to indicate that the file is closed
     Log("Disk closed");
     // close the file
 }
-
-void diskDelay(int c1, int c2){ // simulating the delay between cylinders
-    int delay = ttd * abs(c1 - c2);
-    usleep(delay);
-    if(delay > 0){
-        fprintf(stderr, "Disk delay: %d microseconds\n", delay);        
-    }
-
-}
\ No newline at end of file
@@ -0,0 +1,304 @@
+#include "../include/disk_sched.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/disk.h"
+#include "../include/timerq.h"
+#include "../../include/log.h"
+
+#define DEADLINE_MS 100 // a request queued for longer than this is served next under SCHED_DEADLINE
+
+static const char *policy_names[SCHED_NPOLICY] = {"fcfs", "sstf", "scan", "cscan", "deadline"};
+
+// pending requests in arrival order, protected by lock
+static disk_req *head_req = NULL, *tail_req = NULL;
+static int queued = 0;
+static disk_req **pickq = NULL;  // scratch array handed to sched_pick
+static int pickq_cap = 0;
+
+static int policy = SCHED_FCFS;
+static int sweep_dir = 1;
+static sched_stat stats[SCHED_NPOLICY];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t dispatcher;
+static int running = 0;
+static struct timespec busy_until;  // when the head finishes the access in flight
+
+const char *sched_policy_name(int p) {
+    if (p < 0 || p >= SCHED_NPOLICY) return "unknown";
+    return policy_names[p];
+}
+
+int sched_policy_from_name(const char *name) {
+    for (int i = 0; i < SCHED_NPOLICY; i++) {
+        if (strcmp(name, policy_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// nearest request at or above head, or -1
+static int pick_up(disk_req **q, int n, int head) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+        if (q[i]->cyl >= head && (best < 0 || q[i]->cyl < q[best]->cyl)) best = i;
+    }
+    return best;
+}
+
+// nearest request at or below head, or -1
+static int pick_down(disk_req **q, int n, int head) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+        if (q[i]->cyl <= head && (best < 0 || q[i]->cyl > q[best]->cyl)) best = i;
+    }
+    return best;
+}
+
+int sched_pick(int p, disk_req **q, int n, int head, int *dir, const struct timespec *now) {
+    // q is in arrival order, so ties always go to the older request
+    int best = 0;
+    switch (p) {
+        case SCHED_SSTF:
+            for (int i = 1; i < n; i++) {
+                if (abs(q[i]->cyl - head) < abs(q[best]->cyl - head)) best = i;
+            }
+            return best;
+        case SCHED_SCAN:
+            best = *dir > 0 ? pick_up(q, n, head) : pick_down(q, n, head);
+            if (best < 0) {
+                *dir = -*dir; // nothing left in this direction, turn around
+                best = *dir > 0 ? pick_up(q, n, head) : pick_down(q, n, head);
+            }
+            return best;
+        case SCHED_DEADLINE:
+            if (timespec_diff_us(&q[0]->arrival, now) >= DEADLINE_MS * 1000) return 0;
+            // fall through
+        case SCHED_CSCAN:
+            *dir = 1;
+            best = pick_up(q, n, head);
+            if (best < 0) best = pick_up(q, n, 0); // jump back to the lowest cylinder
+            return best;
+        default:
+            return 0;
+    }
+}
+
+static void execute(disk_req *r) {
+    if (r->op == DREQ_READ) {
+        r->result = r->count == 1 ? cmd_r(r->cyl, r->sec, r->buf)
+                                  : cmd_rr(r->cyl, r->sec, r->count, r->buf);
+    } else if (r->op == DREQ_DISCARD) {
+        r->result = cmd_d(r->cyl, r->sec, r->count);
+    } else {
+        r->result = r->count == 1 ? cmd_w(r->cyl, r->sec, r->len, r->buf)
+                                  : cmd_wr(r->cyl, r->sec, r->count, r->buf);
+    }
+}
+
+// account for r and return the simulated service time of the access, called with lock held
+static long serve(disk_req *r, int p) {
+    int from = disk_head();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_unlock(&lock);
+    execute(r);
+    pthread_mutex_lock(&lock);
+    if (r->result != 0 || r->op == DREQ_DISCARD) return 0; // a discard does not move the head
+
+    int to = disk_head();
+    long wait = timespec_diff_us(&r->arrival, &now);
+    stats[p].requests++;
+    stats[p].seek_distance += abs(r->cyl - from) + abs(to - r->cyl);
+    stats[p].wait_us += wait;
+    if (wait > stats[p].max_wait_us) stats[p].max_wait_us = wait;
+    return disk_last_delay_us(); // executed on this thread
+}
+
+static void complete(void *arg) {
+    disk_req *r = arg;
+    r->done(r);
+}
+
+static void *dispatch_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (running && queued == 0) pthread_cond_wait(&queued_cond, &lock);
+        if (!running) break;
+
+        // the head is still busy with the previous access, keep collecting requests until it is free
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec_diff_us(&now, &busy_until) > 0) {
+            pthread_cond_timedwait(&queued_cond, &lock, &busy_until);
+            continue;
+        }
+
+        if (queued > pickq_cap) {
+            pickq_cap = queued * 2;
+            pickq = realloc(pickq, pickq_cap * sizeof(disk_req *));
+        }
+        int n = 0;
+        for (disk_req *r = head_req; r; r = r->next) pickq[n++] = r;
+        disk_req *r = pickq[sched_pick(policy, pickq, n, disk_head(), &sweep_dir, &now)];
+
+        // unlink r
+        disk_req **pp = &head_req, *prev = NULL;
+        while (*pp != r) {
+            prev = *pp;
+            pp = &(*pp)->next;
+        }
+        *pp = r->next;
+        if (tail_req == r) tail_req = prev;
+        queued--;
+
+        // the data moves now, the completion is reported once the simulated seek is over
+        long cost = serve(r, policy);
+        busy_until = now;
+        timespec_add_us(&busy_until, cost);
+        pthread_mutex_unlock(&lock);
+        if (cost > 0) timerq_add(&busy_until, complete, r);
+        else complete(r);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int sched_init(int p) {
+    if (sched_set_policy(p) != 0) return 1;
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        // the dispatcher sleeps until an absolute CLOCK_MONOTONIC time
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_destroy(&queued_cond);
+        pthread_cond_init(&queued_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        clock_gettime(CLOCK_MONOTONIC, &busy_until);
+
+        running = timerq_start() == 0 &&
+                  pthread_create(&dispatcher, NULL, dispatch_main, NULL) == 0;
+        if (!running) {
+            pthread_mutex_unlock(&lock);
+            timerq_stop();
+            Error("sched: cannot start the dispatcher");
+            return 1;
+        }
+        disk_defer_delay(1);
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void sched_stop() {
+    pthread_mutex_lock(&lock);
+    int was_running = running;
+    running = 0;
+    pthread_cond_broadcast(&queued_cond);
+    pthread_mutex_unlock(&lock);
+    if (was_running) pthread_join(dispatcher, NULL);
+
+    // nobody is left to serve what is still queued
+    pthread_mutex_lock(&lock);
+    disk_req *r = head_req;
+    head_req = tail_req = NULL;
+    queued = 0;
+    free(pickq);
+    pickq = NULL;
+    pickq_cap = 0;
+    pthread_mutex_unlock(&lock);
+    while (r) {
+        disk_req *next = r->next;
+        r->result = 1;
+        r->done(r);
+        r = next;
+    }
+    timerq_stop(); // fires the completions still waiting for their seek
+    disk_defer_delay(0);
+}
+
+int sched_set_policy(int p) {
+    if (p < 0 || p >= SCHED_NPOLICY) {
+        Log("Invalid scheduling policy %d", p);
+        return 1;
+    }
+    pthread_mutex_lock(&lock);
+    policy = p;
+    sweep_dir = 1;
+    pthread_mutex_unlock(&lock);
+    Log("Scheduling policy: %s", policy_names[p]);
+    return 0;
+}
+
+int sched_policy() {
+    pthread_mutex_lock(&lock);
+    int p = policy;
+    pthread_mutex_unlock(&lock);
+    return p;
+}
+
+void sched_submit(disk_req *reqs, int n) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < n; i++) {
+        disk_req *r = &reqs[i];
+        r->arrival = now;
+        r->finished = 0;
+        r->result = 0;
+        r->next = NULL;
+        if (!running) {
+            serve(r, policy); // no dispatcher (e.g. tests or BDS_local), the disk sleeps in place
+            pthread_mutex_unlock(&lock);
+            r->done(r);
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+        if (tail_req) tail_req->next = r;
+        else head_req = r;
+        tail_req = r;
+        queued++;
+    }
+    pthread_cond_signal(&queued_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static void run_done(disk_req *r) {
+    pthread_mutex_lock(&lock);
+    r->finished = 1;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+int sched_run(disk_req *reqs, int n) {
+    int res = 0;
+    for (int i = 0; i < n; i++) reqs[i].done = run_done;
+    sched_submit(reqs, n);
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < n; i++) {
+        while (!reqs[i].finished) pthread_cond_wait(&done_cond, &lock);
+        if (reqs[i].result != 0) res = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void sched_get_stats(int p, sched_stat *out) {
+    memset(out, 0, sizeof(*out));
+    if (p < 0 || p >= SCHED_NPOLICY) return;
+    pthread_mutex_lock(&lock);
+    *out = stats[p];
+    pthread_mutex_unlock(&lock);
+}
+
+void sched_reset_stats() {
+    pthread_mutex_lock(&lock);
+    memset(stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&lock);
+}
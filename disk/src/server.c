@@ -1,21 +1,28 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <unistd.h>
 #include "assert.h"
 #include "../include/disk.h"
+#include "../include/disk_sched.h"
 #include "../../include/log.h"
 #include "../../include/tcp_utils.h"
+#include "../../include/bds_proto.h"
+#include <arpa/inet.h>
 
 #define ARG_MAX 16
 
+// handlers run on several worker threads, so tokenizing must not keep static state
 int parse(char *line, char *cmd[], int argc) {
-    char *p = strtok(line, " ");
+    char *save;
+    char *p = strtok_r(line, " ", &save);
     int idx = 0;
     while (p) {
         cmd[idx++] = p;
         if (idx == argc) break;
-        p = strtok(NULL, " ");
+        p = strtok_r(NULL, " ", &save);
     }
     return idx == argc;
 }
@@ -27,11 +34,145 @@ int string_to_dec(char *str, int *num) {
     return *endptr == '\0';
 }
 
-int handle_i(tcp_buffer *wb, char *args, int len) {
+static tcp_server server;
+
+#define RESP_ROOM 16 // room for the reply header in front of the data
+
+// a client request travelling through the scheduler, its reply is sent from the completion
+typedef struct io_ctx {
+    int id;
+    int binary;
+    uint32_t tag;
+    int nreq, pending, failed;
+    int reply_len;  // bytes of data in a successful reply
+    struct io_ctx *next;
+    disk_req reqs[MAX_RANGE];
+    char frame[RESP_ROOM + MAX_RANGE * BLOCKSIZE];  // data starts at RESP_ROOM
+} io_ctx;
+
+// per-connection count of requests in flight, flushes wait for it to drop to zero
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int inflight;
+    io_ctx *flushes;
+} conns[FD_SETSIZE];
+
+static void send_reply(io_ctx *c, int ok) {
+    char *data = c->frame + RESP_ROOM;
+    int len = ok ? c->reply_len : 0;
+    if (c->binary) {
+        bds_resp_hdr resp = {
+            .magic = BDS_MAGIC,
+            .status = ok ? BDS_OK : BDS_EIO,
+            .flags = 0,
+            .tag = htonl(c->tag),
+            .len = htonl(len),
+        };
+        memcpy(data - sizeof(resp), &resp, sizeof(resp));
+        server_send(server, c->id, data - sizeof(resp), sizeof(resp) + len);
+    } else if (ok) {
+        memcpy(data - 4, "Yes ", 4);
+        server_send(server, c->id, data - 4, 4 + len);
+    } else {
+        server_send(server, c->id, "No ", 3);
+    }
+}
+
+static void finish_flushes(io_ctx *f) {
+    while (f) {
+        io_ctx *next = f->next;
+        send_reply(f, cmd_flush() == 0);
+        free(f);
+        f = next;
+    }
+}
+
+static void conn_done(int id) {
+    pthread_mutex_lock(&conns[id].lock);
+    io_ctx *flushes = NULL;
+    if (--conns[id].inflight == 0) {
+        flushes = conns[id].flushes;
+        conns[id].flushes = NULL;
+        pthread_cond_broadcast(&conns[id].idle);
+    }
+    pthread_mutex_unlock(&conns[id].lock);
+    finish_flushes(flushes);
+}
+
+static void req_done(disk_req *r) {
+    io_ctx *c = r->arg;
+    if (r->result != 0) __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+    if (__atomic_sub_fetch(&c->pending, 1, __ATOMIC_ACQ_REL) > 0) return;
+    int id = c->id;
+    send_reply(c, !__atomic_load_n(&c->failed, __ATOMIC_RELAXED));
+    free(c);
+    conn_done(id);
+}
+
+/*
+ * Queue nreq requests of count sectors each and return without waiting. For a
+ * single sector len is the number of bytes written, the data of writes is
+ * copied out of the read buffer since it is recycled once on_recv returns.
+ */
+static void start_io(int id, int binary, uint32_t tag, int op, int nreq, const int *cyl,
+                     const int *sec, int count, int len, const char *payload) {
+    io_ctx *c = malloc(sizeof(io_ctx));
+    c->id = id;
+    c->binary = binary;
+    c->tag = tag;
+    c->nreq = c->pending = nreq;
+    c->failed = 0;
+    char *data = c->frame + RESP_ROOM;
+    int bytes = count == 1 ? (nreq - 1) * BLOCKSIZE + len : count * BLOCKSIZE;
+    c->reply_len = op == DREQ_READ ? bytes : 0;
+    if (op == DREQ_WRITE) memcpy(data, payload, bytes);
+    for (int i = 0; i < nreq; i++) {
+        c->reqs[i] = (disk_req){.op = op, .cyl = cyl[i], .sec = sec[i], .count = count,
+                                .len = count == 1 ? (i == nreq - 1 ? len : BLOCKSIZE) : count * BLOCKSIZE,
+                                .buf = data + i * count * BLOCKSIZE, .done = req_done, .arg = c};
+    }
+    pthread_mutex_lock(&conns[id].lock);
+    conns[id].inflight++;
+    pthread_mutex_unlock(&conns[id].lock);
+    sched_submit(c->reqs, nreq);
+}
+
+// a flush is answered once every request of the connection queued before it has completed.
+// With nothing in flight it is answered into wb: on_recv holds the write lock, so
+// server_send from here would wait on ourselves
+static void start_flush(int id, tcp_buffer *wb, int binary, uint32_t tag) {
+    pthread_mutex_lock(&conns[id].lock);
+    if (conns[id].inflight > 0) {
+        io_ctx *c = malloc(sizeof(io_ctx));
+        c->id = id;
+        c->binary = binary;
+        c->tag = tag;
+        c->reply_len = 0;
+        c->next = conns[id].flushes;
+        conns[id].flushes = c;
+        pthread_mutex_unlock(&conns[id].lock);
+        return;
+    }
+    pthread_mutex_unlock(&conns[id].lock);
+
+    int ok = cmd_flush() == 0;
+    if (binary) {
+        bds_resp_hdr resp = {.magic = BDS_MAGIC, .status = ok ? BDS_OK : BDS_EIO, .flags = 0,
+                             .tag = htonl(tag), .len = 0};
+        buffer_append(wb, (char *)&resp, sizeof(resp));
+    } else if (ok) {
+        reply_with_yes(wb, NULL, 0);
+    } else {
+        reply_with_no(wb, NULL, 0);
+    }
+}
+
+int handle_i(int id, tcp_buffer *wb, char *args, int len) {
     Log("Info command");
     int ncyl, nsec;
     cmd_i(&ncyl, &nsec);
-    static char buf[64];
+    char buf[64];
     sprintf(buf, "%d %d", ncyl, nsec);
 
     // including the null terminator
@@ -39,7 +180,7 @@ int handle_i(tcp_buffer *wb, char *args, int len) {
     return 0;
 }
 
-int handle_r(tcp_buffer *wb, char *args, int len) {
+int handle_r(int id, tcp_buffer *wb, char *args, int len) {
     Log("Read command");
     char *cmd[ARG_MAX];
     memset(cmd, 0, sizeof(cmd));
@@ -54,18 +195,11 @@ int handle_r(tcp_buffer *wb, char *args, int len) {
     if (!(string_to_dec(cmd[0], &cyl) && string_to_dec(cmd[1], &sec))) {
         return 0;
     }
-    char buf[512];
-
-    if (cmd_r(cyl, sec, buf) == 0) {
-        printf("read\n");
-        reply_with_yes(wb, buf, 512);
-    } else {
-        reply_with_no(wb, NULL, 0);
-    }
+    start_io(id, 0, 0, DREQ_READ, 1, &cyl, &sec, 1, BLOCKSIZE, NULL);
     return 0;
 }
 
-int handle_w(tcp_buffer *wb, char *args, int len) {
+int handle_w(int id, tcp_buffer *wb, char *args, int len) {
     Log("Write command");
     char *cmd[ARG_MAX];
     memset(cmd, 0, sizeof(cmd));
@@ -82,17 +216,246 @@ int handle_w(tcp_buffer *wb, char *args, int len) {
         return 0;
     }
     char *data = cmd[2] + strlen(cmd[2]) + 1;
+    if (datalen < 0 || datalen > BLOCKSIZE) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    start_io(id, 0, 0, DREQ_WRITE, 1, &cyl, &sec, 1, datalen, data);
+    return 0;
+}
 
-    if (cmd_w(cyl, sec, datalen, data) == 0) {
-        printf("write\n");
-        reply_with_yes(wb, NULL, 0);
-    } else {
+// RR cyl sec n: read n consecutive sectors
+int handle_rr(int id, tcp_buffer *wb, char *args, int len) {
+    Log("Range read command");
+    char *cmd[ARG_MAX];
+    memset(cmd, 0, sizeof(cmd));
+    if (parse(args, cmd, 3) == 0) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    int cyl, sec, n;
+    if (!(string_to_dec(cmd[0], &cyl) && string_to_dec(cmd[1], &sec) && string_to_dec(cmd[2], &n)) ||
+        n <= 0 || n > MAX_RANGE) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    start_io(id, 0, 0, DREQ_READ, 1, &cyl, &sec, n, n * BLOCKSIZE, NULL);
+    return 0;
+}
+
+// WR cyl sec n data: write n consecutive sectors, data is n * BLOCKSIZE bytes
+int handle_wr(int id, tcp_buffer *wb, char *args, int len) {
+    Log("Range write command");
+    char *cmd[ARG_MAX];
+    memset(cmd, 0, sizeof(cmd));
+    if (parse(args, cmd, 3) == 0) {
         reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    int cyl, sec, n;
+    if (!(string_to_dec(cmd[0], &cyl) && string_to_dec(cmd[1], &sec) && string_to_dec(cmd[2], &n))) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    char *data = cmd[2] + strlen(cmd[2]) + 1;
+    if (n <= 0 || n > MAX_RANGE || data + n * BLOCKSIZE > args + len) {
+        Log("Range write: payload shorter than %d sectors", n);
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    start_io(id, 0, 0, DREQ_WRITE, 1, &cyl, &sec, n, n * BLOCKSIZE, data);
+    return 0;
+}
+
+// D cyl sec n: discard n consecutive sectors, they read back as zeros
+int handle_d(int id, tcp_buffer *wb, char *args, int len) {
+    Log("Discard command");
+    char *cmd[ARG_MAX];
+    memset(cmd, 0, sizeof(cmd));
+    if (parse(args, cmd, 3) == 0) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    int cyl, sec, n;
+    if (!(string_to_dec(cmd[0], &cyl) && string_to_dec(cmd[1], &sec) && string_to_dec(cmd[2], &n)) ||
+        n <= 0 || n > BDS_MAX_DISCARD) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
     }
+    start_io(id, 0, 0, DREQ_DISCARD, 1, &cyl, &sec, n, 0, NULL);
     return 0;
 }
 
-int handle_e(tcp_buffer *wb, char *args, int len) {
+// parse "n c0 s0 c1 s1 ..." into cyl/sec arrays, return the position after the list
+static char *parse_vector(char *args, int *n, int *cyl, int *sec) {
+    char *save;
+    char *p = strtok_r(args, " ", &save);
+    if (!p || !string_to_dec(p, n) || *n <= 0 || *n > MAX_RANGE) return NULL;
+    for (int i = 0; i < *n; i++) {
+        char *c = strtok_r(NULL, " ", &save);
+        char *s = c ? strtok_r(NULL, " ", &save) : NULL;
+        if (!s || !string_to_dec(c, &cyl[i]) || !string_to_dec(s, &sec[i])) return NULL;
+        p = s;
+    }
+    return p + strlen(p) + 1;
+}
+
+// RV n c0 s0 c1 s1 ...: gather n arbitrary sectors into one reply
+int handle_rv(int id, tcp_buffer *wb, char *args, int len) {
+    Log("Vector read command");
+    int n, cyl[MAX_RANGE], sec[MAX_RANGE];
+    if (parse_vector(args, &n, cyl, sec) == NULL) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    // the whole vector is queued at once so the scheduler can order it
+    start_io(id, 0, 0, DREQ_READ, n, cyl, sec, 1, BLOCKSIZE, NULL);
+    return 0;
+}
+
+// WV n c0 s0 c1 s1 ... data: scatter n sectors of data
+int handle_wv(int id, tcp_buffer *wb, char *args, int len) {
+    Log("Vector write command");
+    int n, cyl[MAX_RANGE], sec[MAX_RANGE];
+    char *data = parse_vector(args, &n, cyl, sec);
+    if (data == NULL || data + n * BLOCKSIZE > args + len) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    start_io(id, 0, 0, DREQ_WRITE, n, cyl, sec, 1, BLOCKSIZE, data);
+    return 0;
+}
+
+// F: flush, every write acknowledged before it is durable once it is answered
+int handle_f(int id, tcp_buffer *wb, char *args, int len) {
+    Log("Flush command");
+    start_flush(id, wb, 0, 0);
+    return 0;
+}
+
+// P name: switch the scheduling policy
+int handle_p(int id, tcp_buffer *wb, char *args, int len) {
+    char *save;
+    char *name = strtok_r(args, " \r\n", &save);
+    int p = name ? sched_policy_from_name(name) : -1;
+    if (p < 0 || sched_set_policy(p) != 0) {
+        reply_with_no(wb, NULL, 0);
+        return 0;
+    }
+    reply_with_yes(wb, NULL, 0);
+    return 0;
+}
+
+// S: per-policy scheduler statistics, one line per policy that served requests
+int handle_s(int id, tcp_buffer *wb, char *args, int len) {
+    char buf[1024];
+    int off = snprintf(buf, sizeof(buf), "policy %s\n", sched_policy_name(sched_policy()));
+    for (int p = 0; p < SCHED_NPOLICY; p++) {
+        sched_stat st;
+        sched_get_stats(p, &st);
+        if (st.requests == 0) continue;
+        off += snprintf(buf + off, sizeof(buf) - off,
+                        "%s: %ld requests, seek %ld cylinders (%.2f avg), wait %.1f us avg %ld us max\n",
+                        sched_policy_name(p), st.requests, st.seek_distance,
+                        (double)st.seek_distance / st.requests, (double)st.wait_us / st.requests,
+                        st.max_wait_us);
+    }
+    disk_timing_stat ts;
+    get_disk_timing(NULL, &ts);
+    off += snprintf(buf + off, sizeof(buf) - off,
+                    "disk: %ld accesses, %ld track cache hits, simulated %ld us "
+                    "(seek %ld, rotation %ld, transfer %ld)\n",
+                    ts.accesses, ts.cache_hits, ts.clock_us, ts.seek_us, ts.rot_us, ts.xfer_us);
+    reply_with_yes(wb, buf, off + 1);
+    return 0;
+}
+
+// V: announce the binary protocol version
+int handle_v(int id, tcp_buffer *wb, char *args, int len) {
+    char buf[16];
+    sprintf(buf, "%d", BDS_VERSION);
+    reply_with_yes(wb, buf, strlen(buf) + 1);
+    return 0;
+}
+
+static void bin_reply(tcp_buffer *wb, const bds_req_hdr *req, int status, const char *data, int len) {
+    bds_resp_hdr resp = {
+        .magic = BDS_MAGIC,
+        .status = status,
+        .flags = 0,
+        .tag = htonl(req->tag),
+        .len = htonl(len),
+    };
+    struct iovec iov[2] = {{&resp, sizeof(resp)}, {(void *)data, len}};
+    buffer_appendv(wb, iov, 2);
+}
+
+// a binary request, see bds_proto.h; the header is copied out and converted to host order
+int handle_binary(int id, tcp_buffer *wb, char *msg, int len) {
+    bds_req_hdr req;
+    memcpy(&req, msg, sizeof(req));
+    req.tag = ntohl(req.tag);
+    req.blockno = ntohl(req.blockno);
+    req.count = ntohl(req.count);
+    req.len = ntohl(req.len);
+    char *payload = msg + sizeof(req);
+
+    int ncyl, nsec;
+    cmd_i(&ncyl, &nsec);
+    int cyl = req.blockno / nsec, sec = req.blockno % nsec;
+    int data_len = req.count * BLOCKSIZE;
+
+    uint32_t max_count = req.op == BDS_OP_DISCARD ? BDS_MAX_DISCARD : MAX_RANGE;
+    if (req.len != (uint32_t)(len - (int)sizeof(req)) || req.count > max_count) {
+        bin_reply(wb, &req, BDS_EINVAL, NULL, 0);
+        return 0;
+    }
+    switch (req.op) {
+        case BDS_OP_INFO: {
+            uint32_t info[2] = {htonl(ncyl), htonl(nsec)};
+            bin_reply(wb, &req, BDS_OK, (char *)info, sizeof(info));
+            return 0;
+        }
+        case BDS_OP_READ:
+            if (req.count == 0 || req.len != 0) break;
+            start_io(id, 1, req.tag, DREQ_READ, 1, &cyl, &sec, req.count, data_len, NULL);
+            return 0;
+        case BDS_OP_WRITE:
+            if (req.count == 0 || req.len != data_len) break;
+            start_io(id, 1, req.tag, DREQ_WRITE, 1, &cyl, &sec, req.count, data_len, payload);
+            return 0;
+        case BDS_OP_READV:
+        case BDS_OP_WRITEV: {
+            int veclen = req.count * sizeof(uint32_t);
+            int expect = veclen + (req.op == BDS_OP_WRITEV ? data_len : 0);
+            if (req.count == 0 || req.len != expect) break;
+            int cyls[MAX_RANGE], secs[MAX_RANGE];
+            for (int i = 0; i < req.count; i++) {
+                uint32_t bno;
+                memcpy(&bno, payload + i * sizeof(uint32_t), sizeof(bno));
+                bno = ntohl(bno);
+                cyls[i] = bno / nsec;
+                secs[i] = bno % nsec;
+            }
+            start_io(id, 1, req.tag, req.op == BDS_OP_READV ? DREQ_READ : DREQ_WRITE, req.count, cyls,
+                     secs, 1, BLOCKSIZE, payload + veclen);
+            return 0;
+        }
+        case BDS_OP_DISCARD:
+            if (req.count == 0 || req.len != 0) break;
+            start_io(id, 1, req.tag, DREQ_DISCARD, 1, &cyl, &sec, req.count, 0, NULL);
+            return 0;
+        case BDS_OP_FLUSH:
+            start_flush(id, wb, 1, req.tag);
+            return 0;
+        default:
+            break;
+    }
+    bin_reply(wb, &req, BDS_EINVAL, NULL, 0);
+    return 0;
+}
+
+int handle_e(int id, tcp_buffer *wb, char *args, int len) {
     const char *msg = "Bye!";
     reply(wb, msg, strlen(msg) + 1);
     return -1;
@@ -100,11 +463,20 @@ int handle_e(tcp_buffer *wb, char *args, int len) {
 
 static struct {
     const char *name;
-    int (*handler)(tcp_buffer *wb, char *, int);
+    int (*handler)(int id, tcp_buffer *wb, char *, int);
 } cmd_table[] = {
     {"I", handle_i},
     {"R", handle_r},
     {"W", handle_w},
+    {"RR", handle_rr},
+    {"WR", handle_wr},
+    {"RV", handle_rv},
+    {"WV", handle_wv},
+    {"D", handle_d},
+    {"F", handle_f},
+    {"P", handle_p},
+    {"S", handle_s},
+    {"V", handle_v},
     {"E", handle_e},
 };
 
@@ -116,15 +488,21 @@ void on_connection(int id) {
 }
 
 int on_recv(int id, tcp_buffer *wb, char *msg, int len) {
-    char *p = strtok(msg, " \r\n");
+    // binary frames are recognised by their first byte, everything else is a text command
+    if (len >= (int)sizeof(bds_req_hdr) && (unsigned char)msg[0] == BDS_MAGIC) {
+        return handle_binary(id, wb, msg, len);
+    }
+    char *save;
+    char *p = strtok_r(msg, " \r\n", &save);
     // remove '\n\0' at the end of msg
     // now len doesnot include \0
-    if (msg[len-2] == '\n') msg[len-2] = '\0';
+    // write payloads are not NUL-terminated, leave their bytes alone
+    if (len >= 2 && msg[len-1] == '\0' && msg[len-2] == '\n') msg[len-2] = '\0';
     // len -= 2;
     int ret = 1;
     for (int i = 0; i < NCMD; i++)
         if (p && strcmp(p, cmd_table[i].name) == 0) {
-            ret = cmd_table[i].handler(wb, p + strlen(p) + 1, len - strlen(p) - 1);
+            ret = cmd_table[i].handler(id, wb, p + strlen(p) + 1, len - strlen(p) - 1);
             break;
         }
     if (ret == 1) {
@@ -138,20 +516,116 @@ int on_recv(int id, tcp_buffer *wb, char *msg, int len) {
 }
 
 void cleanup(int id) {
-    // some code that are executed when a client is disconnected
-    // you don't need this now
+    // replies still in flight must not reach the next client that gets this id
+    pthread_mutex_lock(&conns[id].lock);
+    while (conns[id].inflight > 0) pthread_cond_wait(&conns[id].idle, &conns[id].lock);
+    pthread_mutex_unlock(&conns[id].lock);
 }
 
 FILE *log_file;
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <disk file name> <cylinders> <sector per cylinder> "
+            "<track-to-track delay> <port>\n"
+            "  -y full|range|group[:ms[:writes]]|async  durability of writes (default range)\n"
+            "  -p fcfs|sstf|scan|cscan|deadline         request scheduling policy (default fcfs)\n"
+            "  -t threads                               worker threads serving clients (default 4)\n"
+            "  -m key=value,...                         timing model: rpm, settle (us), xfer (KB/s),\n"
+            "                                           cache (tracks), clock=real|virtual\n"
+            "  -e map|pread|uring[:direct]              how the image is accessed (default map),\n"
+            "                                           uring with O_DIRECT when direct is given\n",
+            prog);
+}
+
+// "group:5:64" -> group commit every 5 ms or 64 writes, whichever comes first
+static int apply_sync_mode(char *spec) {
+    static const char *names[] = {"full", "range", "group", "async"};
+    char *name = strtok(spec, ":");
+    char *ms = strtok(NULL, ":");
+    char *writes = strtok(NULL, ":");
+    for (int mode = 0; name && mode < sizeof(names) / sizeof(names[0]); mode++) {
+        if (strcmp(name, names[mode]) == 0) {
+            return set_sync_mode(mode, ms ? atoi(ms) : 10, writes ? atoi(writes) : 32);
+        }
+    }
+    return 1;
+}
+
+// "uring:direct" -> the io_uring engine on an image opened with O_DIRECT
+static int apply_engine(char *spec) {
+    static const char *names[] = {"map", "pread", "uring"};
+    char *name = strtok(spec, ":");
+    char *flag = strtok(NULL, ":");
+    for (int e = 0; name && e < sizeof(names) / sizeof(names[0]); e++) {
+        if (strcmp(name, names[e]) != 0) continue;
+        if (flag && (e != DISK_ENGINE_URING || strcmp(flag, "direct") != 0)) return 1;
+        return set_disk_engine(e) || set_disk_direct(flag != NULL);
+    }
+    return 1;
+}
+
+// "rpm=7200,settle=500,cache=8,clock=virtual"
+static int apply_timing(char *spec) {
+    disk_timing t = {0};
+    char *save;
+    for (char *kv = strtok_r(spec, ",", &save); kv; kv = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(kv, '=');
+        if (!val) return 1;
+        *val++ = '\0';
+        if (strcmp(kv, "rpm") == 0) t.rpm = atoi(val);
+        else if (strcmp(kv, "settle") == 0) t.settle_us = atoi(val);
+        else if (strcmp(kv, "xfer") == 0) t.xfer_kbs = atoi(val);
+        else if (strcmp(kv, "cache") == 0) t.track_cache = atoi(val);
+        else if (strcmp(kv, "clock") == 0 && strcmp(val, "virtual") == 0) t.virtual_clock = 1;
+        else if (strcmp(kv, "clock") != 0 || strcmp(val, "real") != 0) return 1;
+    }
+    return set_disk_timing(&t);
+}
+
 int main(int argc, char *argv[]) {
     char *filename;
     int ncyl, nsec, ttd, port;
-    if (argc < 5) {
-        fprintf(stderr,
-                "Usage: %s <disk file name> <cylinders> <sector per cylinder> "
-                "<track-to-track delay> <port>\n",
-                argv[0]);
+    char *prog = argv[0], *sync_spec = NULL, *timing_spec = NULL;
+    int opt, policy = SCHED_FCFS, nthreads = 4;
+    while ((opt = getopt(argc, argv, "y:p:t:m:e:")) != -1) {
+        switch (opt) {
+            case 'y':
+                sync_spec = optarg;
+                break;
+            case 'm':
+                timing_spec = optarg;
+                break;
+            case 'p':
+                policy = sched_policy_from_name(optarg);
+                if (policy < 0) {
+                    usage(prog);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                if (apply_engine(optarg) != 0) {
+                    usage(prog);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                if (nthreads <= 0) {
+                    usage(prog);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(prog);
+                exit(EXIT_FAILURE);
+        }
+    }
+    argv += optind - 1; // positional arguments start at argv[1] again
+    argc -= optind - 1;
+
+    if (argc < 6) {
+        usage(prog);
         filename = (char *)malloc(64 * sizeof(char));
         strcpy(filename, "disk.img");
         ncyl = 100; // default number of cylinders
@@ -181,12 +655,29 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Failed to initialize disk\n");
         exit(EXIT_FAILURE);
     }
+    if (sync_spec && apply_sync_mode(sync_spec) != 0) {
+        fprintf(stderr, "Invalid sync mode\n");
+        exit(EXIT_FAILURE);
+    }
+    if (timing_spec && apply_timing(timing_spec) != 0) {
+        fprintf(stderr, "Invalid timing model\n");
+        exit(EXIT_FAILURE);
+    }
+    if (sched_init(policy) != 0) {
+        fprintf(stderr, "Failed to start the request scheduler\n");
+        exit(EXIT_FAILURE);
+    }
 
     // command
-    tcp_server server = server_init(port, 1, on_connection, on_recv, cleanup);
+    for (int i = 0; i < FD_SETSIZE; i++) {
+        pthread_mutex_init(&conns[i].lock, NULL);
+        pthread_cond_init(&conns[i].idle, NULL);
+    }
+    server = server_init(port, nthreads, on_connection, on_recv, cleanup);
     server_run(server);
 
     // never reached
+    sched_stop();
     close_disk();
     log_close();
     free(filename);
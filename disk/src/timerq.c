@@ -0,0 +1,138 @@
+#include "../include/timerq.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "../../include/log.h"
+
+typedef struct {
+    struct timespec due;
+    timer_fn fn;
+    void *arg;
+} timer_ent;
+
+// binary min-heap on due, protected by lock
+static timer_ent *heap = NULL;
+static int nheap = 0, capheap = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;  // waits on CLOCK_MONOTONIC, set up by timerq_start
+static pthread_t th;
+static int running = 0;
+
+void timespec_add_us(struct timespec *t, long us) {
+    t->tv_sec += us / 1000000;
+    t->tv_nsec += (us % 1000000) * 1000;
+    if (t->tv_nsec >= 1000000000) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000;
+    }
+}
+
+long timespec_diff_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int before(const timer_ent *a, const timer_ent *b) {
+    return a->due.tv_sec < b->due.tv_sec ||
+           (a->due.tv_sec == b->due.tv_sec && a->due.tv_nsec < b->due.tv_nsec);
+}
+
+static void swap(int i, int j) {
+    timer_ent t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+}
+
+static void push(timer_ent e) {
+    if (nheap == capheap) {
+        capheap = capheap ? capheap * 2 : 64;
+        heap = realloc(heap, capheap * sizeof(timer_ent));
+    }
+    int i = nheap++;
+    heap[i] = e;
+    while (i > 0 && before(&heap[i], &heap[(i - 1) / 2])) {
+        swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static timer_ent pop(void) {
+    timer_ent top = heap[0];
+    heap[0] = heap[--nheap];
+    int i = 0;
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < nheap && before(&heap[l], &heap[m])) m = l;
+        if (r < nheap && before(&heap[r], &heap[m])) m = r;
+        if (m == i) break;
+        swap(i, m);
+        i = m;
+    }
+    return top;
+}
+
+static void *timer_main(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (running || nheap > 0) {
+        if (nheap == 0) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (running && timespec_diff_us(&now, &heap[0].due) > 0) {
+            pthread_cond_timedwait(&cond, &lock, &heap[0].due);
+            continue;
+        }
+        timer_ent e = pop();
+        pthread_mutex_unlock(&lock);
+        e.fn(e.arg);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int timerq_start() {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cond, &attr);
+        pthread_condattr_destroy(&attr);
+        running = pthread_create(&th, NULL, timer_main, NULL) == 0;
+    }
+    int ok = running;
+    pthread_mutex_unlock(&lock);
+    if (!ok) Error("timerq: cannot start the timer thread");
+    return ok ? 0 : 1;
+}
+
+void timerq_stop() {
+    pthread_mutex_lock(&lock);
+    int was_running = running;
+    running = 0;
+    if (was_running) pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    if (was_running) pthread_join(th, NULL);
+}
+
+void timerq_add(const struct timespec *due, timer_fn fn, void *arg) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        fn(arg); // no timer thread, nothing can wait
+        return;
+    }
+    push((timer_ent){.due = *due, .fn = fn, .arg = arg});
+    pthread_cond_signal(&cond); // it may be the new earliest deadline
+    pthread_mutex_unlock(&lock);
+}
+
+int timerq_pending() {
+    pthread_mutex_lock(&lock);
+    int n = nheap;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
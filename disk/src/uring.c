@@ -0,0 +1,197 @@
+#define _GNU_SOURCE // fallocate
+#include "../include/uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../../include/log.h"
+
+// the ring, protected by ring_lock; one batch is in flight at a time
+static int ring_fd = -1;
+static unsigned nentries;
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_len, cq_ring_len, sqes_len;
+static struct iovec *iovs; // one per submission slot, read by the kernel until completion
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned submit, unsigned wait) {
+    return syscall(__NR_io_uring_enter, ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static void unmap_all(void) {
+    if (sqes && sqes != MAP_FAILED) munmap(sqes, sqes_len);
+    if (cq_ring && cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_len);
+    if (sq_ring && sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_len);
+    sqes = NULL;
+    sq_ring = cq_ring = NULL;
+}
+
+int uring_init(unsigned entries) {
+    pthread_mutex_lock(&ring_lock);
+    if (ring_fd >= 0) {
+        pthread_mutex_unlock(&ring_lock);
+        return 0;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_setup(entries, &p);
+    if (fd < 0) {
+        pthread_mutex_unlock(&ring_lock);
+        Warn("uring: io_uring_setup failed (%s)", strerror(errno));
+        return -1;
+    }
+    ring_fd = fd;
+    sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_ring_len > sq_ring_len) sq_ring_len = cq_ring_len;
+    sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = single ? sq_ring
+                     : mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING);
+    sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    iovs = calloc(p.sq_entries, sizeof(struct iovec));
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED || !iovs) {
+        unmap_all();
+        free(iovs);
+        iovs = NULL;
+        close(fd);
+        ring_fd = -1;
+        pthread_mutex_unlock(&ring_lock);
+        Warn("uring: cannot map the rings");
+        return -1;
+    }
+    char *sq = sq_ring, *cq = cq_ring;
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    nentries = p.sq_entries;
+    pthread_mutex_unlock(&ring_lock);
+    Log("uring: %u submission entries", nentries);
+    return 0;
+}
+
+void uring_exit(void) {
+    pthread_mutex_lock(&ring_lock);
+    if (ring_fd >= 0) {
+        unmap_all();
+        free(iovs);
+        iovs = NULL;
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    pthread_mutex_unlock(&ring_lock);
+}
+
+int uring_ready(void) {
+    pthread_mutex_lock(&ring_lock);
+    int ready = ring_fd >= 0;
+    pthread_mutex_unlock(&ring_lock);
+    return ready;
+}
+
+static void prep(struct io_uring_sqe *sqe, struct iovec *iov, uring_io *io, unsigned idx) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = io->fd;
+    sqe->off = io->off;
+    sqe->user_data = idx;
+    if (io->op == URING_PUNCH) {
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->addr = io->len; // fallocate takes the length in addr and the mode in len
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        return;
+    }
+    iov->iov_base = io->buf;
+    iov->iov_len = io->len;
+    sqe->opcode = io->op == URING_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 1;
+}
+
+// submit ios[0..n), n <= nentries, and wait for all of them; caller holds ring_lock
+static int run_batch(uring_io *ios, int n) {
+    unsigned tail = *sq_tail;
+    for (int i = 0; i < n; i++) {
+        unsigned slot = (tail + i) & *sq_mask;
+        prep(&sqes[slot], &iovs[slot], &ios[i], i);
+        sq_array[slot] = slot;
+    }
+    __atomic_store_n(sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    int submitted = 0, reaped = 0;
+    while (reaped < n) {
+        int ret = sys_enter(n - submitted, 1);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            Error("uring: io_uring_enter failed (%s)", strerror(errno));
+            return -1; // the ring is unusable now, uring_run stops using it
+        }
+        submitted += ret;
+        unsigned head = *cq_head;
+        unsigned ctail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            ios[cqe->user_data].res = cqe->res;
+            reaped++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// finish a transfer the kernel cut short, synchronously
+static int finish_short(uring_io *io) {
+    long done = io->res;
+    while (done < io->len) {
+        ssize_t n = io->op == URING_READ ? pread(io->fd, io->buf + done, io->len - done, io->off + done)
+                                         : pwrite(io->fd, io->buf + done, io->len - done, io->off + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    io->res = done;
+    return 0;
+}
+
+int uring_run(uring_io *ios, int n) {
+    pthread_mutex_lock(&ring_lock);
+    if (ring_fd < 0) {
+        pthread_mutex_unlock(&ring_lock);
+        return -1;
+    }
+    int res = 0;
+    for (int done = 0; done < n && res == 0; done += nentries) {
+        int cnt = n - done < (int)nentries ? n - done : (int)nentries;
+        res = run_batch(ios + done, cnt);
+    }
+    pthread_mutex_unlock(&ring_lock);
+    if (res != 0) {
+        uring_exit(); // the submission queue no longer matches what the kernel took
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (ios[i].res < 0) res = -1;
+        else if (ios[i].op != URING_PUNCH && ios[i].res < ios[i].len && finish_short(&ios[i]) != 0) res = -1;
+    }
+    return res;
+}
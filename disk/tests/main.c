@@ -9,8 +9,12 @@ int mt_pass_count = 0;
 int mt_fail_count = 0;
 
 void disk_tests();
+void sched_tests();
 
-void all_tests() { mt_run_suite(disk_tests); }
+void all_tests() {
+    mt_run_suite(disk_tests);
+    mt_run_suite(sched_tests);
+}
 
 FILE *log_file;
 
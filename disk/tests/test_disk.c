@@ -1,7 +1,11 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "../include/disk.h"
+#include "../../include/log.h"
 #include "../../include/mintest.h"
 
 inline static void setup_disk() { init_disk("test_disk.img", 10, 10, 0); }
@@ -122,6 +126,234 @@ mt_test(test_out_of_bounds) {
     return 0;
 }
 
+mt_test(test_range_wr) {
+    setup_disk();
+    char write_buf[4 * 512];
+    char read_buf[4 * 512];
+    for (int i = 0; i < 4 * 512; i++) {
+        write_buf[i] = 'a' + (i % 26);
+    }
+
+    // sectors 8..11 span cylinder 0 and cylinder 1
+    int write_result = cmd_wr(0, 8, 4, write_buf);
+    mt_assert(write_result == 0);
+
+    int read_result = cmd_rr(0, 8, 4, read_buf);
+    mt_assert(read_result == 0);
+    mt_assert(memcmp(write_buf, read_buf, 4 * 512) == 0);
+
+    read_result = cmd_r(1, 1, read_buf);
+    mt_assert(read_result == 0);
+    mt_assert(memcmp(write_buf + 3 * 512, read_buf, 512) == 0);
+
+    mt_assert(cmd_rr(9, 8, 4, read_buf) != 0);  // runs past the last sector
+    mt_assert(cmd_wr(0, 0, MAX_RANGE + 1, write_buf) != 0);
+    close_disk();
+    return 0;
+}
+
+mt_test(test_sync_modes) {
+    setup_disk();
+    char write_buf[512];
+    char read_buf[512];
+    int modes[] = {SYNC_FULL, SYNC_RANGE, SYNC_GROUP, SYNC_ASYNC};
+    for (int m = 0; m < 4; m++) {
+        mt_assert(set_sync_mode(modes[m], 5, 4) == 0);
+        for (int i = 0; i < 10; i++) {
+            memset(write_buf, 'a' + m + i, sizeof(write_buf));
+            mt_assert(cmd_w(4, i, 512, write_buf) == 0);
+            mt_assert(cmd_r(4, i, read_buf) == 0);
+            mt_assert(memcmp(write_buf, read_buf, 512) == 0);
+        }
+        mt_assert(cmd_flush() == 0);
+    }
+    mt_assert(set_sync_mode(SYNC_GROUP, 0, 4) != 0);
+    mt_assert(set_sync_mode(SYNC_RANGE, 10, 32) == 0);
+    close_disk();
+    return 0;
+}
+
+// each worker owns one sector per cylinder and hammers it with ranges and single writes
+static void *rw_worker(void *arg) {
+    long id = (long)arg;
+    char data[512], back[512];
+    for (int round = 0; round < 50; round++) {
+        for (int cyl = 0; cyl < 10; cyl++) {
+            memset(data, 'a' + (id + round + cyl) % 26, sizeof(data));
+            if (cmd_w(cyl, id, 512, data) != 0 || cmd_r(cyl, id, back) != 0 ||
+                memcmp(data, back, 512) != 0) {
+                return (void *)1;
+            }
+        }
+    }
+    return NULL;
+}
+
+mt_test(test_concurrent_rw) {
+    setup_disk();
+    mt_assert(set_sync_mode(SYNC_ASYNC, 10, 32) == 0);
+    pthread_t th[4];
+    for (long i = 0; i < 4; i++) pthread_create(&th[i], NULL, rw_worker, (void *)i);
+    for (int i = 0; i < 4; i++) {
+        void *res;
+        pthread_join(th[i], &res);
+        mt_assert(res == NULL);
+    }
+    mt_assert(disk_head() >= 0 && disk_head() < 10);
+    mt_assert(set_sync_mode(SYNC_RANGE, 10, 32) == 0);
+    close_disk();
+    return 0;
+}
+
+mt_test(test_timing_model) {
+    setup_disk();
+    char buf[4 * 512];
+    disk_timing t = {.rpm = 6000, .settle_us = 500, .virtual_clock = 1}; // 10 ms per turn, 1 ms per sector
+    disk_timing_stat st;
+    mt_assert(set_disk_timing(&t) == 0);
+
+    mt_assert(cmd_r(0, 0, buf) == 0);  // sector 0 is under the head, only the transfer
+    get_disk_timing(NULL, &st);
+    mt_assert(st.clock_us == 1000 && disk_last_delay_us() == 0);
+
+    mt_assert(cmd_r(0, 5, buf) == 0);  // sector 1 passes under the head, wait for 4 more
+    get_disk_timing(NULL, &st);
+    mt_assert(st.clock_us == 1000 + 4000 + 1000);
+
+    mt_assert(cmd_rr(2, 0, 2, buf) == 0);  // settle, no ttd given; sector 0 comes round 3.5 ms later
+    get_disk_timing(NULL, &st);
+    mt_assert(st.seek_us == 500 && st.rot_us == 4000 + 3500 && st.clock_us == 6000 + 500 + 3500 + 2000);
+
+    t.track_cache = 2;
+    t.xfer_kbs = 0;
+    mt_assert(set_disk_timing(&t) == 0);
+    mt_assert(cmd_rr(1, 0, 4, buf) == 0);
+    mt_assert(cmd_r(1, 9, buf) == 0);  // same track, straight from the cache
+    get_disk_timing(NULL, &st);
+    mt_assert(st.accesses == 2 && st.cache_hits == 1 && st.xfer_us == 4000);
+    mt_assert(cmd_w(1, 9, 512, buf) == 0);  // writes always go to the platter
+    get_disk_timing(NULL, &st);
+    mt_assert(st.cache_hits == 1 && st.xfer_us == 5000);
+
+    t.virtual_clock = 0;
+    mt_assert(set_disk_timing(&t) == 0);
+    mt_assert(cmd_r(9, 0, buf) == 0);
+    mt_assert(disk_last_delay_us() > 0);  // slept for it
+    t = (disk_timing){0};
+    mt_assert(set_disk_timing(&t) == 0);
+    mt_assert(set_disk_timing(&(disk_timing){.rpm = -1}) != 0);
+    close_disk();
+    return 0;
+}
+
+static long allocated_kb(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_blocks / 2 : -1;
+}
+
+mt_test(test_sparse_image) {
+    // 4.5 GB, past what an int byte offset can address
+    unlink("test_big.img");
+    mt_assert(init_disk("test_big.img", 9000, 1024, 0) == 0);
+    mt_assert(allocated_kb("test_big.img") < 1024);
+    char buf[BLOCKSIZE], back[BLOCKSIZE];
+    memset(buf, 'z', BLOCKSIZE);
+    mt_assert(cmd_w(8999, 1023, BLOCKSIZE, buf) == 0);
+    mt_assert(cmd_w(0, 0, BLOCKSIZE, buf) == 0);
+    mt_assert(cmd_r(8999, 1023, back) == 0 && memcmp(buf, back, BLOCKSIZE) == 0);
+    mt_assert(cmd_r(4500, 7, back) == 0 && back[0] == 0 && back[BLOCKSIZE - 1] == 0);
+    mt_assert(cmd_r(9000, 0, back) != 0);
+    close_disk();
+    mt_assert(allocated_kb("test_big.img") < 1024); // only the touched pages take space
+    unlink("test_big.img");
+    return 0;
+}
+
+mt_test(test_pread_engine) {
+    unlink("test_pread.img");
+    mt_assert(set_disk_engine(DISK_ENGINE_PREAD) == 0);
+    mt_assert(init_disk("test_pread.img", 64, 64, 0) == 0);
+    mt_assert(set_disk_engine(DISK_ENGINE_MAP) != 0); // not while the disk is open
+
+    char data[64 * BLOCKSIZE], back[64 * BLOCKSIZE];
+    for (int i = 0; i < sizeof(data); i++) data[i] = 'a' + i % 26;
+    mt_assert(cmd_wr(3, 0, 64, data) == 0);
+    mt_assert(cmd_rr(3, 0, 64, back) == 0 && memcmp(data, back, sizeof(data)) == 0);
+    mt_assert(cmd_flush() == 0);
+    long full = allocated_kb("test_pread.img");
+    mt_assert(full >= 32);
+
+    // writing zeros over the cylinder gives its space back
+    memset(data, 0, sizeof(data));
+    mt_assert(cmd_wr(3, 0, 64, data) == 0);
+    mt_assert(cmd_rr(3, 0, 64, back) == 0 && memcmp(data, back, sizeof(data)) == 0);
+    mt_assert(allocated_kb("test_pread.img") <= full - 32);
+
+    // a discard needs no data and leaves the neighbours alone
+    memset(data, 'q', sizeof(data));
+    mt_assert(cmd_wr(5, 0, 64, data) == 0);
+    mt_assert(cmd_d(5, 8, 48) == 0);
+    mt_assert(cmd_rr(5, 0, 64, back) == 0);
+    mt_assert(back[8 * BLOCKSIZE - 1] == 'q' && back[56 * BLOCKSIZE] == 'q');
+    for (int i = 8 * BLOCKSIZE; i < 56 * BLOCKSIZE; i++) mt_assert(back[i] == 0);
+    mt_assert(cmd_d(63, 60, 8) != 0); // past the end of the disk
+
+    // a discard is not held to MAX_RANGE, one may span several cylinders
+    memset(data, 'r', sizeof(data));
+    for (int c = 10; c < 14; c++) mt_assert(cmd_wr(c, 0, 64, data) == 0);
+    mt_assert(cmd_d(10, 32, 3 * 64) == 0);
+    mt_assert(cmd_rr(10, 0, 64, back) == 0 && back[32 * BLOCKSIZE - 1] == 'r' && back[32 * BLOCKSIZE] == 0);
+    for (int c = 11; c < 13; c++) {
+        mt_assert(cmd_rr(c, 0, 64, back) == 0);
+        for (int i = 0; i < sizeof(back); i++) mt_assert(back[i] == 0);
+    }
+    mt_assert(cmd_rr(13, 0, 64, back) == 0 && back[32 * BLOCKSIZE - 1] == 0 && back[32 * BLOCKSIZE] == 'r');
+    mt_assert(cmd_d(0, 0, 64 * 64) == 0);
+    mt_assert(cmd_d(0, 1, 64 * 64) != 0);
+    close_disk();
+    set_disk_engine(DISK_ENGINE_MAP);
+    unlink("test_pread.img");
+    return 0;
+}
+
+// the same traffic on the uring engine, buffered and with O_DIRECT; without io_uring it runs on pread
+mt_test(test_uring_engine) {
+    for (int pass = 0; pass < 2; pass++) {
+        unlink("test_uring.img");
+        mt_assert(set_disk_engine(DISK_ENGINE_URING) == 0);
+        mt_assert(set_disk_direct(pass) == 0);
+        mt_assert(init_disk("test_uring.img", 64, 64, 0) == 0);
+        mt_assert(disk_engine() == DISK_ENGINE_URING || disk_engine() == DISK_ENGINE_PREAD);
+        Log("test_uring_engine: pass %d on the %s engine", pass,
+            disk_engine() == DISK_ENGINE_URING ? "uring" : "pread");
+
+        char data[64 * BLOCKSIZE], back[64 * BLOCKSIZE];
+        for (int i = 0; i < sizeof(data); i++) data[i] = 'A' + (i + pass) % 26;
+        // zero sectors in the middle of a range become a hole in the same batch
+        memset(data + 10 * BLOCKSIZE, 0, 20 * BLOCKSIZE);
+        mt_assert(cmd_wr(7, 0, 64, data) == 0);
+        mt_assert(cmd_rr(7, 0, 64, back) == 0 && memcmp(data, back, sizeof(data)) == 0);
+        mt_assert(cmd_w(9, 3, 5, "hello") == 0);
+        mt_assert(cmd_r(9, 3, back) == 0 && memcmp(back, "hello", 6) == 0);
+        mt_assert(cmd_d(7, 0, 8) == 0);
+        mt_assert(cmd_rr(7, 0, 10, back) == 0);
+        for (int i = 0; i < 8 * BLOCKSIZE; i++) mt_assert(back[i] == 0);
+        mt_assert(memcmp(back + 8 * BLOCKSIZE, data + 8 * BLOCKSIZE, 2 * BLOCKSIZE) == 0);
+        mt_assert(cmd_flush() == 0);
+        close_disk();
+
+        // what was written is in the file for the next engine to find
+        mt_assert(set_disk_engine(DISK_ENGINE_PREAD) == 0);
+        mt_assert(set_disk_direct(0) == 0);
+        mt_assert(init_disk("test_uring.img", 64, 64, 0) == 0);
+        mt_assert(cmd_rr(7, 8, 56, back) == 0 && memcmp(back, data + 8 * BLOCKSIZE, 56 * BLOCKSIZE) == 0);
+        close_disk();
+    }
+    set_disk_engine(DISK_ENGINE_MAP);
+    unlink("test_uring.img");
+    return 0;
+}
+
 void disk_tests() {
     mt_run_test(test_cmd_i);
     mt_run_test(test_cmd_wr);
@@ -129,4 +361,11 @@ void disk_tests() {
     mt_run_test(test_w_partial);
     mt_run_test(test_non_ascii);
     mt_run_test(test_out_of_bounds);
+    mt_run_test(test_range_wr);
+    mt_run_test(test_sync_modes);
+    mt_run_test(test_concurrent_rw);
+    mt_run_test(test_timing_model);
+    mt_run_test(test_sparse_image);
+    mt_run_test(test_pread_engine);
+    mt_run_test(test_uring_engine);
 }
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/disk.h"
+#include "../include/disk_sched.h"
+#include "../include/timerq.h"
+#include "../../include/mintest.h"
+
+#define NTRACE 8
+static const int trace[NTRACE] = {90, 10, 60, 40, 95, 5, 70, 30};
+
+// serve the trace with sched_pick starting at head 50, store the service order and return the distance
+static int replay(int policy, int *order) {
+    disk_req reqs[NTRACE], *q[NTRACE];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < NTRACE; i++) {
+        reqs[i] = (disk_req){.cyl = trace[i], .arrival = now};
+        q[i] = &reqs[i];
+    }
+    int n = NTRACE, head = 50, dir = 1, dist = 0;
+    for (int k = 0; k < NTRACE; k++) {
+        int i = sched_pick(policy, q, n, head, &dir, &now);
+        dist += abs(q[i]->cyl - head);
+        head = order[k] = q[i]->cyl;
+        memmove(&q[i], &q[i + 1], (n - i - 1) * sizeof(q[0]));
+        n--;
+    }
+    return dist;
+}
+
+mt_test(test_sched_pick) {
+    int order[NTRACE];
+    int fcfs = replay(SCHED_FCFS, order);
+    mt_assert(memcmp(order, trace, sizeof(trace)) == 0);
+
+    int sstf = replay(SCHED_SSTF, order);
+    int want_sstf[NTRACE] = {60, 70, 90, 95, 40, 30, 10, 5};  // 60 wins the tie with 40 by arriving first
+    mt_assert(memcmp(order, want_sstf, sizeof(order)) == 0);
+
+    int scan = replay(SCHED_SCAN, order);
+    int want_scan[NTRACE] = {60, 70, 90, 95, 40, 30, 10, 5};
+    mt_assert(memcmp(order, want_scan, sizeof(order)) == 0);
+
+    int cscan = replay(SCHED_CSCAN, order);
+    int want_cscan[NTRACE] = {60, 70, 90, 95, 5, 10, 30, 40};
+    mt_assert(memcmp(order, want_cscan, sizeof(order)) == 0);
+
+    mt_assert(sstf < fcfs && scan < fcfs && cscan < fcfs);
+    return 0;
+}
+
+mt_test(test_sched_deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    disk_req old = {.cyl = 99, .arrival = now}, near = {.cyl = 50, .arrival = now};
+    disk_req *q[2] = {&old, &near};
+    int dir = 1;
+    mt_assert(sched_pick(SCHED_DEADLINE, q, 2, 50, &dir, &now) == 1);
+
+    old.arrival.tv_sec -= 1; // starved for a second, goes ahead of the nearer request
+    mt_assert(sched_pick(SCHED_DEADLINE, q, 2, 50, &dir, &now) == 0);
+    return 0;
+}
+
+// write then read back the trace through the dispatcher, return the seek distance of the reads
+static long run_trace(int policy) {
+    char data[NTRACE][BLOCKSIZE], back[NTRACE][BLOCKSIZE];
+    disk_req reqs[NTRACE];
+    for (int i = 0; i < NTRACE; i++) {
+        memset(data[i], 'a' + i, BLOCKSIZE);
+        reqs[i] = (disk_req){.op = DREQ_WRITE, .cyl = trace[i], .sec = i, .count = 1,
+                             .len = BLOCKSIZE, .buf = data[i]};
+    }
+    if (sched_init(policy) != 0 || sched_run(reqs, NTRACE) != 0) return -1;
+
+    char buf[BLOCKSIZE];
+    disk_req park = {.op = DREQ_READ, .cyl = 50, .count = 1, .buf = buf};
+    sched_run(&park, 1);
+    sched_reset_stats();
+    for (int i = 0; i < NTRACE; i++) {
+        reqs[i] = (disk_req){.op = DREQ_READ, .cyl = trace[i], .sec = i, .count = 1, .buf = back[i]};
+    }
+    if (sched_run(reqs, NTRACE) != 0 || memcmp(data, back, sizeof(data)) != 0) return -1;
+
+    sched_stat st;
+    sched_get_stats(policy, &st);
+    return st.requests == NTRACE ? st.seek_distance : -1;
+}
+
+mt_test(test_sched_run) {
+    init_disk("test_disk.img", 100, 10, 0);
+    long fcfs = run_trace(SCHED_FCFS);
+    long sstf = run_trace(SCHED_SSTF);
+    long scan = run_trace(SCHED_SCAN);
+    long cscan = run_trace(SCHED_CSCAN);
+    long deadline = run_trace(SCHED_DEADLINE);
+    mt_assert(fcfs > 0 && sstf > 0 && scan > 0 && cscan > 0 && deadline > 0);
+    mt_assert(sstf < fcfs && scan < fcfs && cscan < fcfs && deadline < fcfs);
+
+    disk_req bad = {.op = DREQ_READ, .cyl = 100, .count = 1, .buf = NULL};
+    mt_assert(sched_run(&bad, 1) != 0);
+    sched_stop();
+    close_disk();
+    return 0;
+}
+
+static int fired[4], nfired;
+
+static void record(void *arg) { fired[nfired++] = (long)arg; }
+
+mt_test(test_timerq_order) {
+    mt_assert(timerq_start() == 0);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long delays[4] = {30000, 10000, 40000, 20000};
+    nfired = 0;
+    for (long i = 0; i < 4; i++) {
+        struct timespec due = now;
+        timespec_add_us(&due, delays[i]);
+        timerq_add(&due, record, (void *)i);
+    }
+    mt_assert(timerq_pending() == 4);
+    timerq_stop(); // fires the rest at once, still in deadline order
+    int want[4] = {1, 3, 0, 2};
+    mt_assert(nfired == 4 && memcmp(fired, want, sizeof(want)) == 0);
+    return 0;
+}
+
+static int completed;
+
+static void count_done(disk_req *r) { __atomic_add_fetch(&completed, 1, __ATOMIC_RELAXED); }
+
+mt_test(test_sched_async) {
+    init_disk("test_disk.img", 100, 10, 1000); // 1 ms per cylinder
+    mt_assert(sched_init(SCHED_CSCAN) == 0);
+    char buf[NTRACE][BLOCKSIZE];
+    disk_req reqs[NTRACE];
+    for (int i = 0; i < NTRACE; i++) {
+        reqs[i] = (disk_req){.op = DREQ_READ, .cyl = trace[i], .count = 1, .buf = buf[i], .done = count_done};
+    }
+    completed = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sched_submit(reqs, NTRACE);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    // the submitter is not held for the simulated seeks, at least 95 ms of them
+    mt_assert(timespec_diff_us(&t0, &t1) < 50000);
+    mt_assert(__atomic_load_n(&completed, __ATOMIC_RELAXED) < NTRACE);
+    while (__atomic_load_n(&completed, __ATOMIC_RELAXED) < NTRACE) usleep(1000);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    mt_assert(timespec_diff_us(&t0, &t1) >= 95000);
+    sched_stop();
+    close_disk();
+    return 0;
+}
+
+void sched_tests() {
+    mt_run_test(test_sched_pick);
+    mt_run_test(test_sched_deadline);
+    mt_run_test(test_sched_run);
+    mt_run_test(test_timerq_order);
+    mt_run_test(test_sched_async);
+}
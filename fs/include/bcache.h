@@ -0,0 +1,51 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include "common.h"
+
+#define BCACHE_NBUF 1024      // blocks kept in memory
+#define BCACHE_FLUSH_MS 500   // dirty blocks are written back at least this often
+
+/*
+ * Write-back buffer cache under read_block/write_block. The cache does no I/O
+ * of its own except writing dirty blocks back through the function given to
+ * bcache_init; block.c reads the misses and hands them in with bcache_fill.
+ */
+typedef void (*bcache_writeback_fn)(const uint *bnos, int n, uchar *data);
+
+typedef struct {
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;  // blocks written back, by flushes or to make room
+    long ra_fills;    // blocks cached by readahead
+    long ra_useful;   // ... and read afterwards
+    long ra_wasted;   // ... and evicted or overwritten before anyone read them
+} bcache_stat;
+
+void bcache_init(int nbuf, bcache_writeback_fn writeback);
+void bcache_shutdown();  // write back everything, stop the flusher and free the buffers
+
+// copy bno out of the cache, 1 on a hit
+int bcache_read(uint bno, uchar *buf);
+// snapshot to take before reading a miss from the disk, see bcache_fill
+long bcache_epoch();
+// cache a block just read from the disk, dropped if the disk was written since epoch
+void bcache_fill(uint bno, const uchar *buf, long epoch);
+// bcache_fill for a block read ahead, it is counted as useful once read and wasted if dropped unread
+void bcache_prefetched(uint bno, const uchar *buf, long epoch);
+int bcache_cached(uint bno);
+// write a block into the cache, it reaches the disk on the next flush
+void bcache_write(uint bno, const uchar *buf);
+// the disk already holds buf at bno (NULL for zeros), refresh a cached copy
+void bcache_update(uint bno, const uchar *buf);
+// 1 when bno is cached with changes the disk does not have yet
+int bcache_dirty(uint bno);
+int bcache_flush();
+// run fn from the flusher thread every BCACHE_FLUSH_MS, ahead of its write back
+void bcache_set_tick(void (*fn)());
+
+void bcache_get_stats(bcache_stat *st);
+void bcache_reset_stats();
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __BLKDEV_H__
+#define __BLKDEV_H__
+
+#include "common.h"
+
+/*
+ * Block devices the file system can run on without a BDS, in the same process.
+ * block.c talks to the BDS itself and uses one of these when set_block_device
+ * picks it; every call moves whole BSIZE blocks and returns 0 on success.
+ * Calls may come from several threads at once, for different blocks.
+ */
+typedef struct {
+    const char *name;
+    int (*open)(const char *path, int ncyl, int nsec); // path is ignored by the RAM disk
+    void (*close)();
+    int (*read)(const uint *bnos, int n, uchar *buf);
+    int (*write)(const uint *bnos, int n, const uchar *buf);
+    int (*discard)(uint first, uint n);                 // the blocks read back as zeros
+    int (*flush)();                                     // everything written so far is durable
+} blkdev_ops;
+
+extern const blkdev_ops blkdev_mmap;   // the image file mapped into memory
+extern const blkdev_ops blkdev_pread;  // pread/pwrite on the image file
+extern const blkdev_ops blkdev_ram;    // a zeroed buffer, gone when the process exits
+
+#endif
@@ -5,6 +5,9 @@
 #include "stdbool.h"
 // #include "../../disk/include/disk.h"
 #define MAXUSERS 32
+#define MAX_RANGE 64 // max blocks per range/vector request, must match the BDS
+#define BIO_QDEPTH 8 // requests kept in flight against the BDS
+#define BIO_MAX_BYTES (64 * 1024) // payload in flight, keeps both socket directions from filling up
 typedef struct {
     uint magic;      // Magic number, used to identify the file system
     uint size;       // Size in blocks
@@ -21,28 +24,103 @@ typedef struct {
         uint cwd; //the inum of the current working directory
     }users[MAXUSERS];
     uint n_users; // Number of users
+    uint ngroups;    // cylinder groups, 0 for one inode region followed by one data region
+    uint group_size; // blocks per cylinder group
+    uint ipb;        // dinodes per inode block, 0 on images from before they were packed (one)
+    uint flags;      // SB_ flags the disk was formatted with
 } superblock;
 
 // sb is defined in block.c
 extern superblock sb;
 
+#define INODES_PER_BLOCK 5 // dinodes packed into an inode block by a fresh format
+#define SB_EXTENTS 0x1     // files map their blocks with extent trees instead of block pointers
+#define SB_FLAGS_TAG 0x464c0000 // high half of flags on a superblock that has them, older ones hold garbage there
+
+// an inum names slot inum % ipb of inode block inum / ipb; block 0 is the superblock,
+// so no inode has inum 0
+static inline uint inodes_per_block(){
+    return sb.ipb ? sb.ipb : 1;
+}
+static inline uint inum_block(uint inum){
+    return inum / inodes_per_block();
+}
+static inline uint inum_slot(uint inum){
+    return inum % inodes_per_block();
+}
+static inline bool extent_format(){
+    return (sb.flags & SB_EXTENTS) != 0;
+}
+
 extern int BDS_port;
 extern char BDS_addr[32];
 
 void zero_block(uint bno);
 uint allocate_block();
 void free_block(uint bno);
+void free_blocks(const uint *bnos, int n); // one bitmap update for all of them
 
 void get_disk_info(int *ncyl, int *nsec);
 void read_block(int blockno, uchar *buf);
 void write_block(int blockno, uchar *buf);
+void read_blocks(const uint *bnos, int n, uchar *buf);
+void write_blocks(const uint *bnos, int n, uchar *buf);
+void discard_blocks(const uint *bnos, int n); // the blocks read back as zeros
+
+// asynchronous block I/O, at most MAX_RANGE blocks per request; submit returns a tag or -1.
+// A read buffer must stay valid until the request completes, a write buffer may be reused at once.
+// Every tag has to be collected with poll_block_io or wait_block_io, which return 0 on success
+int submit_read_blocks(const uint *bnos, int n, uchar *buf);
+int submit_write_blocks(const uint *bnos, int n, const uchar *buf);
+int poll_block_io(int *status); // a completed tag or 0 if none, never blocks
+int wait_block_io(int tag);
+int drain_block_io();           // wait for everything still in flight
+
+// read blocks into the buffer cache in the background, blocks already cached are skipped;
+// a no-op on a text-only BDS. wait_prefetch returns once everything queued so far is cached
+void prefetch_blocks(const uint *bnos, int n);
+void wait_prefetch();
+
+// requests sent to the BDS, and the cylinders a disk serving them in that order would seek
+typedef struct {
+    long requests;
+    long seek_distance;
+} block_stat;
+void get_block_stats(block_stat *st);
+void reset_block_stats();
 
 uint allocate_data_block();
+// up to want contiguous zeroed data blocks, at goal or as close after it as possible;
+// returns the first one and the length in got, 0 when the disk is full
+uint allocate_data_extent(uint goal, uint want, uint *got);
 uint allocate_iNode_block();
+uint allocate_iNode_block_near(uint goal);
+bool is_inode_block(uint b);
+bool block_in_use(uint b);
+int inode_group(uint b); // the cylinder group of inode block b, 0 without groups, -1 outside the inode region
+// bumped by every _mount_disk, whatever caches on-disk state above the block layer compares it
+uint mount_generation();
+// the inode block to look for a new inode at: its parent's group for a file, the emptiest
+// group for a directory
+uint inode_goal(uint parent, bool is_dir);
+// where a file's first data block should go, in the group of inode inum
+uint data_goal(uint inum);
+// the next _mount_disk formats the disk, with ngroups cylinder groups or the two-region layout for 0
+void set_format_layout(int ngroups);
+// the next _mount_disk formats the disk, files mapped by extents or by direct/indirect blocks;
+// the choice holds for that format only, later ones map by blocks unless asked again
+void set_format_extents(bool on);
+
+// what to run on, before the first block I/O: "bds" (the default, BDS_addr:BDS_port),
+// "mmap:FILE:NCYL:NSEC", "pread:FILE:NCYL:NSEC" or "ram:NCYL:NSEC" in this process
+int set_block_device(const char *spec);
+const char *block_device(); // "bds" or the name of the local device
 
 void _mount_disk();
-void diskClientSetup();
+void diskClientSetup(); // connect to the BDS or open the device set_block_device chose
 void exit_block();
+void flush_disk();
+void set_flush_hook(void (*hook)()); // run by flush_disk first, for writes held back above it
 
 void _fetch_bitmap();
 void _update_bitmap();
@@ -0,0 +1,30 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+#define BUFPOOL_MIN_SHIFT 9    // smallest buffer handed out, BSIZE
+#define BUFPOOL_MAX_SHIFT 17   // largest pooled buffer, bigger ones come straight from the heap
+#define BUFPOOL_KEEP 8         // free buffers of each size a thread keeps for reuse
+
+/*
+ * Thread-local pool of scratch buffers for the block and inode code. Sizes are
+ * rounded up to a power of two; a freed buffer goes back to the free list of
+ * the thread that frees it, so a request that has run once before allocates
+ * nothing from the heap. The lists are released when the thread exits.
+ */
+typedef struct {
+    long gets;     // buffers handed out
+    long reuses;   // ... taken from a free list
+    long mallocs;  // heap allocations, pool misses and oversized buffers
+    long frees;    // buffers given back to the heap, the free list being full
+} bufpool_stat;
+
+void *buf_get(size_t size);
+void *buf_get_zero(size_t size);  // buf_get, cleared
+void buf_put(void *buf);          // NULL is ignored
+
+void bufpool_get_stats(bufpool_stat *st);
+void bufpool_reset_stats();
+
+#endif
@@ -13,7 +13,7 @@ enum {
 
 
 // You should add more fields, this is format of iNode that stored in disk
-// the size of a dinode must divide BSIZE
+// INODES_PER_BLOCK of them are packed into an inode block, see inum_block
 typedef struct {
     char name[MAXNAME]; // File name
     uint inum; //这个inode 块在磁盘中的绝对坐标
@@ -28,6 +28,24 @@ typedef struct {
     uint linkCount; // Number of links to file
     uint modTime; // Modification time
 } dinode;
+_Static_assert(INODES_PER_BLOCK * sizeof(dinode) <= BSIZE, "packed dinodes do not fit a block");
+
+// On a disk formatted with SB_EXTENTS addrs holds the root of an extent tree instead: a
+// header and ROOT_EXTENTS entries. A tree node is a block with a header and NODE_EXTENTS
+// entries; the entries of a leaf (depth 0) are extents, the others point at the nodes below
+typedef struct {
+    uint count;  // entries in use, sorted by logic
+    uint depth;  // levels of nodes below this one
+} extent_hdr;
+
+typedef struct {
+    uint logic;  // first logic block mapped
+    uint start;  // its disk block, or the node below for an index entry
+    uint len;    // blocks, unused by index entries
+} extent;
+
+#define ROOT_EXTENTS ((sizeof(uint) * (NDIRECT + 2) - sizeof(extent_hdr)) / sizeof(extent))
+#define NODE_EXTENTS ((BSIZE - sizeof(extent_hdr)) / sizeof(extent))
 
 // inode in memory
 // more useful fields can be added, e.g. reference count
@@ -44,6 +62,7 @@ typedef struct {
     uint refCount;  // Reference count, for current file in iNode
     uint linkCount; // Number of links to file, when this iNode serves as directory
     uint modTime; // Modification time
+    bool dirty;   // changed since it was last stored, iput writes it back only then
 } inode;
 
 
@@ -61,19 +80,51 @@ void iput(inode *ip);
 // Allocate a new inode of specified type (returns allocated inode or NULL)
 // Don't forget to use iput()
 inode *ialloc(short type);
+// the same, placed near the directory parent with cylinder groups
+inode *ialloc_near(short type, uint parent);
 
 // Update disk inode with memory inode contents
 void iupdate(inode *ip);
+// Note a change to the memory inode for the iput that follows; readers leave it clean
+void idirty(inode *ip);
 
 // Read from an inode (returns bytes read or -1 on error)
 int readi(inode *ip, uchar *dst, uint off, uint n);
 
+// readi reads ahead on inodes read sequentially: the window starts at min_window blocks
+// and doubles with every sequential read up to max_window, 0 turns readahead off
+#define RA_MIN_WINDOW 4
+#define RA_MAX_WINDOW 64
+void set_readahead(uint min_window, uint max_window);
+
 // Write to an inode (returns bytes written or -1 on error)
 int writei(inode *ip, uchar *src, uint off, uint n);
 
+// Small appends to a file are buffered in memory and get their blocks only when they are
+// written out: once a file has more than the threshold (DA_MAX_BYTES at most) buffered,
+// by isync, by a write that is not an append, when another file needs the buffer, or by
+// the bcache flusher once the first of them is DA_MAX_AGE_MS old.
+// The dinode records the size without the buffered bytes until then; iget and readi see them.
+#define DA_MAX_BYTES (16 * BSIZE)
+#define DA_MAX_AGE_MS 1000
+void set_delalloc(uint max_bytes); // 0 writes every append through
+// write out what is buffered for ip, 0 on success and -1 when the disk is full; the
+// bytes stay buffered then
+int isync(inode *ip);
+int isync_all();
+
+typedef struct {
+    long appends;  // writes taken into a buffer
+    long bytes;    // ... and their size
+    long flushes;  // buffers written out, each one allocation and one write_blocks
+} da_stat;
+void get_da_stats(da_stat *st);
+void reset_da_stats();
+
 void copy_to_diNode(dinode *d, inode *ip);
 
 inline uint maxFileSize(){
+    if(sb.flags & SB_EXTENTS) return ~0u; // extents map as many blocks as the file size can count
     uint ret = 0;
     ret += NDIRECT * BSIZE;
     ret += BSIZE * (BSIZE / sizeof(uint)); //single indirect
@@ -82,6 +133,24 @@ inline uint maxFileSize(){
 }
 
 void store_iNode(inode *ip); //store an inode to disk
-inode *load_iNode(uint inum); // load an inode from disk 
+inode *load_iNode(uint inum); // load an inode from disk, without the appends still buffered
+
+// iget and store_iNode go through a table of recently used dinodes, kept in step with the disk
+typedef struct {
+    long hits;    // dinodes found in the table
+    long misses;  // ... and read from their inode block
+} itable_stat;
+void get_itable_stats(itable_stat *st);
+void reset_itable_stats();
+// iget hands out one shared inode per inum, kept after its last iput until the slot is reused
+typedef struct {
+    long hits;       // iget found the inode in memory
+    long misses;     // ... and read its dinode
+    long overflows;  // every cached inode was in use, one more was allocated
+    long stores;     // iput wrote a dirty inode back
+    long clean;      // ... or had nothing to write
+} icache_stat;
+void get_icache_stats(icache_stat *st);
+void reset_icache_stats();
 int wipeout_inode(inode *ip); // wipe out an inode from disk
 #endif
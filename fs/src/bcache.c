@@ -0,0 +1,355 @@
+#include "../include/bcache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../include/log.h"
+
+typedef struct buf {
+    uint bno;
+    bool dirty;
+    bool ra;                  // read ahead and not asked for yet
+    long gen;                 // bumped by every change, a flush only cleans what it wrote
+    struct buf *prev, *next;  // LRU list, most recently used first
+    struct buf *hnext;        // hash chain
+    uchar data[BSIZE];
+} buf;
+
+// everything below is protected by lock
+static buf *bufs = NULL;
+static int nbufs = 0;
+static buf **hash = NULL;
+static int nhash = 0;
+static buf lru;               // sentinel of the LRU list, cached blocks only
+static buf *free_bufs = NULL; // never used yet, chained through next
+static int ndirty = 0;
+static long epoch = 0;        // bumped whenever the disk is written
+static bcache_stat stats;
+static bcache_writeback_fn writeback = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// one flush at a time, so an older copy of a block can never land after a newer one
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond;
+static pthread_t flusher;
+static bool running = false;
+static void (*tick)() = NULL; // called by the flusher on every wakeup, without lock
+
+static buf *lookup(uint bno){
+    for(buf *b = hash[bno % nhash]; b; b = b->hnext){
+        if(b->bno == bno) return b;
+    }
+    return NULL;
+}
+
+static void unhash(buf *b){
+    buf **pp = &hash[b->bno % nhash];
+    while(*pp != b) pp = &(*pp)->hnext;
+    *pp = b->hnext;
+}
+
+static void lru_remove(buf *b){
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void lru_front(buf *b){
+    b->next = lru.next;
+    b->prev = &lru;
+    lru.next->prev = b;
+    lru.next = b;
+}
+
+static void lru_back(buf *b){
+    b->prev = lru.prev;
+    b->next = &lru;
+    lru.prev->next = b;
+    lru.prev = b;
+}
+
+// the cached copy of b is replaced, a read ahead nobody used was wasted
+static void drop_ra(buf *b){
+    if(b->ra) stats.ra_wasted++;
+    b->ra = false;
+}
+
+// a buffer to cache bno in, taking the least recently used clean block if need be.
+// When every block is dirty they are flushed first and NULL is returned: the lock
+// was dropped meanwhile, the caller starts over
+static buf *get_buf(uint bno){
+    buf *b = free_bufs;
+    if(b){
+        free_bufs = b->next;
+    }else{
+        for(b = lru.prev; b != &lru && b->dirty; b = b->prev);
+        if(b == &lru){
+            pthread_mutex_unlock(&lock);
+            bcache_flush();
+            pthread_mutex_lock(&lock);
+            return NULL;
+        }
+        unhash(b);
+        lru_remove(b);
+        stats.evictions++;
+        if(b->ra) stats.ra_wasted++;
+    }
+    b->bno = bno;
+    b->dirty = false;
+    b->ra = false;
+    b->gen = 0;
+    b->hnext = hash[bno % nhash];
+    hash[bno % nhash] = b;
+    lru_front(b);
+    return b;
+}
+
+int bcache_read(uint bno, uchar *data){
+    pthread_mutex_lock(&lock);
+    buf *b = nbufs ? lookup(bno) : NULL;
+    if(b){
+        memcpy(data, b->data, BSIZE);
+        lru_remove(b);
+        if(b->ra){
+            // streamed data is read once, it goes to the cold end and makes room for the next window
+            b->ra = false;
+            stats.ra_useful++;
+            lru_back(b);
+        }else{
+            lru_front(b);
+        }
+        stats.hits++;
+    }else{
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&lock);
+    return b != NULL;
+}
+
+long bcache_epoch(){
+    pthread_mutex_lock(&lock);
+    long e = epoch;
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+static void fill(uint bno, const uchar *data, long ep, bool ra){
+    pthread_mutex_lock(&lock);
+    // a newer copy is cached already or the disk changed under the read
+    while(nbufs && ep == epoch && lookup(bno) == NULL){
+        buf *b = get_buf(bno);
+        if(b){
+            memcpy(b->data, data, BSIZE);
+            b->ra = ra;
+            if(ra) stats.ra_fills++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void bcache_fill(uint bno, const uchar *data, long ep){
+    fill(bno, data, ep, false);
+}
+
+void bcache_prefetched(uint bno, const uchar *data, long ep){
+    fill(bno, data, ep, true);
+}
+
+int bcache_cached(uint bno){
+    pthread_mutex_lock(&lock);
+    int cached = nbufs && lookup(bno) != NULL;
+    pthread_mutex_unlock(&lock);
+    return cached;
+}
+
+void bcache_write(uint bno, const uchar *data){
+    pthread_mutex_lock(&lock);
+    if(nbufs == 0){
+        pthread_mutex_unlock(&lock);
+        writeback(&bno, 1, (uchar *)data); // no cache, write through
+        return;
+    }
+    buf *b;
+    while((b = lookup(bno)) == NULL && (b = get_buf(bno)) == NULL);
+    drop_ra(b);
+    memcpy(b->data, data, BSIZE);
+    if(!b->dirty) ndirty++;
+    b->dirty = true;
+    b->gen++;
+    epoch++; // a miss read before this must not be cached once the block is written back
+    lru_remove(b);
+    lru_front(b);
+    pthread_mutex_unlock(&lock);
+}
+
+void bcache_update(uint bno, const uchar *data){
+    pthread_mutex_lock(&lock);
+    epoch++;
+    buf *b = nbufs ? lookup(bno) : NULL;
+    if(b){
+        drop_ra(b);
+        if(data) memcpy(b->data, data, BSIZE);
+        else memset(b->data, 0, BSIZE);
+        b->gen++; // a dirty block stays dirty, the flush in progress may hold an older copy
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int bcache_dirty(uint bno){
+    pthread_mutex_lock(&lock);
+    buf *b = nbufs ? lookup(bno) : NULL;
+    int dirty = b && b->dirty;
+    pthread_mutex_unlock(&lock);
+    return dirty;
+}
+
+typedef struct {
+    uint bno;
+    long gen;
+    buf *b;
+} flush_ent;
+
+static int by_bno(const void *a, const void *b){
+    uint x = ((const flush_ent *)a)->bno, y = ((const flush_ent *)b)->bno;
+    return x < y ? -1 : x > y;
+}
+
+int bcache_flush(){
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&lock);
+    int n = 0;
+    flush_ent *ents = malloc(max(ndirty, 1) * sizeof(flush_ent));
+    for(buf *b = lru.next; b != &lru; b = b->next){
+        if(b->dirty) ents[n++] = (flush_ent){b->bno, b->gen, b};
+    }
+    // in block order, so the write back goes out in as few requests as possible
+    qsort(ents, n, sizeof(flush_ent), by_bno);
+    uint *bnos = malloc(max(n, 1) * sizeof(uint));
+    uchar *data = malloc(max(n, 1) * BSIZE);
+    for(int i = 0; i < n; i++){
+        bnos[i] = ents[i].bno;
+        memcpy(data + i * BSIZE, ents[i].b->data, BSIZE);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if(n > 0) writeback(bnos, n, data);
+
+    pthread_mutex_lock(&lock);
+    epoch++;
+    for(int i = 0; i < n; i++){
+        buf *b = lookup(bnos[i]); // dirty blocks are never evicted, only changed
+        if(b && b->dirty && b->gen == ents[i].gen){
+            b->dirty = false;
+            ndirty--;
+        }
+    }
+    stats.writebacks += n;
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&flush_lock);
+    free(ents);
+    free(bnos);
+    free(data);
+    return 0;
+}
+
+static void *flusher_main(void *arg){
+    pthread_mutex_lock(&lock);
+    while(running){
+        struct timespec due;
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        due.tv_sec += BCACHE_FLUSH_MS / 1000;
+        due.tv_nsec += (BCACHE_FLUSH_MS % 1000) * 1000000L;
+        if(due.tv_nsec >= 1000000000L){
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flusher_cond, &lock, &due);
+        if(running && tick){
+            void (*fn)() = tick;
+            pthread_mutex_unlock(&lock);
+            fn();
+            pthread_mutex_lock(&lock);
+        }
+        if(running && ndirty > 0){
+            pthread_mutex_unlock(&lock);
+            bcache_flush();
+            pthread_mutex_lock(&lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void bcache_set_tick(void (*fn)()){
+    pthread_mutex_lock(&lock);
+    tick = fn;
+    pthread_mutex_unlock(&lock);
+}
+
+void bcache_init(int nbuf, bcache_writeback_fn wb){
+    pthread_mutex_lock(&lock);
+    writeback = wb;
+    if(nbufs > 0 || nbuf <= 0){
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    nbufs = nbuf;
+    nhash = 2 * nbuf + 1;
+    bufs = calloc(nbufs, sizeof(buf));
+    hash = calloc(nhash, sizeof(buf *));
+    lru.next = lru.prev = &lru;
+    free_bufs = NULL;
+    for(int i = nbufs - 1; i >= 0; i--){
+        bufs[i].next = free_bufs;
+        free_bufs = &bufs[i];
+    }
+    ndirty = 0;
+
+    // the flusher sleeps on CLOCK_MONOTONIC
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flusher_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    running = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+    if(!running) Warn("bcache: no flusher thread, dirty blocks wait for an explicit flush");
+    pthread_mutex_unlock(&lock);
+    Log("bcache: %d blocks, written back every %d ms", nbuf, BCACHE_FLUSH_MS);
+}
+
+void bcache_shutdown(){
+    pthread_mutex_lock(&lock);
+    bool was_running = running;
+    running = false;
+    if(was_running) pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&lock);
+    if(was_running) pthread_join(flusher, NULL);
+    if(nbufs == 0) return;
+
+    bcache_flush();
+    pthread_mutex_lock(&lock);
+    Log("bcache: %ld hits, %ld misses, %ld evictions, %ld blocks written back",
+        stats.hits, stats.misses, stats.evictions, stats.writebacks);
+    Log("bcache: %ld blocks read ahead, %ld used, %ld wasted", stats.ra_fills, stats.ra_useful, stats.ra_wasted);
+    free(bufs);
+    free(hash);
+    bufs = NULL;
+    hash = NULL;
+    nbufs = nhash = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+void bcache_get_stats(bcache_stat *st){
+    pthread_mutex_lock(&lock);
+    *st = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+void bcache_reset_stats(){
+    pthread_mutex_lock(&lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "../include/blkdev.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../include/log.h"
+
+// one device is open at a time
+static int fd = -1;
+static uchar *mem = NULL;  // the mapping or the RAM disk
+static off_t disk_size = 0;
+static uint nblocks = 0;
+
+static int in_range(const uint *bnos, int n){
+    for(int i = 0; i < n; i++){
+        if(bnos[i] >= nblocks){
+            Warn("blkdev: block %u out of range", bnos[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// open the image, growing it to the disk size; a larger image keeps its size
+static int open_image(const char *path, int ncyl, int nsec){
+    if(ncyl <= 0 || nsec <= 0){
+        Error("blkdev: invalid geometry %d x %d", ncyl, nsec);
+        return -1;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0){
+        Error("blkdev: cannot open %s", path);
+        return -1;
+    }
+    disk_size = (off_t)ncyl * nsec * BSIZE;
+    nblocks = ncyl * nsec;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (st.st_size < disk_size && ftruncate(fd, disk_size) != 0)){
+        Error("blkdev: cannot size %s", path);
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void close_image(){
+    if(fd >= 0) close(fd);
+    fd = -1;
+    nblocks = 0;
+}
+
+/* mmap */
+
+static int mmap_open(const char *path, int ncyl, int nsec){
+    if(open_image(path, ncyl, nsec) != 0) return -1;
+    mem = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if(mem == MAP_FAILED){
+        Error("blkdev: cannot map %s", path);
+        mem = NULL;
+        close_image();
+        return -1;
+    }
+    Log("blkdev: %s mapped, %d cylinders, %d sectors per cylinder", path, ncyl, nsec);
+    return 0;
+}
+
+static void mmap_close(){
+    if(mem){
+        msync(mem, disk_size, MS_SYNC);
+        munmap(mem, disk_size);
+    }
+    mem = NULL;
+    close_image();
+}
+
+static int mem_read(const uint *bnos, int n, uchar *buf){
+    if(!in_range(bnos, n)) return -1;
+    for(int i = 0; i < n; i++) memcpy(buf + i * BSIZE, mem + (size_t)bnos[i] * BSIZE, BSIZE);
+    return 0;
+}
+
+static int mem_write(const uint *bnos, int n, const uchar *buf){
+    if(!in_range(bnos, n)) return -1;
+    for(int i = 0; i < n; i++) memcpy(mem + (size_t)bnos[i] * BSIZE, buf + i * BSIZE, BSIZE);
+    return 0;
+}
+
+static int mem_discard(uint first, uint n){
+    if(first >= nblocks || n > nblocks - first) return -1;
+    memset(mem + (size_t)first * BSIZE, 0, (size_t)n * BSIZE);
+    return 0;
+}
+
+static int mmap_flush(){
+    return msync(mem, disk_size, MS_SYNC) == 0 ? 0 : -1;
+}
+
+const blkdev_ops blkdev_mmap = {"mmap", mmap_open, mmap_close, mem_read, mem_write, mem_discard, mmap_flush};
+
+/* pread */
+
+static int pread_open(const char *path, int ncyl, int nsec){
+    if(open_image(path, ncyl, nsec) != 0) return -1;
+    Log("blkdev: %s opened for pread, %d cylinders, %d sectors per cylinder", path, ncyl, nsec);
+    return 0;
+}
+
+// a run of adjacent blocks moves with one call
+static int run_length(const uint *bnos, int n){
+    int len = 1;
+    while(len < n && bnos[len] == bnos[0] + len) len++;
+    return len;
+}
+
+static int pread_read(const uint *bnos, int n, uchar *buf){
+    if(!in_range(bnos, n)) return -1;
+    for(int i = 0; i < n; ){
+        int len = run_length(bnos + i, n - i);
+        size_t want = (size_t)len * BSIZE;
+        if(pread(fd, buf + i * BSIZE, want, (off_t)bnos[i] * BSIZE) != (ssize_t)want) return -1;
+        i += len;
+    }
+    return 0;
+}
+
+static int pread_write(const uint *bnos, int n, const uchar *buf){
+    if(!in_range(bnos, n)) return -1;
+    for(int i = 0; i < n; ){
+        int len = run_length(bnos + i, n - i);
+        size_t want = (size_t)len * BSIZE;
+        if(pwrite(fd, buf + i * BSIZE, want, (off_t)bnos[i] * BSIZE) != (ssize_t)want) return -1;
+        i += len;
+    }
+    return 0;
+}
+
+static int pread_discard(uint first, uint n){
+    if(first >= nblocks || n > nblocks - first) return -1;
+    off_t off = (off_t)first * BSIZE, len = (off_t)n * BSIZE;
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) return 0;
+    // no hole punching here, write the zeros
+    static const uchar zeros[64 * BSIZE];
+    while(len > 0){
+        size_t chunk = min(len, (off_t)sizeof(zeros));
+        if(pwrite(fd, zeros, chunk, off) != (ssize_t)chunk) return -1;
+        off += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int pread_flush(){
+    return fdatasync(fd) == 0 ? 0 : -1;
+}
+
+const blkdev_ops blkdev_pread = {"pread", pread_open, close_image, pread_read, pread_write, pread_discard,
+                                 pread_flush};
+
+/* RAM */
+
+static int ram_open(const char *path, int ncyl, int nsec){
+    if(ncyl <= 0 || nsec <= 0){
+        Error("blkdev: invalid geometry %d x %d", ncyl, nsec);
+        return -1;
+    }
+    disk_size = (off_t)ncyl * nsec * BSIZE;
+    mem = calloc(1, disk_size);
+    if(mem == NULL){
+        Error("blkdev: no memory for a %ld byte RAM disk", (long)disk_size);
+        return -1;
+    }
+    nblocks = ncyl * nsec;
+    Log("blkdev: RAM disk, %d cylinders, %d sectors per cylinder", ncyl, nsec);
+    return 0;
+}
+
+static void ram_close(){
+    free(mem);
+    mem = NULL;
+    nblocks = 0;
+}
+
+static int ram_flush(){
+    return 0;
+}
+
+const blkdev_ops blkdev_ram = {"ram", ram_open, ram_close, mem_read, mem_write, mem_discard, ram_flush};
@@ -1,12 +1,13 @@
 #include "../include/block.h"
+#include "../include/bcache.h"
+#include "../include/blkdev.h"
+#include "../include/bufpool.h"
 #include <assert.h>
 
 
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
 
@@ -20,168 +21,398 @@
 #include "stdbool.h"
 #include "../../include/tcp_utils.h"
 #include "../../include/tcp_buffer.h"
+#include "../../include/bds_proto.h"
+#include <arpa/inet.h>
+#include <pthread.h>
 #define CMD_SIZE 4096
-#define BLOCKSIZE 512
-
-int _ncyl, _nsec, ttd;
-char *diskFile;
-int fd;
-int FILE_SIZE = 0; //n bytes
-int lastCyl = 0; // last cylinder accessed
-
-void diskDelay(int c1, int c2){ // simulating the delay between cylinders
-    int delay = ttd * abs(c1 - c2);
-    usleep(delay);
-    if(delay > 0){
-        // fprintf(stderr, "Disk delay: %d microseconds\n", delay);        
-    }
-}
-
-int init_disk(char *filename, int ncyl, int nsec, int _ttd) {
-    _ncyl = ncyl;
-    _nsec = nsec;
-    ttd = _ttd;
-    lastCyl = 0;
-    FILE_SIZE = ncyl * nsec * BLOCKSIZE;
-    fd = open(filename , O_RDWR | O_CREAT, 0644);
-    if(fd == -1){
-        Log("Error opening/creating file");
-        close(fd);
+#define RANGE_MSG_SIZE (CMD_SIZE + MAX_RANGE * BSIZE)
+int _ncyl, _nsec;
+
+int BDS_port=10356;
+char BDS_addr[32] = "localhost";
+static char BDS_response[4096];
+
+tcp_client diskClient;
+
+
+superblock sb={
+    .magic = 0x12345678,
+    .size = 2048,  // 2048 blocks
+    .bmapstart = 1,
+    .bitmap = NULL,
+    .n_blocks = 1024,
+    .n_iNodes = 0,
+    .data_start = 1024,
+    .iNode_start = 2,
+    .n_bitmap_blocks = 0,
+    .root = 0,
+    .n_users = 0,
+    .users = {0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
+};
+
+static bool bds_binary = false; // the BDS accepted the binary protocol of bds_proto.h
+
+// the device in this process that replaces the BDS, NULL to use the BDS; see set_block_device
+static const blkdev_ops *local_dev = NULL;
+static char local_path[256];
+static int local_ncyl, local_nsec;
+static bool dev_ready = false; // diskClientSetup connected to the BDS or opened local_dev
+
+static void _disk_read_blocks(const uint *bnos, int n, uchar *buf);
+static void _disk_write_blocks(const uint *bnos, int n, uchar *buf);
+static bool _range_ok(const uint *bnos, int n);
+static void _bitmap_clean();
+static void _region_range(int region, uint k, uint *lo, uint *hi);
+enum { REGION_INODE, REGION_DATA, REGION_ANY, NREGION };
+
+int set_block_device(const char *spec){
+    static const blkdev_ops *devs[] = {&blkdev_mmap, &blkdev_pread, &blkdev_ram};
+    if(dev_ready){
+        Error("set_block_device: the block device is in use already");
         return -1;
     }
-    // open file
-    int result = lseek(fd, FILE_SIZE - 1, SEEK_SET); // expand the file to the size of the disk
-    if(result == -1){
-        Log("error when stretching file with lseek\n");
-        close(fd);
-        return -1;
+    if(strcmp(spec, "bds") == 0){
+        local_dev = NULL;
+        return 0;
     }
-    
-    result = write(fd, "", 1); // write a byte at the end of the file
-    if(result < 0){
-        Log("error when writing to file at the begining\n");
-        close(fd);
-        return -1;
+    char copy[sizeof(local_path) + 32], *save;
+    snprintf(copy, sizeof(copy), "%s", spec);
+    char *name = strtok_r(copy, ":", &save);
+    const blkdev_ops *dev = NULL;
+    for(int i = 0; name && i < (int)(sizeof(devs) / sizeof(devs[0])); i++){
+        if(strcmp(name, devs[i]->name) == 0) dev = devs[i];
     }
-    // stretch the file
-
-    diskFile = (char *)mmap(NULL,FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(diskFile == MAP_FAILED){
-        Log("error when mapping file to memory\n");
-        close(fd);
+    char *path = dev == &blkdev_ram ? "" : strtok_r(NULL, ":", &save);
+    char *cyl = strtok_r(NULL, ":", &save), *sec = strtok_r(NULL, ":", &save);
+    if(dev == NULL || path == NULL || cyl == NULL || sec == NULL || atoi(cyl) <= 0 || atoi(sec) <= 0){
+        Error("set_block_device: %s is not bds, mmap:FILE:NCYL:NSEC, pread:FILE:NCYL:NSEC or ram:NCYL:NSEC", spec);
         return -1;
     }
-    // mmap
-
-    Log("Disk initialized: %s, %d Cylinders, %d Sectors per cylinder", filename, ncyl, nsec);
+    local_dev = dev;
+    snprintf(local_path, sizeof(local_path), "%s", path);
+    local_ncyl = atoi(cyl);
+    local_nsec = atoi(sec);
     return 0;
 }
 
-// all cmd functions return 0 on success
-int disk_cmd_i(int *ncyl, int *nsec) {
-    // get the disk info
-    *ncyl = _ncyl;
-    *nsec = _nsec;
-    return 0;
+const char *block_device(){
+    return local_dev ? local_dev->name : "bds";
 }
 
-int disk_cmd_r(int cyl, int sec, char *buf) {
-    // read data from disk, store it in buf
-    if (cyl >= _ncyl || sec >= _nsec || cyl < 0 || sec < 0) {
-        Log("Invalid cylinder or sector");
-        return 1;
+void diskClientSetup(){
+    if(local_dev){
+        if(local_dev->open(local_path, local_ncyl, local_nsec) != 0){
+            Error("diskClientSetup: cannot open the %s block device", local_dev->name);
+            exit(EXIT_FAILURE);
+        }
+        _ncyl = local_ncyl;
+        _nsec = local_nsec;
+        dev_ready = true;
+        Log("diskClientSetup: using the %s block device, no BDS", local_dev->name);
+        bcache_init(BCACHE_NBUF, _disk_write_blocks);
+        return;
     }
-    int start = (cyl * _nsec + sec) ;
-    if (start*BLOCKSIZE + BLOCKSIZE > FILE_SIZE) {
-        Log("Invalid read");
-        return 1; //read a block each time
+    assert(BDS_port > 0);
+    assert(strlen(BDS_addr) > 0);
+    diskClient = client_init(BDS_addr, BDS_port);
+
+    // ask for the binary protocol, an older BDS answers "Unknown command" and we stay on text
+    char msg[CMD_SIZE];
+    client_send(diskClient, "V", 2);
+    int n = client_recv(diskClient, msg, CMD_SIZE - 1);
+    msg[max(n, 0)] = '\0';
+    bds_binary = n > 4 && strncmp(msg, "Yes ", 4) == 0 && atoi(msg + 4) == BDS_VERSION;
+    dev_ready = true;
+    Log("diskClientSetup: using %s protocol", bds_binary ? "binary" : "text");
+    bcache_init(BCACHE_NBUF, _disk_write_blocks);
+}
+
+/*
+ * Asynchronous block I/O. Every binary request carries a tag and the BDS may
+ * answer them in any order, so each request in flight owns a slot of bio[]
+ * that says where its reply goes. Replies are only read off the socket by
+ * _bio_reap, on behalf of whoever is waiting. bio_lock serializes users of the
+ * connection, readers of the FS server run concurrently.
+ */
+typedef struct {
+    uint32_t tag;  // 0 when the slot is free
+    bool done;
+    int status;    // 0 on success
+    uchar *out;    // reply payload destination
+    int outlen;    // expected payload length
+    int bytes;     // charged against bio_bytes while in flight
+} bio_slot;
+
+// what the requests sent to the BDS would cost a disk serving them in order
+static block_stat bstat;
+static int bstat_cyl = 0;
+static pthread_mutex_t bstat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// account for a request touching vec (or count blocks from first when vec is NULL)
+static void _account(uint first, uint count, const uint *vec){
+    if(count == 0 || _nsec <= 0) return;
+    pthread_mutex_lock(&bstat_lock);
+    bstat.requests++;
+    for(uint i = 0; i < count; i++){
+        int cyl = (vec ? vec[i] : first + i) / _nsec;
+        bstat.seek_distance += abs(cyl - bstat_cyl);
+        bstat_cyl = cyl;
     }
-    memcpy(buf, diskFile + start*BLOCKSIZE, BLOCKSIZE);
+    pthread_mutex_unlock(&bstat_lock);
+}
 
-    diskDelay(lastCyl, cyl); // simulate the delay between cylinders
-    lastCyl = cyl; // update the last cylinder accessed
+void get_block_stats(block_stat *st){
+    pthread_mutex_lock(&bstat_lock);
+    *st = bstat;
+    pthread_mutex_unlock(&bstat_lock);
+}
 
-    return 0;
+void reset_block_stats(){
+    pthread_mutex_lock(&bstat_lock);
+    memset(&bstat, 0, sizeof(bstat));
+    pthread_mutex_unlock(&bstat_lock);
+}
+
+static bio_slot bio[BIO_QDEPTH];
+static uint32_t bio_next_tag = 1;
+static int bio_bytes = 0; // request and reply payload of everything in flight
+static pthread_mutex_t bio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// tags stay positive ints, 0 marks a free slot
+static int _bio_new_tag(){
+    int tag = bio_next_tag;
+    bio_next_tag = bio_next_tag % INT_MAX + 1;
+    return tag;
 }
 
-int disk_cmd_w(int cyl, int sec, int len, char *data) {
-    if (cyl >= _ncyl || sec >= _nsec || cyl < 0 || sec < 0) {
-        Log("Invalid cylinder or sector");
-        return 1;
+static bio_slot *_bio_find(uint32_t tag){
+    for(int i = 0; i < BIO_QDEPTH; i++){
+        if(bio[i].tag == tag && tag != 0) return &bio[i];
     }
+    return NULL;
+}
+
+static void _bio_complete(bio_slot *s, int status){
+    s->done = true;
+    s->status = status;
+    bio_bytes -= s->bytes;
+    s->bytes = 0;
+}
 
-    char *buf = (char*)malloc(BLOCKSIZE * sizeof(char));
-    if (buf == NULL) {
-        Log("Error allocating memory");
-        return 1;
+// read one reply and complete its request, caller holds bio_lock
+static int _bio_reap(){
+    char *msg;
+    int n = client_peek(diskClient, &msg);
+    if(n <= 0){
+        Error("_bio_reap: connection to the BDS lost");
+        for(int i = 0; i < BIO_QDEPTH; i++){
+            if(bio[i].tag && !bio[i].done) _bio_complete(&bio[i], -1);
+        }
+        return -1;
+    }
+    bds_resp_hdr resp;
+    bio_slot *s = NULL;
+    if(n >= (int)sizeof(resp)){
+        memcpy(&resp, msg, sizeof(resp));
+        s = _bio_find(ntohl(resp.tag));
+    }
+    if(s == NULL || s->done || resp.magic != BDS_MAGIC){
+        Error("_bio_reap: unexpected reply");
+        client_release(diskClient, n);
+        return -1;
     }
+    int plen = ntohl(resp.len);
+    int ok = resp.status == BDS_OK && plen == s->outlen && n == (int)sizeof(resp) + plen;
+    if(ok && s->out) memcpy(s->out, msg + sizeof(resp), plen);
+    client_release(diskClient, n);
+    _bio_complete(s, ok ? 0 : -1);
+    return 0;
+}
 
-    if(len > BLOCKSIZE){
-        Log("Data too long");
-        free(buf);
-        return  1;
-    }else{
-        memcpy(buf, data, len);
-        if(len < BLOCKSIZE){
-            memset(buf + len, 0, BLOCKSIZE - len);
-            // fill the rest of the buffer with zeros
+// a free slot, reaping replies while the queue or the byte budget is full; caller holds bio_lock
+static bio_slot *_bio_slot(int bytes){
+    while(1){
+        bio_slot *free_slot = NULL;
+        int inflight = 0;
+        for(int i = 0; i < BIO_QDEPTH; i++){
+            if(bio[i].tag == 0) free_slot = &bio[i];
+            else if(!bio[i].done) inflight++;
         }
+        bool budget = bio_bytes + bytes <= BIO_MAX_BYTES || inflight == 0;
+        if(free_slot && budget) return free_slot;
+        if(inflight == 0){
+            Error("_bio_slot: every slot holds a completion nobody waited for");
+            return NULL;
+        }
+        _bio_reap();
+    }
+}
+
+// send one tagged binary request; vec (block numbers) and data follow the header when given,
+// the reply payload must be exactly outlen bytes and lands in out. Returns the tag or -1
+static int _bio_send(uint8_t op, uint blockno, uint count, const uint *vec, const uchar *data,
+                     uchar *out, int outlen){
+    bds_req_hdr req = {.magic = BDS_MAGIC, .op = op, .flags = 0,
+                       .blockno = htonl(blockno), .count = htonl(count)};
+    uint32_t nvec[MAX_RANGE];
+    struct iovec iov[3];
+    int cnt = 0, len = 0;
+    iov[cnt++] = (struct iovec){&req, sizeof(req)};
+    if(vec){
+        for(uint i = 0; i < count; i++) nvec[i] = htonl(vec[i]);
+        iov[cnt++] = (struct iovec){nvec, count * sizeof(uint32_t)};
+        len += count * sizeof(uint32_t);
+    }
+    if(data){
+        iov[cnt++] = (struct iovec){(void *)data, count * BSIZE};
+        len += count * BSIZE;
     }
+    req.len = htonl(len);
 
-    int start = cyl * _nsec + sec;
-    memcpy(diskFile + start*BLOCKSIZE, buf, BLOCKSIZE);
-    free(buf);
-    // write data to disk
+    bio_slot *s = _bio_slot(len + outlen);
+    if(s == NULL) return -1;
+    _account(blockno, count, vec);
+    int tag = _bio_new_tag();
+    *s = (bio_slot){.tag = tag, .done = false, .out = out, .outlen = outlen, .bytes = len + outlen};
+    bio_bytes += s->bytes;
+    req.tag = htonl(tag);
+    client_sendv(diskClient, iov, cnt);
+    return tag;
+}
 
-    diskDelay(lastCyl, cyl); // simulate the delay between cylinders
-    lastCyl = cyl; // update the last cylinder accessed
-    return 0;
+// wait for tag and free its slot, caller holds bio_lock
+static int _bio_wait(int tag){
+    bio_slot *s = _bio_find(tag);
+    if(s == NULL) return -1;
+    while(!s->done) _bio_reap(); // a lost connection completes everything with an error
+    int status = s->status;
+    s->tag = 0;
+    return status;
 }
 
-void close_disk() {
-    close(fd);
-    if (diskFile != NULL) {
-        munmap(diskFile, FILE_SIZE); // unmap the file
-        diskFile = NULL;
+// one binary round trip
+static int _bds_call(uint8_t op, uint blockno, uint count, const uint *vec, const uchar *data,
+                     uchar *out, int outlen){
+    pthread_mutex_lock(&bio_lock);
+    int tag = _bio_send(op, blockno, count, vec, data, out, outlen);
+    int ret = tag < 0 ? -1 : _bio_wait(tag);
+    pthread_mutex_unlock(&bio_lock);
+    return ret;
+}
+
+// a request the text protocol or a local device already carried out, completed on the spot
+static int _bio_done_now(int status){
+    pthread_mutex_lock(&bio_lock);
+    bio_slot *s = _bio_slot(0);
+    int tag = -1;
+    if(s){
+        tag = _bio_new_tag();
+        *s = (bio_slot){.tag = tag, .done = true, .status = status};
     }
-    fd = -1; // set fd to -1 to indicate that the file is closed
-    FILE_SIZE = 0; // set FILE_SIZE to 0 to indicate that the file is closed
-    Log("Disk closed");
-    // close the file
+    pthread_mutex_unlock(&bio_lock);
+    return tag;
 }
 
-int BDS_port=10356;
-char BDS_addr[32] = "localhost";
-static char BDS_response[4096];
+static int _submit_blocks(bool is_read, const uint *bnos, int n, uchar *buf){
+    if(!dev_ready) diskClientSetup();
+    if(n <= 0 || n > MAX_RANGE){
+        Warn("submit: %d blocks do not fit one request", n);
+        return -1;
+    }
+    if(local_dev){
+        if(!_range_ok(bnos, n)) return -1;
+        _account(0, n, bnos);
+        return _bio_done_now(is_read ? local_dev->read(bnos, n, buf) : local_dev->write(bnos, n, buf));
+    }
+    if(!bds_binary){
+        if(is_read) _disk_read_blocks(bnos, n, buf);
+        else _disk_write_blocks(bnos, n, buf);
+        return _bio_done_now(0);
+    }
+    for(int i = 0; i < n; i++){
+        if(bnos[i] >= sb.size){
+            Warn("submit: block number %d out of range", bnos[i]);
+            return -1;
+        }
+    }
+    bool seq = true;
+    for(int i = 1; i < n; i++) seq = seq && bnos[i] == bnos[0] + i;
+    pthread_mutex_lock(&bio_lock);
+    int tag;
+    if(is_read){
+        tag = _bio_send(seq ? BDS_OP_READ : BDS_OP_READV, bnos[0], n, seq ? NULL : bnos, NULL, buf, n * BSIZE);
+    }else{
+        tag = _bio_send(seq ? BDS_OP_WRITE : BDS_OP_WRITEV, bnos[0], n, seq ? NULL : bnos, buf, NULL, 0);
+    }
+    pthread_mutex_unlock(&bio_lock);
+    return tag;
+}
 
-tcp_client diskClient;
+int submit_read_blocks(const uint *bnos, int n, uchar *buf){
+    // the request goes straight to the disk, which must not miss changes still in the cache
+    for(int i = 0; i < n; i++){
+        if(bcache_dirty(bnos[i])){
+            bcache_flush();
+            break;
+        }
+    }
+    return _submit_blocks(true, bnos, n, buf);
+}
 
+int submit_write_blocks(const uint *bnos, int n, const uchar *buf){
+    int tag = _submit_blocks(false, bnos, n, (uchar *)buf);
+    for(int i = 0; tag > 0 && i < n; i++) bcache_update(bnos[i], buf + i * BSIZE);
+    return tag;
+}
 
-superblock sb={
-    .magic = 0x12345678,
-    .size = 2048,  // 2048 blocks
-    .bmapstart = 1,
-    .bitmap = NULL,
-    .n_blocks = 1024,
-    .n_iNodes = 0,
-    .data_start = 1024,
-    .iNode_start = 2,
-    .n_bitmap_blocks = 0,
-    .root = 0,
-    .n_users = 0,
-    .users = {0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0},
-};
+int poll_block_io(int *status){
+    pthread_mutex_lock(&bio_lock);
+    int tag = 0;
+    // take in whatever replies have already arrived, without blocking
+    while(diskClient && client_poll(diskClient, 0) > 0){
+        if(_bio_reap() < 0) break;
+    }
+    for(int i = 0; i < BIO_QDEPTH && tag == 0; i++){
+        if(bio[i].tag && bio[i].done){
+            tag = bio[i].tag;
+            if(status) *status = bio[i].status;
+            bio[i].tag = 0;
+        }
+    }
+    pthread_mutex_unlock(&bio_lock);
+    return tag;
+}
 
-void diskClientSetup(){
-    assert(BDS_port > 0);
-    assert(strlen(BDS_addr) > 0);
-    diskClient = client_init(BDS_addr, BDS_port);
+int wait_block_io(int tag){
+    pthread_mutex_lock(&bio_lock);
+    int ret = _bio_wait(tag);
+    pthread_mutex_unlock(&bio_lock);
+    return ret;
+}
+
+int drain_block_io(){
+    pthread_mutex_lock(&bio_lock);
+    int ret = 0;
+    for(int i = 0; i < BIO_QDEPTH; i++){
+        if(bio[i].tag && _bio_wait(bio[i].tag) != 0) ret = -1;
+    }
+    pthread_mutex_unlock(&bio_lock);
+    return ret;
 }
 
 
 void fetch_disk_info(){
+    if(!dev_ready) diskClientSetup(); // a local device knows its geometry once opened
     if(_nsec > 0 && _ncyl > 0) return; // already fetched
-    char *msg = malloc(CMD_SIZE);
+    if(bds_binary){
+        uint32_t info[2];
+        if(_bds_call(BDS_OP_INFO, 0, 0, NULL, NULL, (uchar *)info, sizeof(info)) == 0){
+            _ncyl = ntohl(info[0]);
+            _nsec = ntohl(info[1]);
+        }
+        return;
+    }
+    char *msg = buf_get(CMD_SIZE);
     strcpy(msg, "I");
     client_send(diskClient, msg, strlen(msg) + 1);
     int n = client_recv(diskClient, msg, CMD_SIZE);
@@ -193,14 +424,35 @@ void fetch_disk_info(){
     token = strtok(NULL, " ");
     assert(token != NULL);
     _nsec = atoi(token);
-    free(msg);
+    buf_put(msg);
+}
+
+
+static int format_groups = 0;         // cylinder groups of the next format, 0 for the two-region layout
+static uint format_flags = 0;         // SB_ flags of the next format, cleared by it
+static bool format_requested = false; // set_format_layout was called, reformat on the next mount
+
+void set_format_layout(int ngroups){
+    format_groups = max(ngroups, 0);
+    format_requested = true;
 }
 
+void set_format_extents(bool on){
+    format_flags = on ? format_flags | SB_EXTENTS : format_flags & ~SB_EXTENTS;
+    format_requested = true;
+}
+
+static uint mount_gen = 0;
+
+uint mount_generation(){
+    return __atomic_load_n(&mount_gen, __ATOMIC_ACQUIRE);
+}
 
 void _mount_disk(){
+    __atomic_add_fetch(&mount_gen, 1, __ATOMIC_RELEASE);
 
     // ensure TCP client is initialized
-    if (!diskClient) diskClientSetup();
+    if (!dev_ready) diskClientSetup();
 
     
     fetch_disk_info();
@@ -210,27 +462,60 @@ void _mount_disk(){
     read_block(0, tmp); // read superblock from disk
     memcpy(&sb, tmp, sizeof(sb)); // copy superblock to sb
 
-    if(sb.magic != 0x12345678){
+    if(sb.ngroups > sb.size || (sb.ngroups > 0 && sb.group_size * sb.ngroups < sb.size)){
+        sb.ngroups = 0; // written before the layout was recorded
+    }
+    if(sb.ipb > BSIZE) sb.ipb = 0;
+    if((sb.flags & 0xffff0000) != SB_FLAGS_TAG || (sb.flags & 0xffff & ~SB_EXTENTS) != 0){
+        sb.flags = 0; // written before the flags were recorded, or not by us
+    }
+    if(sb.magic != 0x12345678 || format_requested){
         Warn("FS not formated yet, reformating");
         sb.magic = 0x12345678;
         sb.size = _ncyl * _nsec;
         sb.bmapstart = 1;
         sb.n_bitmap_blocks = (sb.size / BPB) + 1;
         sb.iNode_start = sb.bmapstart + sb.n_bitmap_blocks; //start point of iNode
-        sb.data_start = sb.size / 2; // 50% of the disk for data
+        sb.ipb = INODES_PER_BLOCK;
+        sb.flags = SB_FLAGS_TAG | format_flags;
+        format_flags = 0;
+        // as many inodes as one per block on half the disk took, the rest for data
+        sb.data_start = sb.iNode_start + (sb.size / 2 - sb.iNode_start) / sb.ipb;
         sb.n_blocks = sb.size - sb.data_start; //remaining blocks for data
         sb.n_iNodes = sb.data_start - sb.iNode_start; //remaining blocks for iNodes
+        sb.ngroups = 0;
+        sb.group_size = 0;
+        if(format_groups > 0){
+            // groups of whole cylinders, each one as many inodes as half of it holds blocks
+            uint cpg = (_ncyl + format_groups - 1) / format_groups;
+            sb.group_size = cpg * _nsec;
+            sb.ngroups = (sb.size + sb.group_size - 1) / sb.group_size;
+            sb.data_start = sb.iNode_start;
+            sb.n_iNodes = sb.n_blocks = 0;
+            for(uint g = 0; g < sb.ngroups; g++){
+                uint lo, mid, hi;
+                _region_range(REGION_INODE, g, &lo, &mid);
+                _region_range(REGION_DATA, g, &mid, &hi);
+                sb.n_iNodes += mid - lo;
+                sb.n_blocks += hi - mid;
+            }
+        }
+        format_requested = false;
+        Log("_mount_disk: formatting with %s, files mapped by %s", sb.ngroups ? "cylinder groups" : "one inode and one data region",
+            extent_format() ? "extents" : "block pointers");
         
         sb.bitmap = (bool *)malloc(sb.n_bitmap_blocks * BSIZE);
         sb.root = 0; //uninitialized root 
 
         memset(sb.bitmap, 0 , sb.n_bitmap_blocks * BSIZE);
-        for(int i = sb.bmapstart; i < sb.bmapstart + sb.n_bitmap_blocks ; i++)
-            zero_block(i); //initialize bitmap blocks
-
-        zero_block(0); 
+        _bitmap_clean();
+        uint *bmap = (uint *)malloc((sb.n_bitmap_blocks + 1) * sizeof(uint));
+        bmap[0] = 0; // superblock
+        for(int i = 0; i < sb.n_bitmap_blocks; i++) bmap[i + 1] = sb.bmapstart + i;
+        discard_blocks(bmap, sb.n_bitmap_blocks + 1); //initialize bitmap blocks
+        free(bmap);
 
-        uchar *buf = (uchar *)malloc(BSIZE);
+        uchar *buf = (uchar *)calloc(1, BSIZE); // nothing past sb may look like a field later
         memcpy(buf, &sb, sizeof(sb));
         write_block(0, buf);
         free(buf); // write superblock to disk
@@ -242,48 +527,210 @@ void _mount_disk(){
             Warn("Error allocating memory for bitmap");
             return;
         }
-        for(int i = sb.bmapstart; i< sb.bmapstart + sb.n_bitmap_blocks; i++){
-            read_block(i, (uchar *)(sb.bitmap + (i - sb.bmapstart) * BSIZE));
-        }
-        // read bitmap from disk
+        _fetch_bitmap(); // read bitmap from disk
     }
 }
 
-void _fetch_bitmap(){
-    for(int i = 0; i < sb.n_bitmap_blocks; i++){
-        read_block(sb.bmapstart + i, (uchar *)(sb.bitmap + i * BSIZE));
+/*
+ * The bitmap in sb.bitmap is authoritative once it is loaded by _mount_disk or
+ * load_basic_data. Allocating or freeing flips bits in memory and marks their
+ * bitmap block dirty, _update_bitmap writes back only the dirty blocks.
+ */
+static bool *bmap_dirty = NULL; // per bitmap block
+static int bmap_nblocks = 0;
+static pthread_mutex_t bmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each bitmap block covers a group of BPB blocks and grp_free counts the free
+ * ones, so the search skips full groups without looking at them. Inside a
+ * group it tests 64 bits at a time. The allocators are next-fit: each region
+ * resumes after the block it handed out last. Words are read in host byte
+ * order, which puts block b at bit b % 64 on a little-endian machine.
+ */
+static int *grp_free = NULL;
+static uint cursor[NREGION];
+
+/*
+ * A region is one range of blocks in the original layout. With cylinder
+ * groups (sb.ngroups > 0) the inode and data regions have one range per
+ * group: a group is sb.group_size blocks of whole cylinders, its front
+ * holds inodes and the rest data, so a file's inode and its blocks stay a few
+ * cylinders apart. The inode part is half the group on images with one inode
+ * per block and 1 / (2 * ipb) of it with packed inodes.
+ */
+static uint _nranges(int region){
+    return region == REGION_ANY || sb.ngroups == 0 ? 1 : sb.ngroups;
+}
+
+// range k of region, empty when the group has no room left after the metadata
+static void _region_range(int region, uint k, uint *lo, uint *hi){
+    if(region == REGION_ANY){
+        *lo = 0;
+        *hi = sb.size;
+    }else if(sb.ngroups == 0){
+        *lo = region == REGION_INODE ? sb.iNode_start : sb.data_start;
+        *hi = region == REGION_INODE ? sb.data_start : sb.size;
+    }else{
+        uint start = max(k * sb.group_size, sb.iNode_start);
+        uint end = min((k + 1) * sb.group_size, sb.size);
+        if(start > end) start = end;
+        uint mid = start + (end - start) / (2 * inodes_per_block());
+        *lo = region == REGION_INODE ? start : mid;
+        *hi = region == REGION_INODE ? mid : end;
     }
 }
 
-void _update_bitmap(){
-    for(int i = 0; i < sb.n_bitmap_blocks; i++){
+// the range of region holding b, or -1
+static int _range_at(int region, uint b){
+    for(uint k = 0; k < _nranges(region); k++){
+        uint lo, hi;
+        _region_range(region, k, &lo, &hi);
+        if(b >= lo && b < hi) return k;
+    }
+    return -1;
+}
+
+// segment i of a search through region that starts at start: the rest of start's
+// range, the ranges after it, then the front of start's range. false past the end
+static bool _segment(int region, uint start, uint i, uint *from, uint *to){
+    uint n = _nranges(region), k0 = max(_range_at(region, start), 0);
+    if(i > n) return false;
+    uint lo, hi;
+    _region_range(region, (k0 + i) % n, &lo, &hi);
+    if(i == 0){
+        *from = max(start, lo);
+        *to = hi;
+    }else if(i < n){
+        *from = lo;
+        *to = hi;
+    }else{
+        *from = lo;
+        *to = max(min(start, hi), lo);
+    }
+    return true;
+}
+
+// where a search through region begins: goal if it lies in the region, else the cursor
+static uint _search_start(int region, uint goal){
+    if(goal != 0 && _range_at(region, goal) >= 0) return goal; // block 0 is the superblock, never a goal
+    if(_range_at(region, cursor[region]) >= 0) return cursor[region];
+    uint lo, hi;
+    _region_range(region, 0, &lo, &hi);
+    return lo;
+}
+
+// nothing in memory differs from the disk, recount the free blocks; caller holds bmap_lock or is mounting
+static void _bitmap_clean(){
+    if(bmap_nblocks != sb.n_bitmap_blocks){
+        free(bmap_dirty);
+        free(grp_free);
+        bmap_dirty = (bool *)malloc(max(sb.n_bitmap_blocks, 1) * sizeof(bool));
+        grp_free = (int *)malloc(max(sb.n_bitmap_blocks, 1) * sizeof(int));
+        bmap_nblocks = sb.n_bitmap_blocks;
+    }
+    memset(bmap_dirty, 0, bmap_nblocks * sizeof(bool));
+    memset(cursor, 0, sizeof(cursor));
+
+    const uint64_t *words = (const uint64_t *)sb.bitmap;
+    for(int g = 0; g < bmap_nblocks; g++){
+        uint lo = g * BPB, hi = min((uint)(g + 1) * BPB, sb.size);
+        int used = 0;
+        uint b = lo;
+        for(; b + 64 <= hi; b += 64) used += __builtin_popcountll(words[b / 64]);
+        for(; b < hi; b++) used += (((const uchar *)sb.bitmap)[b / 8] >> (b % 8)) & 1;
+        grp_free[g] = hi > lo ? (int)(hi - lo) - used : 0;
+    }
+}
+
+static bool _bitmap_test(uint b){
+    uchar *bm = (uchar *)sb.bitmap;
+    return (bm[b / 8] & (1u << (b % 8))) != 0;
+}
+
+// mark b used or free, caller holds bmap_lock
+static void _bitmap_mark(uint b, bool used){
+    if(_bitmap_test(b) == used) return;
+    uchar *bm = (uchar *)sb.bitmap;
+    if(used) bm[b / 8] |= (1u << (b % 8));
+    else bm[b / 8] &= ~(1u << (b % 8));
+    grp_free[b / BPB] += used ? -1 : 1;
+    bmap_dirty[b / BPB] = true;
+}
+
+// first free block in [lo, hi) or UINT_MAX, caller holds bmap_lock
+static uint _bitmap_find(uint lo, uint hi){
+    const uint64_t *words = (const uint64_t *)sb.bitmap;
+    for(uint b = lo; b < hi; ){
+        uint g = b / BPB;
+        if(grp_free[g] == 0){
+            b = (g + 1) * BPB; // nothing free in this group
+            continue;
+        }
+        uint64_t avail = ~words[b / 64] & (~0ULL << (b % 64));
+        if(avail){
+            uint f = b / 64 * 64 + __builtin_ctzll(avail);
+            return f < hi ? f : UINT_MAX;
+        }
+        b = b / 64 * 64 + 64;
+    }
+    return UINT_MAX;
+}
+
+// write back the dirty bitmap blocks, caller holds bmap_lock
+static void _bitmap_sync(){
+    for(int i = 0; i < bmap_nblocks; i++){
+        if(!bmap_dirty[i]) continue;
         write_block(sb.bmapstart + i, (uchar *)(sb.bitmap + i * BSIZE));
+        bmap_dirty[i] = false;
     }
 }
+
+// reload the whole bitmap from disk, dropping changes not written back
+void _fetch_bitmap(){
+    uint *bnos = buf_get(max(sb.n_bitmap_blocks, 1) * sizeof(uint));
+    for(int i = 0; i < sb.n_bitmap_blocks; i++) bnos[i] = sb.bmapstart + i;
+    pthread_mutex_lock(&bmap_lock);
+    read_blocks(bnos, sb.n_bitmap_blocks, (uchar *)sb.bitmap);
+    _bitmap_clean();
+    pthread_mutex_unlock(&bmap_lock);
+    buf_put(bnos);
+}
+
+void _update_bitmap(){
+    pthread_mutex_lock(&bmap_lock);
+    if(bmap_dirty) _bitmap_sync();
+    pthread_mutex_unlock(&bmap_lock);
+}
   
 
 void zero_block(uint bno) {
-    uchar buf[BSIZE];
-    memset(buf, 0, BSIZE);
-    write_block(bno, buf);
+    discard_blocks(&bno, 1); // no payload, the BDS hands back zeros
 }
 
-uint allocate_iNode_block(){ //为一个iNode分配一个块
-    _fetch_bitmap();
-    uchar *bm = (uchar *)sb.bitmap;
-    uint b;
-    for(b=sb.iNode_start ; b < sb.data_start ; b++){
-        uint byte = b / 8;
-        uint bit = b % 8;
-        if((bm[byte] & (1u << bit)) == 0) { //check if this bit is 0
-            // mark bit used
-            bm[byte] |= (1u << bit);
-            break;
-        }
+// next free block of region at goal or, without one, after its cursor, wrapping
+// around; marked used and written back, or 0
+static uint _allocate_in(int region, uint goal){
+    pthread_mutex_lock(&bmap_lock);
+    uint start = _search_start(region, goal), from, to, b = UINT_MAX;
+    for(uint i = 0; b == UINT_MAX && _segment(region, start, i, &from, &to); i++){
+        b = _bitmap_find(from, to);
     }
-    _update_bitmap();
+    if(b != UINT_MAX){
+        _bitmap_mark(b, true);
+        cursor[region] = b + 1;
+    }
+    _bitmap_sync();
+    pthread_mutex_unlock(&bmap_lock);
+    return b != UINT_MAX ? b : 0;
+}
 
-    if(b>=sb.data_start){
+uint allocate_iNode_block(){ //为一个iNode分配一个块
+    return allocate_iNode_block_near(0);
+}
+
+uint allocate_iNode_block_near(uint goal){
+    uint b = _allocate_in(REGION_INODE, goal);
+    if(b == 0){
         Warn("allocate inode: No free inodes blocks");
         return 0;
     }
@@ -293,21 +740,8 @@ uint allocate_iNode_block(){ //为一个iNode分配一个块
 }
 
 uint allocate_data_block(){
-    _fetch_bitmap();
-    uchar *bm = (uchar *)sb.bitmap;
-    uint b;
-    for(b=sb.data_start ; b < sb.size ; b++){
-        uint byte = b / 8;
-        uint bit = b % 8;
-        if((bm[byte] & (1u << bit)) == 0) { //check if this bit is 0
-            // mark bit used
-            bm[byte] |= (1u << bit);
-            break;
-        }
-    }
-    _update_bitmap();
-
-    if(b>=sb.size){
+    uint b = _allocate_in(REGION_DATA, 0);
+    if(b == 0){
         Warn("allocate data: No free data blocks");
         return 0;
     }
@@ -316,22 +750,105 @@ uint allocate_data_block(){
     return b;
 }
 
-uint allocate_block() {
-    _fetch_bitmap();
-    // bitmap is raw bytes: treat sb.bitmap memory as byte array
-    uchar *bm = (uchar *)sb.bitmap;
-    uint b;
-    for(b = 0; b < sb.size; b++) {
-        uint byte = b / 8;
-        uint bit = b % 8;
-        if((bm[byte] & (1u << bit)) == 0) { //check if this bit is 0
-            // mark bit used
-            bm[byte] |= (1u << bit);
-            break;
+#define EXTENT_PROBES 64 // free runs looked at before settling for the longest one seen
+
+// length of the free run at b, at most want and not past hi, caller holds bmap_lock
+static uint _free_run(uint b, uint hi, uint want){
+    uint len = 0;
+    while(len < want && b + len < hi && !_bitmap_test(b + len)) len++;
+    return len;
+}
+
+uint allocate_data_extent(uint goal, uint want, uint *got){
+    *got = 0;
+    if(want == 0) return 0;
+    pthread_mutex_lock(&bmap_lock);
+    uint start = _search_start(REGION_DATA, goal), from, to;
+
+    // the first run of want blocks at or after start, wrapping around once;
+    // on a fragmented disk the longest run among the first EXTENT_PROBES
+    uint best = UINT_MAX, best_len = 0;
+    int probes = 0;
+    for(uint i = 0; best_len < want && probes < EXTENT_PROBES && _segment(REGION_DATA, start, i, &from, &to); i++){
+        uint b = _bitmap_find(from, to);
+        while(b != UINT_MAX && probes++ < EXTENT_PROBES){
+            uint len = _free_run(b, to, want);
+            if(len > best_len){
+                best = b;
+                best_len = len;
+            }
+            if(len >= want) break;
+            b = _bitmap_find(b + len, to);
         }
     }
-    _update_bitmap();
-    if(b >= sb.size) {
+    for(uint i = 0; i < best_len; i++) _bitmap_mark(best + i, true);
+    if(best_len > 0) cursor[REGION_DATA] = best + best_len;
+    _bitmap_sync();
+    pthread_mutex_unlock(&bmap_lock);
+
+    if(best_len == 0){
+        Warn("allocate extent: No free data blocks");
+        return 0;
+    }
+    uint *bnos = buf_get(best_len * sizeof(uint));
+    for(uint i = 0; i < best_len; i++) bnos[i] = best + i;
+    discard_blocks(bnos, best_len); // a single discard for the whole run
+    buf_put(bnos);
+    *got = best_len;
+    return best;
+}
+
+bool is_inode_block(uint b){
+    return _range_at(REGION_INODE, b) >= 0;
+}
+
+bool block_in_use(uint b){
+    if(b >= sb.size) return false;
+    pthread_mutex_lock(&bmap_lock);
+    bool used = _bitmap_test(b);
+    pthread_mutex_unlock(&bmap_lock);
+    return used;
+}
+
+int inode_group(uint b){
+    return _range_at(REGION_INODE, b);
+}
+
+uint inode_goal(uint parent, bool is_dir){
+    if(sb.ngroups == 0) return 0; // one inode region, next fit
+    pthread_mutex_lock(&bmap_lock);
+    int k = max(_range_at(REGION_INODE, inum_block(parent)), 0);
+    if(is_dir){
+        // a new directory goes to the group with the most free inodes, like FFS
+        uint most = 0;
+        for(uint g = 0; g < sb.ngroups; g++){
+            uint lo, hi, nfree = 0;
+            _region_range(REGION_INODE, g, &lo, &hi);
+            for(uint b = lo; b < hi; b++) nfree += !_bitmap_test(b);
+            if(nfree > most){
+                most = nfree;
+                k = g;
+            }
+        }
+    }
+    uint lo, hi;
+    _region_range(REGION_INODE, k, &lo, &hi);
+    pthread_mutex_unlock(&bmap_lock);
+    return lo;
+}
+
+uint data_goal(uint inum){
+    if(sb.ngroups == 0) return 0;
+    int k = _range_at(REGION_INODE, inum_block(inum));
+    if(k < 0) return 0;
+    uint lo, hi;
+    _region_range(REGION_DATA, k, &lo, &hi);
+    return lo;
+}
+
+uint allocate_block() {
+    uint b = _allocate_in(REGION_ANY, 0);
+    if(b == 0) {
         Warn("allocate block: No free blocks");
         return 0;
     }
@@ -341,20 +858,24 @@ uint allocate_block() {
 }
 
 void free_block(uint bno) {
+    free_blocks(&bno, 1);
+}
 
-    _fetch_bitmap();
-    // clear data block
-    zero_block(bno);
-    // clear the bit in bitmap
-    uchar *bm = (uchar *)sb.bitmap;
-    if(bno < sb.size) {
-        uint byte = bno / 8;
-        uint bit = bno % 8;
-        bm[byte] &= ~(1u << bit);
-    } else {
-        Warn("free block: block number out of range");
+void free_blocks(const uint *bnos, int n) {
+    if(n <= 0) return;
+    // clear the data blocks, adjacent ones in a single discard
+    discard_blocks(bnos, n);
+    // clear the bits in bitmap
+    pthread_mutex_lock(&bmap_lock);
+    for(int i = 0; i < n; i++){
+        if(bnos[i] < sb.size) {
+            _bitmap_mark(bnos[i], false);
+        } else {
+            Warn("free block: block number out of range");
+        }
     }
-    _update_bitmap();
+    _bitmap_sync();
+    pthread_mutex_unlock(&bmap_lock);
 }
 
 void get_disk_info(int *ncyl, int *nsec) {
@@ -362,62 +883,377 @@ void get_disk_info(int *ncyl, int *nsec) {
     *nsec = _nsec;
 }
 
-void read_block(int blockno, uchar *buf) {
-    if(!diskClient ) diskClientSetup();
-
-    if(blockno <0 || blockno >= sb.size){ //sb.size is the total number of blocks
-        Warn("read_block: block number out of range");
+// one block from the BDS, past the cache
+static void _disk_read_block(int blockno, uchar *buf) {
+    if(local_dev){
+        uint bno = blockno;
+        _account(bno, 1, NULL);
+        if(local_dev->read(&bno, 1, buf) != 0) Error("read_block: error reading block");
+        return;
+    }
+    if(bds_binary){
+        if(_bds_call(BDS_OP_READ, blockno, 1, NULL, NULL, buf, BSIZE) != 0){
+            Error("read_block: error reading block");
+        }
         return;
     }
     int cyl = blockno / _nsec, sec = blockno % _nsec;
-    // int res = disk_cmd_r(cyl, sec, (char *)buf); // write data to disk
-    // if(res < 0){
-    //     Error("read_block: error when reading disk block");
-    //     return ;
-    // }
+    _account(blockno, 1, NULL);
 
-    char *msg = malloc(CMD_SIZE);
+    char *msg = buf_get(CMD_SIZE);
     int header = sprintf(msg, "R %d %d", cyl, sec);
     client_send(diskClient, msg, header + 1);
     int n = client_recv(diskClient, msg, CMD_SIZE);
     if(n <= 0 || strcmp(msg, "No") == 0){
         Error("read_block: error reading block");
-        free(msg);
+        buf_put(msg);
         return;
     }
     memcpy(buf, msg + 4, BSIZE);
-    free(msg);
+    buf_put(msg);
+}
+
+void read_block(int blockno, uchar *buf) {
+    if(!dev_ready) diskClientSetup();
+
+    if(blockno <0 || blockno >= sb.size){ //sb.size is the total number of blocks
+        Warn("read_block: block number out of range");
+        return;
+    }
+    if(bcache_read(blockno, buf)) return;
+    long epoch = bcache_epoch();
+    _disk_read_block(blockno, buf);
+    bcache_fill(blockno, buf, epoch);
 }
 
 void write_block(int blockno, uchar *buf){
-    if(!diskClient ) diskClientSetup();
+    if(!dev_ready) diskClientSetup();
 
     if(blockno <0 || blockno >= sb.size){ //sb.size is the total number of blocks
         Warn("write_block: block number out of range");
         return;
     }
+    bcache_write(blockno, buf); // written back by the flusher, flush_disk or to make room
+}
 
-    int cyl = blockno / _nsec, sec = blockno % _nsec;
-    // int res = disk_cmd_w(cyl, sec, BSIZE, (char *)buf); // write data to disk
-    // if(res < 0){
-    //     Error("write_block: error writing block");
-    //     return ;
-    // }
-
-    char *msg = malloc(CMD_SIZE);
-    int header = sprintf(msg, "W %d %d %d ", cyl, sec, BSIZE);
-    memcpy(msg + header, buf, BSIZE);
-    client_send(diskClient, msg, header + BSIZE);
+static bool _is_contiguous(const uint *bnos, int n){
+    for(int i = 1; i < n; i++){
+        if(bnos[i] != bnos[0] + i) return false;
+    }
+    return true;
+}
+
+// build the header of a range (RR/WR) or vector (RV/WV) command for one chunk
+static int _range_header(char *msg, char op, const uint *bnos, int n){
+    if(_is_contiguous(bnos, n)){
+        return sprintf(msg, "%cR %d %d %d", op, bnos[0] / _nsec, bnos[0] % _nsec, n);
+    }
+    int header = sprintf(msg, "%cV %d", op, n);
+    for(int i = 0; i < n; i++){
+        header += sprintf(msg + header, " %d %d", bnos[i] / _nsec, bnos[i] % _nsec);
+    }
+    return header;
+}
+
+static bool _range_ok(const uint *bnos, int n){
+    for(int i = 0; i < n; i++){
+        if(bnos[i] >= sb.size){
+            Warn("block range: block number %d out of range", bnos[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// move n blocks in MAX_RANGE chunks, keeping up to BIO_QDEPTH chunks in flight
+static void _pipeline_blocks(bool is_read, const uint *bnos, int n, uchar *buf){
+    int tags[BIO_QDEPTH], first[BIO_QDEPTH];
+    int head = 0, inflight = 0;
+    for(int done = 0; done < n || inflight > 0; ){
+        if(done < n && inflight < BIO_QDEPTH){
+            int cnt = min(n - done, MAX_RANGE);
+            int slot = (head + inflight) % BIO_QDEPTH;
+            tags[slot] = _submit_blocks(is_read, bnos + done, cnt, buf + done * BSIZE);
+            first[slot] = done;
+            inflight++;
+            done += cnt;
+            continue;
+        }
+        if(tags[head] < 0 || wait_block_io(tags[head]) != 0){
+            Error("%s: error moving blocks from %d", is_read ? "read_blocks" : "write_blocks", bnos[first[head]]);
+        }
+        head = (head + 1) % BIO_QDEPTH;
+        inflight--;
+    }
+}
+
+// read n blocks from the BDS into buf, MAX_RANGE blocks per round trip
+static void _disk_read_blocks(const uint *bnos, int n, uchar *buf){
+    if(local_dev){
+        _account(0, n, bnos);
+        if(local_dev->read(bnos, n, buf) != 0) Error("read_blocks: error reading %d blocks from %d", n, bnos[0]);
+        return;
+    }
+    if(bds_binary){
+        _pipeline_blocks(true, bnos, n, buf);
+        return;
+    }
+
+    char *msg = buf_get(RANGE_MSG_SIZE);
+    for(int done = 0; done < n; done += MAX_RANGE){
+        int cnt = min(n - done, MAX_RANGE);
+        int header = _range_header(msg, 'R', bnos + done, cnt);
+        _account(0, cnt, bnos + done);
+        client_send(diskClient, msg, header + 1);
+        int len = client_recv(diskClient, msg, RANGE_MSG_SIZE);
+        if(len < 4 + cnt * BSIZE || strncmp(msg, "Yes ", 4) != 0){
+            Error("read_blocks: error reading %d blocks from %d", cnt, bnos[done]);
+            break;
+        }
+        memcpy(buf + done * BSIZE, msg + 4, cnt * BSIZE);
+    }
+    buf_put(msg);
+}
+
+// write n blocks to the BDS, also how the buffer cache writes back
+static void _disk_write_blocks(const uint *bnos, int n, uchar *buf){
+    if(local_dev){
+        _account(0, n, bnos);
+        if(local_dev->write(bnos, n, buf) != 0) Error("write_blocks: error writing %d blocks from %d", n, bnos[0]);
+        return;
+    }
+    if(bds_binary){
+        _pipeline_blocks(false, bnos, n, buf);
+        return;
+    }
+
+    char *msg = buf_get(RANGE_MSG_SIZE);
+    for(int done = 0; done < n; done += MAX_RANGE){
+        int cnt = min(n - done, MAX_RANGE);
+        int header = _range_header(msg, 'W', bnos + done, cnt);
+        _account(0, cnt, bnos + done);
+        msg[header++] = ' ';
+        memcpy(msg + header, buf + done * BSIZE, cnt * BSIZE);
+        client_send(diskClient, msg, header + cnt * BSIZE);
+        int len = client_recv(diskClient, msg, RANGE_MSG_SIZE);
+        if(len < 3 || strncmp(msg, "Yes", 3) != 0){
+            Error("write_blocks: error writing %d blocks from %d", cnt, bnos[done]);
+            break;
+        }
+    }
+    buf_put(msg);
+}
+
+void read_blocks(const uint *bnos, int n, uchar *buf){
+    if(!dev_ready) diskClientSetup();
+    if(n <= 0 || !_range_ok(bnos, n)) return;
+
+    // cached blocks are copied out, the rest is read in one go and not cached,
+    // so streaming a large file does not push out the metadata
+    uint *miss = buf_get(n * sizeof(uint));
+    int *at = buf_get(n * sizeof(int));
+    int nmiss = 0;
+    for(int i = 0; i < n; i++){
+        if(bcache_read(bnos[i], buf + i * BSIZE)) continue;
+        miss[nmiss] = bnos[i];
+        at[nmiss++] = i;
+    }
+    if(nmiss == n){
+        _disk_read_blocks(bnos, n, buf);
+    }else if(nmiss > 0){
+        uchar *tmp = buf_get(nmiss * BSIZE);
+        _disk_read_blocks(miss, nmiss, tmp);
+        for(int i = 0; i < nmiss; i++) memcpy(buf + at[i] * BSIZE, tmp + i * BSIZE, BSIZE);
+        buf_put(tmp);
+    }
+    buf_put(miss);
+    buf_put(at);
+}
+
+void write_blocks(const uint *bnos, int n, uchar *buf){
+    if(!dev_ready) diskClientSetup();
+    if(n <= 0 || !_range_ok(bnos, n)) return;
+
+    // bulk data is written through, cached copies are brought up to date
+    _disk_write_blocks(bnos, n, buf);
+    for(int i = 0; i < n; i++) bcache_update(bnos[i], buf + i * BSIZE);
+}
+
+// write zeros over n blocks, for a BDS without discard or a discard that failed
+static void _zero_blocks(const uint *bnos, int n){
+    uchar *zeros = buf_get_zero(min(n, MAX_RANGE) * BSIZE);
+    for(int done = 0; done < n; done += MAX_RANGE){
+        _disk_write_blocks(bnos + done, min(n - done, MAX_RANGE), zeros);
+    }
+    buf_put(zeros);
+}
+
+// make blocks read back as zeros without shipping any data, a run of adjacent
+// block numbers goes out as one discard and up to BIO_QDEPTH discards are in flight
+void discard_blocks(const uint *bnos, int n){
+    if(!dev_ready) diskClientSetup();
+    if(n <= 0 || !_range_ok(bnos, n)) return;
+
+    if(local_dev){
+        for(int done = 0, cnt; done < n; done += cnt){
+            for(cnt = 1; done + cnt < n && bnos[done + cnt] == bnos[done] + cnt; cnt++);
+            _account(bnos[done], cnt, NULL);
+            if(local_dev->discard(bnos[done], cnt) != 0){
+                Warn("discard_blocks: cannot discard %d blocks from %d, writing zeros", cnt, bnos[done]);
+                _zero_blocks(bnos + done, cnt);
+            }
+        }
+        for(int i = 0; i < n; i++) bcache_update(bnos[i], NULL);
+        return;
+    }
+    if(!bds_binary){
+        // a text-only BDS has no discard, write the zeros instead
+        _zero_blocks(bnos, n);
+        for(int i = 0; i < n; i++) bcache_update(bnos[i], NULL);
+        return;
+    }
+
+    int tags[BIO_QDEPTH], first[BIO_QDEPTH], count[BIO_QDEPTH];
+    int head = 0, inflight = 0;
+    for(int done = 0; done < n || inflight > 0; ){
+        if(done < n && inflight < BIO_QDEPTH){
+            int cnt = 1;
+            while(done + cnt < n && cnt < BDS_MAX_DISCARD && bnos[done + cnt] == bnos[done] + cnt) cnt++;
+            int slot = (head + inflight) % BIO_QDEPTH;
+            pthread_mutex_lock(&bio_lock);
+            tags[slot] = _bio_send(BDS_OP_DISCARD, bnos[done], cnt, NULL, NULL, NULL, 0);
+            pthread_mutex_unlock(&bio_lock);
+            first[slot] = done;
+            count[slot] = cnt;
+            inflight++;
+            done += cnt;
+            continue;
+        }
+        if(tags[head] < 0 || wait_block_io(tags[head]) != 0){
+            // the allocators count on these blocks reading back as zeros
+            Warn("discard_blocks: cannot discard %d blocks from %d, writing zeros", count[head], bnos[first[head]]);
+            _zero_blocks(bnos + first[head], count[head]);
+        }
+        head = (head + 1) % BIO_QDEPTH;
+        inflight--;
+    }
+    for(int i = 0; i < n; i++) bcache_update(bnos[i], NULL);
+}
+
+/* readahead */
+
+#define RA_QUEUE 256 // blocks waiting for the readahead thread, more are dropped
+
+static uint ra_queue[RA_QUEUE];
+static int ra_head = 0, ra_count = 0;
+static int ra_busy = 0;        // blocks the thread took off the queue and has not cached yet
+static bool ra_started = false;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ra_idle = PTHREAD_COND_INITIALIZER;
+
+// reads queued blocks in MAX_RANGE batches and leaves them in the buffer cache
+static void *_ra_main(void *arg){
+    uint bnos[MAX_RANGE];
+    uchar *buf = buf_get(MAX_RANGE * BSIZE);
+    while(1){
+        pthread_mutex_lock(&ra_lock);
+        while(ra_count == 0) pthread_cond_wait(&ra_work, &ra_lock);
+        long epoch = bcache_epoch();
+        int n = 0;
+        while(ra_count > 0 && n < MAX_RANGE){
+            uint b = ra_queue[ra_head];
+            ra_head = (ra_head + 1) % RA_QUEUE;
+            ra_count--;
+            if(!bcache_cached(b)) bnos[n++] = b;
+        }
+        ra_busy = n;
+        pthread_mutex_unlock(&ra_lock);
+
+        if(n > 0){
+            int tag = _submit_blocks(true, bnos, n, buf);
+            if(tag > 0 && wait_block_io(tag) == 0){
+                for(int i = 0; i < n; i++) bcache_prefetched(bnos[i], buf + i * BSIZE, epoch);
+            }else{
+                Warn("readahead: error reading %d blocks from %d", n, bnos[0]);
+            }
+        }
+
+        pthread_mutex_lock(&ra_lock);
+        ra_busy = 0;
+        if(ra_count == 0) pthread_cond_broadcast(&ra_idle);
+        pthread_mutex_unlock(&ra_lock);
+    }
+    return NULL;
+}
+
+void prefetch_blocks(const uint *bnos, int n){
+    if(!dev_ready) diskClientSetup();
+    // the text protocol has one request on the wire at a time, a second thread would garble it
+    if(n <= 0 || (!local_dev && !bds_binary) || !_range_ok(bnos, n)) return;
+
+    pthread_mutex_lock(&ra_lock);
+    if(!ra_started){
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, _ra_main, NULL) != 0){
+            pthread_mutex_unlock(&ra_lock);
+            Warn("prefetch_blocks: cannot start the readahead thread");
+            return;
+        }
+        pthread_detach(tid);
+        ra_started = true;
+    }
+    for(int i = 0; i < n && ra_count < RA_QUEUE; i++){
+        ra_queue[(ra_head + ra_count) % RA_QUEUE] = bnos[i];
+        ra_count++;
+    }
+    pthread_cond_signal(&ra_work);
+    pthread_mutex_unlock(&ra_lock);
+}
+
+void wait_prefetch(){
+    pthread_mutex_lock(&ra_lock);
+    while(ra_count > 0 || ra_busy > 0) pthread_cond_wait(&ra_idle, &ra_lock);
+    pthread_mutex_unlock(&ra_lock);
+}
+
+static void (*flush_hook)() = NULL;
+
+void set_flush_hook(void (*hook)()){
+    flush_hook = hook;
+}
+
+void flush_disk(){
+    // ask the BDS to make every write so far durable, whatever its sync mode
+    if(!dev_ready) return;
+    if(flush_hook) flush_hook(); // data held back above the block layer comes down first
+    bcache_flush(); // the cache first, the BDS has not seen its dirty blocks yet
+    if(local_dev){
+        if(local_dev->flush() != 0) Error("flush_disk: flush failed");
+        return;
+    }
+    if(bds_binary){
+        if(_bds_call(BDS_OP_FLUSH, 0, 0, NULL, NULL, NULL, 0) != 0){
+            Error("flush_disk: flush failed");
+        }
+        return;
+    }
+    char msg[CMD_SIZE];
+    client_send(diskClient, "F", 2);
     int n = client_recv(diskClient, msg, CMD_SIZE);
-    msg[n] = '\0';
-    if(strcmp(msg, "No") == 0){
-        Error("write_block: error writing block");
+    if(n < 3 || strncmp(msg, "Yes", 3) != 0){
+        Warn("flush_disk: BDS did not acknowledge the flush");
     }
-    free(msg);
 }
 
 void exit_block(){
     _update_bitmap();
+    flush_disk();
+    bcache_stat st;
+    bcache_get_stats(&st);
+    Log("exit_block: bcache %ld hits, %ld misses, %ld evictions, %ld blocks written back",
+        st.hits, st.misses, st.evictions, st.writebacks);
+    Log("exit_block: %ld blocks read ahead, %ld used, %ld wasted", st.ra_fills, st.ra_useful, st.ra_wasted);
     assert(sb.magic == 0x12345678);
     assert(sb.size > 0);
 }
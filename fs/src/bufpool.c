@@ -0,0 +1,109 @@
+#include "../include/bufpool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NCLASS (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+#define OVERSIZED (-1)
+
+// in front of every buffer, padded to max_align_t so the data keeps malloc's alignment
+typedef union hdr {
+    struct {
+        int cls;              // size class, OVERSIZED for heap-only buffers
+        union hdr *next;      // free list link while pooled
+    };
+    max_align_t align;
+} hdr;
+
+static __thread hdr *free_list[NCLASS];
+static __thread int nfree[NCLASS];
+static __thread int registered = 0;
+
+static bufpool_stat stats; // updated atomically, threads share it
+static pthread_key_t exit_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+#define COUNT(field) __atomic_fetch_add(&stats.field, 1, __ATOMIC_RELAXED)
+
+// give a thread's free lists back to the heap when it exits
+static void release_lists(void *arg){
+    for(int c = 0; c < NCLASS; c++){
+        while(free_list[c]){
+            hdr *h = free_list[c];
+            free_list[c] = h->next;
+            free(h);
+            COUNT(frees);
+        }
+        nfree[c] = 0;
+    }
+}
+
+static void make_key(){
+    pthread_key_create(&exit_key, release_lists);
+}
+
+static int size_class(size_t size){
+    for(int c = 0; c < NCLASS; c++){
+        if(size <= ((size_t)1 << (BUFPOOL_MIN_SHIFT + c))) return c;
+    }
+    return OVERSIZED;
+}
+
+void *buf_get(size_t size){
+    COUNT(gets);
+    int c = size_class(size);
+    hdr *h;
+    if(c != OVERSIZED && free_list[c]){
+        h = free_list[c];
+        free_list[c] = h->next;
+        nfree[c]--;
+        COUNT(reuses);
+        return h + 1;
+    }
+    if(c != OVERSIZED && !registered){
+        // the value only has to be non-NULL for the destructor to run
+        pthread_once(&key_once, make_key);
+        pthread_setspecific(exit_key, &registered);
+        registered = 1;
+    }
+    h = malloc(sizeof(hdr) + (c == OVERSIZED ? size : (size_t)1 << (BUFPOOL_MIN_SHIFT + c)));
+    if(h == NULL) return NULL;
+    COUNT(mallocs);
+    h->cls = c;
+    return h + 1;
+}
+
+void *buf_get_zero(size_t size){
+    void *buf = buf_get(size);
+    if(buf) memset(buf, 0, size);
+    return buf;
+}
+
+void buf_put(void *buf){
+    if(buf == NULL) return;
+    hdr *h = (hdr *)buf - 1;
+    int c = h->cls;
+    if(c == OVERSIZED || nfree[c] >= BUFPOOL_KEEP){
+        free(h);
+        COUNT(frees);
+        return;
+    }
+    h->next = free_list[c];
+    free_list[c] = h;
+    nfree[c]++;
+}
+
+void bufpool_get_stats(bufpool_stat *st){
+    st->gets = __atomic_load_n(&stats.gets, __ATOMIC_RELAXED);
+    st->reuses = __atomic_load_n(&stats.reuses, __ATOMIC_RELAXED);
+    st->mallocs = __atomic_load_n(&stats.mallocs, __ATOMIC_RELAXED);
+    st->frees = __atomic_load_n(&stats.frees, __ATOMIC_RELAXED);
+}
+
+void bufpool_reset_stats(){
+    __atomic_store_n(&stats.gets, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.reuses, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.mallocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.frees, 0, __ATOMIC_RELAXED);
+}
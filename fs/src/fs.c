@@ -33,7 +33,7 @@ void store_sb(){
     superblock to_store = sb;
     memset(&to_store.users, 0, sizeof(to_store.users)); // clear user information
     to_store.bitmap = NULL; // clear bitmap to avoid storing it
-    uchar *buf = (uchar *)malloc(BSIZE);
+    uchar *buf = (uchar *)calloc(1, BSIZE);
     memcpy(buf, &to_store, sizeof(superblock));
     write_block(0, buf); // write superblock to disk
     assert(to_store.users[0].uid == 0); //ensure no user information
@@ -171,18 +171,20 @@ int cmd_f() {
     superblock tmp_sb;
     memcpy(&tmp_sb, &sb, sizeof(superblock)); //backup user information
 
+    isync_all(); // no buffered append may outlive the file system it was made on
     _mount_disk();
     inode *root ;
     if(sb.root == 0){
         Warn("cmd_f: file system uninitialized");
         root = ialloc(T_DIR);
-        root->owner = 1145; //root can be accessed by any user
-        root->permission = 0b111111; //root can be accessed by any user
         if(root == NULL){
             Error("cmd_f: root allocation failed");
             return E_ERROR;
         }
+        root->owner = 1145; //root can be accessed by any user
+        root->permission = 0b111111; //root can be accessed by any user
         strcpy(root->name, "/");
+        idirty(root);
         uint hardlink[2] = {root->inum, root->inum};
         writei(root, (uchar *)hardlink, 0, sizeof(hardlink));
          //add hardlink to root . and ..
@@ -248,7 +250,7 @@ int cmd_mk(char *name, short mode) {
         return E_ERROR;
     }
 
-    inode *file = ialloc(T_FILE);
+    inode *file = ialloc_near(T_FILE, curDir.inum);
     if(file == NULL){
         Error("cmd_mk: file allocation failed");
         return E_ERROR;
@@ -296,7 +298,7 @@ int cmd_mkdir(char *name, short mode) {
     iput(tmp);
     /*permission check on creating sub directory*/
 
-    inode *subdir = ialloc(T_DIR);
+    inode *subdir = ialloc_near(T_DIR, curDir.inum);
     if(subdir == NULL){
         Error("cmd_mkdir: subdir allocation failed");
         return E_ERROR;
@@ -656,6 +658,7 @@ int cmd_rmdir(char *name) {
     cur->linkCount--;
     cur->fileSize -= sizeof(uint);
     cur->modTime = time(NULL);
+    idirty(cur);
 
     free(links);
     iput(cur); //remove the link to target dir from its parent
@@ -1016,6 +1019,8 @@ int cmd_login(int auid) {
 }
 
 void cmd_exit(uint u){
+    // buffered appends get their blocks before the bitmap goes out
+    if(isync_all() != 0) Error("cmd_exit: some buffered appends could not be written");
     uchar *buf = (uchar *)malloc(BSIZE);
     memset(buf, 0, BSIZE);
     memcpy(buf, &sb, sizeof(superblock));
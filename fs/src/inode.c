@@ -3,13 +3,16 @@
 #include <assert.h>
 #include <bits/types/locale_t.h>
 #include <locale.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "../include/bcache.h"
 #include "../include/block.h"
+#include "../include/bufpool.h"
 #include "../../include/log.h"
 #include "../include/common.h"
 
@@ -42,18 +45,473 @@ void copy_from_diNode(inode *ip, dinode *d){
     memcpy(ip->addrs, d->addrs, (NDIRECT + 2) * sizeof(uint));
 }
 
+/* in-core inode table */
+
+#define NINODE 256 // dinodes kept resident, by inum modulo NINODE
+
+// a dinode as the disk has it, valid while gen matches the mount it was read under
+typedef struct {
+    uint inum;  // 0 for a free entry
+    uint gen;
+    dinode d;
+} itab_ent;
+
+static itab_ent itable[NINODE];
+static itable_stat itab_stats;
+static pthread_mutex_t itab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t iblock_lock = PTHREAD_MUTEX_INITIALIZER; // read-modify-write of inode blocks
+
+static void _itab_put(uint inum, const dinode *d){
+    pthread_mutex_lock(&itab_lock);
+    itab_ent *e = &itable[inum % NINODE];
+    e->inum = inum;
+    e->gen = mount_generation();
+    e->d = *d;
+    pthread_mutex_unlock(&itab_lock);
+}
+
+// the dinode of inum, from the table or its inode block
+static void _read_dinode(uint inum, dinode *d){
+    pthread_mutex_lock(&itab_lock);
+    itab_ent *e = &itable[inum % NINODE];
+    if(e->inum == inum && e->gen == mount_generation()){
+        *d = e->d;
+        itab_stats.hits++;
+        pthread_mutex_unlock(&itab_lock);
+        return;
+    }
+    itab_stats.misses++;
+    pthread_mutex_unlock(&itab_lock);
+
+    dinode *blk = buf_get(BSIZE);
+    read_block(inum_block(inum), (uchar *)blk);
+    *d = blk[inum_slot(inum)];
+    buf_put(blk);
+    _itab_put(inum, d);
+}
+
+// store d in its slot, the other dinodes of the block are left alone
+static void _write_dinode(uint inum, const dinode *d){
+    uchar *blk = buf_get(BSIZE);
+    pthread_mutex_lock(&iblock_lock);
+    if(inodes_per_block() > 1) read_block(inum_block(inum), blk);
+    else memset(blk, 0, BSIZE);
+    ((dinode *)blk)[inum_slot(inum)] = *d;
+    write_block(inum_block(inum), blk);
+    _itab_put(inum, d);
+    pthread_mutex_unlock(&iblock_lock);
+    buf_put(blk);
+}
+
+void get_itable_stats(itable_stat *st){
+    pthread_mutex_lock(&itab_lock);
+    *st = itab_stats;
+    pthread_mutex_unlock(&itab_lock);
+}
+
+void reset_itable_stats(){
+    pthread_mutex_lock(&itab_lock);
+    memset(&itab_stats, 0, sizeof(itab_stats));
+    pthread_mutex_unlock(&itab_lock);
+}
+
+/* inode cache */
+
+#define NICACHE 128 // inodes shared by iget callers, more are allocated while all are in use
+
+/*
+ * iget hands out &e->ip of an entry here, every caller of the same inum gets the
+ * same one and iput drops the reference. An entry nobody references keeps its
+ * inode until the least recently used one is taken for another inum. readi
+ * holds the entry's lock shared, writei, isync and wipeout_inode hold it alone.
+ * The entries allocated while all of these are referenced sit on a list that is
+ * searched as well, so an inum never has two entries.
+ */
+typedef struct icache_ent {
+    inode ip;               // first, so an inode pointer is its entry
+    int ref;
+    bool loaded;            // ip was read from disk by whoever claimed the entry, under icache_lock
+    bool heap;              // allocated because every entry was referenced, freed at ref 0
+    uint gen;               // mount generation of the inode
+    unsigned long used;     // LRU clock
+    struct icache_ent *next; // overflow list, for heap entries
+    pthread_rwlock_t lock;
+} icache_ent;
+
+static icache_ent icache[NICACHE];
+static icache_ent *overflow = NULL; // the heap entries in use
+static unsigned long icache_clock = 0;
+static icache_stat ic_stats;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t icache_once = PTHREAD_ONCE_INIT;
+
+static void _icache_init(){
+    for(int i = 0; i < NICACHE; i++) pthread_rwlock_init(&icache[i].lock, NULL);
+}
+
+static icache_ent *_ent(inode *ip){
+    return (icache_ent *)ip;
+}
+
+static void _ilock(inode *ip){
+    pthread_rwlock_wrlock(&_ent(ip)->lock);
+}
+
+static void _ilock_shared(inode *ip){
+    pthread_rwlock_rdlock(&_ent(ip)->lock);
+}
+
+static void _iunlock(inode *ip){
+    pthread_rwlock_unlock(&_ent(ip)->lock);
+}
+
+// e caches inum for this mount, and its inode was not wiped out; caller holds icache_lock
+static bool _icache_match(icache_ent *e, uint inum, uint gen){
+    return e->ip.inum == inum && e->gen == gen && (!e->loaded || e->ip.type != 0);
+}
+
+// the entry for inum with a reference taken, claimed and write-locked when *fresh is set
+// so the caller can load it; the least recently used unreferenced entry is reused.
+// *loading is set for an entry somebody else is still reading in
+static icache_ent *_icache_get(uint inum, bool *fresh, bool *loading){
+    pthread_once(&icache_once, _icache_init);
+    pthread_mutex_lock(&icache_lock);
+    uint gen = mount_generation();
+    icache_ent *found = NULL, *victim = NULL;
+    for(int i = 0; i < NICACHE && found == NULL; i++){
+        icache_ent *e = &icache[i];
+        if(_icache_match(e, inum, gen)) found = e;
+        else if(e->ref == 0 && (victim == NULL || e->used < victim->used)) victim = e;
+    }
+    for(icache_ent *e = overflow; e != NULL && found == NULL; e = e->next){
+        if(_icache_match(e, inum, gen)) found = e;
+    }
+    if(found){
+        found->ref++;
+        found->used = ++icache_clock;
+        ic_stats.hits++;
+        *loading = !found->loaded;
+        pthread_mutex_unlock(&icache_lock);
+        *fresh = false;
+        return found;
+    }
+    ic_stats.misses++;
+    if(victim == NULL){
+        victim = calloc(1, sizeof(icache_ent));
+        pthread_rwlock_init(&victim->lock, NULL);
+        victim->heap = true;
+        victim->next = overflow;
+        overflow = victim;
+        ic_stats.overflows++;
+    }
+    pthread_rwlock_wrlock(&victim->lock); // unreferenced, nobody holds it
+    victim->ip.inum = inum;
+    victim->gen = gen;
+    victim->ref = 1;
+    victim->loaded = false;
+    victim->used = ++icache_clock;
+    pthread_mutex_unlock(&icache_lock);
+    *fresh = true;
+    return victim;
+}
+
+// drop a reference; an entry whose inode was wiped out is forgotten with its last one
+static void _icache_put(icache_ent *e){
+    pthread_mutex_lock(&icache_lock);
+    bool gone = --e->ref == 0 && (e->heap || !e->loaded || e->ip.type == 0);
+    if(gone && !e->heap){
+        e->ip.inum = 0;
+        e->loaded = false;
+    }
+    if(gone && e->heap){
+        icache_ent **pp = &overflow;
+        while(*pp != e) pp = &(*pp)->next;
+        *pp = e->next;
+    }
+    pthread_mutex_unlock(&icache_lock);
+    if(gone && e->heap){
+        pthread_rwlock_destroy(&e->lock);
+        free(e);
+    }
+}
+
+void get_icache_stats(icache_stat *st){
+    pthread_mutex_lock(&icache_lock);
+    *st = ic_stats;
+    pthread_mutex_unlock(&icache_lock);
+}
+
+void reset_icache_stats(){
+    pthread_mutex_lock(&icache_lock);
+    memset(&ic_stats, 0, sizeof(ic_stats));
+    pthread_mutex_unlock(&icache_lock);
+}
+
+/* delayed allocation */
+
+#define DA_SLOTS 16 // files with buffered appends, by inum modulo DA_SLOTS
+
+// bytes appended to a file and not written yet: the dinode says base, the inode base + len
+typedef struct {
+    uint inum;   // 0 for a free slot
+    uint base;
+    uint len;
+    bool busy;   // being written out by the holder of the inode lock, kept until that succeeds
+    long since;  // when the first of the bytes came in, in ms
+    uchar data[DA_MAX_BYTES];
+} da_slot;
+
+static da_slot da_table[DA_SLOTS];
+static uint da_max = DA_MAX_BYTES;
+static da_stat da_stats;
+static pthread_mutex_t da_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t da_once = PTHREAD_ONCE_INIT;
+
+static int _writei_now(inode *ip, uchar *src, uint off, uint n);
+static void _da_drop(uint inum);
+
+// the buffered appends of inum, NULL if there are none or they are being written out;
+// caller holds da_lock
+static da_slot *_da_find(uint inum){
+    da_slot *s = &da_table[inum % DA_SLOTS];
+    return s->inum == inum && s->len > 0 && !s->busy ? s : NULL;
+}
+
+static long _now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// the file size to record on disk, which stops short of the buffered bytes;
+// a file cut down into them keeps what is left
+static uint _da_disk_size(inode *ip){
+    pthread_mutex_lock(&da_lock);
+    uint size = ip->fileSize;
+    da_slot *s = _da_find(ip->inum);
+    if(s && size <= s->base){
+        s->inum = 0;
+        s->len = 0;
+    }else if(s){
+        s->len = min(s->len, size - s->base);
+        size = s->base;
+    }
+    pthread_mutex_unlock(&da_lock);
+    return size;
+}
+
+// write out the len bytes at base ahead of src[0..n), the caller holds ip's lock
+static int _da_write(inode *ip, const uchar *buf, uint base, uint len, uchar *src, uint n){
+    uchar *all = buf_get(len + n);
+    memcpy(all, buf, len);
+    if(n) memcpy(all + len, src, n);
+    ip->fileSize = base;
+    int ret = _writei_now(ip, all, base, len + n);
+    buf_put(all);
+    pthread_mutex_lock(&da_lock);
+    da_stats.flushes++;
+    pthread_mutex_unlock(&da_lock);
+    return ret < 0 ? -1 : (int)n;
+}
+
+// write the buffered appends of s to ip, ahead of src[0..n) when given, and free the slot;
+// when that fails they stay buffered. Caller holds da_lock, which is dropped, and ip's lock
+static int _da_flush_slot(da_slot *s, inode *ip, uchar *src, uint n){
+    uint base = s->base, len = s->len;
+    s->busy = true; // nobody else touches the data meanwhile
+    pthread_mutex_unlock(&da_lock);
+
+    int ret = _da_write(ip, s->data, base, len, src, n);
+    pthread_mutex_lock(&da_lock);
+    s->busy = false;
+    if(ret < 0){
+        Error("isync: %u buffered bytes of iNode %d stay in memory", len, ip->inum);
+        ip->fileSize = base + len;
+    }else{
+        s->inum = 0;
+        s->len = 0;
+    }
+    pthread_mutex_unlock(&da_lock);
+    return ret;
+}
+
+// write out what another file has buffered; 1 when done, 0 when wait is not set and the
+// file is busy, -1 when the write failed. Caller holds no inode lock when wait is set
+static int _da_flush_inum(uint inum, bool wait){
+    inode *ip = iget(inum);
+    if(ip == NULL){
+        _da_drop(inum);
+        return 1;
+    }
+    if(wait) _ilock(ip);
+    else if(pthread_rwlock_trywrlock(&_ent(ip)->lock) != 0){
+        iput(ip);
+        return 0;
+    }
+    int ret = 1;
+    pthread_mutex_lock(&da_lock);
+    da_slot *s = _da_find(inum);
+    if(s) ret = _da_flush_slot(s, ip, NULL, 0) < 0 ? -1 : 1;
+    else pthread_mutex_unlock(&da_lock);
+    _iunlock(ip);
+    iput(ip);
+    return ret;
+}
+
+// called by the bcache flusher: buffers that waited long enough go out, unless their
+// file is in use, then the next tick tries again
+static void _da_tick(){
+    long now = _now_ms();
+    for(int i = 0; i < DA_SLOTS; i++){
+        pthread_mutex_lock(&da_lock);
+        da_slot *s = &da_table[i];
+        uint inum = s->len > 0 && !s->busy && now - s->since >= DA_MAX_AGE_MS ? s->inum : 0;
+        pthread_mutex_unlock(&da_lock);
+        if(inum) _da_flush_inum(inum, false);
+    }
+}
+
+static void _da_sync_all(){
+    isync_all();
+}
+
+// flush_disk writes out every buffer first, the flusher the old ones
+static void _da_hook(){
+    set_flush_hook(_da_sync_all);
+    bcache_set_tick(_da_tick);
+}
+
+// buffer an append of n bytes at off: 1 when it was taken, 0 when writei has to write it, -1 on error
+static int _da_append(inode *ip, uchar *src, uint off, uint n){
+    if(n == 0 || ip->type != T_FILE || off != ip->fileSize) return 0;
+    pthread_once(&da_once, _da_hook);
+    pthread_mutex_lock(&da_lock);
+    if(da_max == 0){
+        pthread_mutex_unlock(&da_lock);
+        return 0;
+    }
+    da_slot *s = &da_table[ip->inum % DA_SLOTS];
+    while(s->len > 0 && s->inum != ip->inum){
+        // another file holds the slot, it goes to disk first unless someone is using it
+        uint other = s->inum;
+        pthread_mutex_unlock(&da_lock);
+        if(_da_flush_inum(other, false) != 1) return 0;
+        pthread_mutex_lock(&da_lock);
+    }
+    if(s->len == 0){
+        if(n >= da_max){
+            pthread_mutex_unlock(&da_lock);
+            return 0;
+        }
+        s->inum = ip->inum;
+        s->base = off;
+        s->since = _now_ms();
+    }
+    da_stats.appends++;
+    da_stats.bytes += n;
+    if(s->len + n > da_max){
+        // past the threshold everything buffered goes out with this write, as one allocation
+        return _da_flush_slot(s, ip, src, n) < 0 ? -1 : 1;
+    }
+    memcpy(s->data + s->len, src, n);
+    s->len += n;
+    ip->fileSize += n;
+    pthread_mutex_unlock(&da_lock);
+    return 1;
+}
+
+// copy what the buffered appends hold of [off, off + n) into dst, returns where that begins
+static uint _da_overlay(inode *ip, uchar *dst, uint off, uint n){
+    pthread_mutex_lock(&da_lock);
+    uint from = off + n;
+    da_slot *s = _da_find(ip->inum);
+    if(s && s->base < off + n){
+        from = max(off, s->base);
+        uint to = min(off + n, s->base + s->len);
+        if(to > from) memcpy(dst + (from - off), s->data + (from - s->base), to - from);
+    }
+    pthread_mutex_unlock(&da_lock);
+    return from;
+}
+
+static void _da_drop(uint inum){
+    pthread_mutex_lock(&da_lock);
+    da_slot *s = &da_table[inum % DA_SLOTS];
+    if(s->inum == inum){
+        s->inum = 0;
+        s->len = 0;
+    }
+    pthread_mutex_unlock(&da_lock);
+}
+
+// isync for a caller that holds ip's lock
+static int _isync(inode *ip){
+    pthread_mutex_lock(&da_lock);
+    da_slot *s = _da_find(ip->inum);
+    if(s == NULL){
+        pthread_mutex_unlock(&da_lock);
+        return 0;
+    }
+    return _da_flush_slot(s, ip, NULL, 0) < 0 ? -1 : 0;
+}
+
+int isync(inode *ip){
+    _ilock(ip);
+    int ret = _isync(ip);
+    _iunlock(ip);
+    return ret;
+}
+
+int isync_all(){
+    int ret = 0;
+    for(int i = 0; i < DA_SLOTS; i++){
+        pthread_mutex_lock(&da_lock);
+        uint inum = da_table[i].len > 0 ? da_table[i].inum : 0;
+        pthread_mutex_unlock(&da_lock);
+        if(inum && _da_flush_inum(inum, true) < 0) ret = -1;
+    }
+    return ret;
+}
+
+void set_delalloc(uint max_bytes){
+    isync_all();
+    pthread_mutex_lock(&da_lock);
+    da_max = min(max_bytes, DA_MAX_BYTES);
+    pthread_mutex_unlock(&da_lock);
+}
+
+void get_da_stats(da_stat *st){
+    pthread_mutex_lock(&da_lock);
+    *st = da_stats;
+    pthread_mutex_unlock(&da_lock);
+}
+
+void reset_da_stats(){
+    pthread_mutex_lock(&da_lock);
+    memset(&da_stats, 0, sizeof(da_stats));
+    pthread_mutex_unlock(&da_lock);
+}
+
 void store_iNode(inode *ip){
     if(ip == NULL){
         Error("store_iNode: ip is NULL");
         return;
     }
 
-    uchar *tmp = (uchar *)malloc(BSIZE);
-    memset(tmp, 0, BSIZE);
-    dinode *d = (dinode *)tmp;
-    copy_to_diNode(d, ip);
-    write_block(ip->inum, tmp);
-    free(tmp);
+    if(ip->type == 0) return; // wiped out, its slot may belong to another inode by now
+    dinode d;
+    memset(&d, 0, sizeof(d));
+    copy_to_diNode(&d, ip);
+    d.fileSize = _da_disk_size(ip);
+    _write_dinode(ip->inum, &d);
+}
+
+inode *load_iNode(uint inum){
+    dinode d;
+    _read_dinode(inum, &d);
+    inode *ip = (inode *)malloc(sizeof(inode));
+    copy_from_diNode(ip, &d);
+    return ip;
 }
 
 bool _is_exist(uint inum){ //检查在inum的位置是否有inode
@@ -61,15 +519,13 @@ bool _is_exist(uint inum){ //检查在inum的位置是否有inode
         Error("is_exist: inum is 0");
         return false;
     }
-    if(inum < sb.iNode_start ||inum >=sb.data_start){
+    if(!is_inode_block(inum_block(inum))){
         Error("is_exist: inum %d is out of range", inum);
         return false;
     }
 
-    uchar *bm = (uchar *)sb.bitmap;
-    uint byte = inum / 8, bit = inum % 8;
-    if((bm[byte] & (1u << bit)) == 0) { //check if this bit is 0
-        Error("is_exist: the block %d is not allocated", inum);
+    if(!block_in_use(inum_block(inum))) { //check if this bit is 0
+        Error("is_exist: the block %d is not allocated", inum_block(inum));
         return false;
     }else{
         return true;
@@ -82,36 +538,112 @@ inode *iget(uint inum) {
         return NULL;
     }
 
-    inode *ret = (inode *)malloc(sizeof(inode));
-    uchar *tmp = (uchar *)malloc(BSIZE);
-    memset(tmp, 0, BSIZE);
-    read_block(inum, tmp);
-    dinode *d = (dinode *)tmp;
-    copy_from_diNode(ret, d);
-    free(tmp);
-    return ret;
+    bool fresh, loading;
+    icache_ent *e = _icache_get(inum, &fresh, &loading);
+    if(!fresh){
+        if(!loading) return &e->ip;
+        // whoever claimed the entry loads it under its lock
+        _ilock_shared(&e->ip);
+        pthread_mutex_lock(&icache_lock);
+        bool ok = e->loaded && e->ip.type != 0;
+        pthread_mutex_unlock(&icache_lock);
+        _iunlock(&e->ip);
+        if(ok) return &e->ip;
+        _icache_put(e);
+        Error("iget: iNode %d is free", inum);
+        return NULL;
+    }
+    dinode d;
+    _read_dinode(inum, &d);
+    if(d.type == 0){
+        _iunlock(&e->ip);
+        _icache_put(e);
+        Error("iget: iNode %d is free", inum);
+        return NULL;
+    }
+    copy_from_diNode(&e->ip, &d);
+    e->ip.inum = inum;
+    e->ip.dirty = false;
+    pthread_mutex_lock(&da_lock);
+    da_slot *s = _da_find(inum);
+    if(s && s->base == e->ip.fileSize) e->ip.fileSize += s->len;
+    pthread_mutex_unlock(&da_lock);
+    pthread_mutex_lock(&icache_lock);
+    e->loaded = true;
+    pthread_mutex_unlock(&icache_lock);
+    _iunlock(&e->ip);
+    return &e->ip;
 }
 
 void iput(inode *ip) {
-    iupdate(ip);
-    free(ip);
+    if(ip == NULL) return;
+    _ilock_shared(ip);
+    bool dirty = __atomic_load_n(&ip->dirty, __ATOMIC_ACQUIRE);
+    if(dirty) iupdate(ip);
+    _iunlock(ip);
+    pthread_mutex_lock(&icache_lock);
+    if(dirty) ic_stats.stores++;
+    else ic_stats.clean++;
+    pthread_mutex_unlock(&icache_lock);
+    _icache_put(_ent(ip));
 }
 
 inode *ialloc(short type) {
-    inode *ret = (inode *)malloc(sizeof(inode));
-    ret->type = type;
-    ret->fileSize = 0;
-    ret->blocks = 0;
-    memset(ret->addrs, 0 , (NDIRECT + 2) * sizeof(uint));
-    uint inum = allocate_iNode_block();
+    return ialloc_near(type, 0);
+}
+
+static pthread_mutex_t ialloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint last_iblock = 0, last_gen = 0; // where the last inode went, under ialloc_lock
+
+// a free dinode in inode block b or 0, caller holds ialloc_lock
+static uint _free_slot(uint b){
+    if(b == 0 || !is_inode_block(b) || !block_in_use(b)) return 0;
+    dinode *blk = buf_get(BSIZE);
+    read_block(b, (uchar *)blk);
+    uint ipb = inodes_per_block(), inum = 0;
+    for(uint i = 0; i < ipb && inum == 0; i++){
+        if(blk[i].type == 0) inum = b * ipb + i;
+    }
+    buf_put(blk);
+    return inum;
+}
+
+// a file goes next to its directory, then into the block the last inode went to when it is
+// in the right group; only when both are full a new inode block is taken
+static uint _alloc_inum(short type, uint parent){
+    uint goal = inode_goal(parent, type == T_DIR), inum = 0;
+    if(type != T_DIR && parent != 0) inum = _free_slot(inum_block(parent));
+    bool same_group = sb.ngroups == 0 || inode_group(last_iblock) == inode_group(goal);
+    if(inum == 0 && last_gen == mount_generation() && same_group) inum = _free_slot(last_iblock);
+    if(inum == 0){
+        uint b = allocate_iNode_block_near(goal);
+        if(b == 0) return 0;
+        inum = b * inodes_per_block();
+    }
+    last_iblock = inum_block(inum);
+    last_gen = mount_generation();
+    return inum;
+}
+
+inode *ialloc_near(short type, uint parent) {
+    inode fresh;
+    memset(&fresh, 0, sizeof(inode));
+    fresh.type = type;
+    fresh.fileSize = 0;
+    fresh.blocks = 0;
+    memset(fresh.addrs, 0 , (NDIRECT + 2) * sizeof(uint));
+    pthread_mutex_lock(&ialloc_lock);
+    uint inum = _alloc_inum(type, parent);
     if(inum == 0){
-        free(ret);
+        pthread_mutex_unlock(&ialloc_lock);
         Error("ialloc: no enough space");
         return NULL;
     }
-    ret->inum = inum;
-    store_iNode(ret);
-    return ret;
+    fresh.inum = inum;
+    _da_drop(inum); // left over from a file that used the inum before
+    store_iNode(&fresh); // the slot is taken once its type is on disk
+    pthread_mutex_unlock(&ialloc_lock);
+    return iget(inum);
 }
 
 void iupdate(inode *ip) {
@@ -119,47 +651,435 @@ void iupdate(inode *ip) {
         Error("iupdate: ip is NULL");
         return;
     }
+    __atomic_store_n(&ip->dirty, false, __ATOMIC_RELEASE);
     ip->modTime = time(NULL);
     store_iNode(ip);
 }
 
-uint _which_read(inode *ip ,uint logic){
+void idirty(inode *ip) {
+    if(ip == NULL) return;
+    __atomic_store_n(&ip->dirty, true, __ATOMIC_RELEASE);
+}
+
+/* block map */
+
+// blocks reserved by writei for the blocks a write adds to a file
+typedef struct {
+    uint next, left;  // reserved blocks not handed out yet
+    uint want;        // blocks the write may still need
+} extent_pool;
+
+// one index block, read once for a run of logic blocks and written back once if changed
+typedef struct {
+    uint bno;     // 0 while nothing is loaded
+    bool dirty;
+    uint *links;
+} index_page;
+
+// a pass over the block map of ip for a range of logic blocks
+typedef struct {
+    inode *ip;
+    extent_pool *pool;     // where new blocks come from, with alloc
+    bool alloc;            // missing blocks are allocated, otherwise there must be none
+    bool changed;          // the inode has to be stored
+    index_page top, leaf;  // level 0 of the double indirect blocks, and the page of the last slot;
+                           // with extents the index node and the leaf last used
+    extent hint;           // with extents, the last one found, len 0 for none
+} bmap_walk;
+
+static void _bmap_begin(bmap_walk *w, inode *ip, bool alloc, extent_pool *pool){
+    *w = (bmap_walk){.ip = ip, .pool = pool, .alloc = alloc};
+    w->top.links = buf_get(BSIZE);
+    w->leaf.links = buf_get(BSIZE);
+}
+
+static void _page_store(index_page *pg){
+    if(pg->dirty) write_block(pg->bno, (uchar *)pg->links);
+    pg->dirty = false;
+}
+
+static void _page_load(index_page *pg, uint bno){
+    if(pg->bno == bno) return;
+    _page_store(pg);
+    read_block(bno, (uchar *)pg->links);
+    pg->bno = bno;
+}
+
+// write back what the pass changed
+static void _bmap_end(bmap_walk *w){
+    _page_store(&w->leaf);
+    _page_store(&w->top);
+    buf_put(w->leaf.links);
+    buf_put(w->top.links);
+    if(w->changed) iupdate(w->ip);
+}
+
+// a block for a missing slot, from the write's reservation when there is one
+static uint _take_block(inode *ip, extent_pool *pool){
+    if(pool == NULL || (pool->left == 0 && pool->want == 0)){
+        uint got;
+        return allocate_data_extent(data_goal(ip->inum), 1, &got);
+    }
+    if(pool->left == 0){
+        // the reservation ran out (index blocks take from it too), continue right after it
+        uint got;
+        uint first = allocate_data_extent(pool->next, max(pool->want, 1), &got);
+        if(first == 0) return 0;
+        pool->next = first;
+        pool->left = got;
+    }
+    pool->left--;
+    if(pool->want > 0) pool->want--;
+    return pool->next++;
+}
+
+/* extents */
+
+static extent_hdr *_ext_root(inode *ip){
+    return (extent_hdr *)ip->addrs;
+}
+
+static extent *_ext_entries(extent_hdr *h){
+    return (extent *)(h + 1);
+}
+
+// the last entry of h at or before logic, -1 when all of them come after it
+static int _ext_search(extent_hdr *h, uint logic){
+    extent *e = _ext_entries(h);
+    int lo = 0, hi = (int)h->count - 1, found = -1;
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        if(e[mid].logic <= logic){
+            found = mid;
+            lo = mid + 1;
+        }else{
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+// the disk block of logic, 0 when no extent maps it; the extent found is kept in the walk,
+// the blocks after logic come from it without a search
+static uint _ext_lookup(bmap_walk *w, uint logic){
+    extent *hint = &w->hint;
+    if(hint->len > 0 && hint->logic <= logic && logic < hint->logic + hint->len){
+        return hint->start + logic - hint->logic;
+    }
+    extent_hdr *h = _ext_root(w->ip);
+    while(h->depth > 0){
+        int i = _ext_search(h, logic);
+        if(i < 0) return 0;
+        index_page *pg = h->depth == 1 ? &w->leaf : &w->top;
+        _page_load(pg, _ext_entries(h)[i].start);
+        h = (extent_hdr *)pg->links;
+    }
+    int i = _ext_search(h, logic);
+    if(i < 0) return 0;
+    extent *e = &_ext_entries(h)[i];
+    if(logic >= e->logic + e->len) return 0;
+    *hint = *e;
+    return e->start + logic - e->logic;
+}
+
+// the rightmost node at depth, in *pg, or the root itself (*pg NULL) when it is that deep
+static extent_hdr *_ext_rightmost(bmap_walk *w, uint depth, index_page **pg){
+    extent_hdr *h = _ext_root(w->ip);
+    *pg = NULL;
+    while(h->depth > depth){
+        index_page *next = h->depth == 1 ? &w->leaf : &w->top;
+        _page_load(next, _ext_entries(h)[h->count - 1].start);
+        h = (extent_hdr *)next->links;
+        *pg = next;
+    }
+    return h;
+}
+
+// add e at the right end of the nodes at depth; a full node gets a new one next to it,
+// and a full root moves its entries down into a node and points at that
+static bool _ext_insert(bmap_walk *w, extent e, uint depth){
+    index_page *pg;
+    extent_hdr *h = _ext_rightmost(w, depth, &pg);
+    if(h->count < (pg ? NODE_EXTENTS : ROOT_EXTENTS)){
+        _ext_entries(h)[h->count++] = e;
+        if(pg) pg->dirty = true;
+        else w->changed = true;
+        return true;
+    }
+    uint nb = _take_block(w->ip, NULL); // nodes stay out of the run reserved for the data
+    if(nb == 0){
+        Error("_which_write: no enough space");
+        return false;
+    }
+    uchar *blk = buf_get_zero(BSIZE);
+    extent_hdr *nh = (extent_hdr *)blk;
+    if(pg == NULL){
+        memcpy(blk, h, sizeof(extent_hdr) + h->count * sizeof(extent));
+        write_block(nb, blk);
+        buf_put(blk);
+        extent down = {_ext_entries(h)[0].logic, nb, 0};
+        h->depth++;
+        h->count = 1;
+        _ext_entries(h)[0] = down;
+        w->changed = true;
+        return _ext_insert(w, e, depth);
+    }
+    *nh = (extent_hdr){1, depth};
+    _ext_entries(nh)[0] = e;
+    write_block(nb, blk);
+    buf_put(blk);
+    return _ext_insert(w, (extent){e.logic, nb, 0}, depth + 1);
+}
+
+// map logic, the block after the last mapped one, to bno: the last extent grows when bno
+// follows it on the disk, otherwise a new one starts
+static bool _ext_append(bmap_walk *w, uint logic, uint bno){
+    index_page *pg;
+    extent_hdr *h = _ext_rightmost(w, 0, &pg);
+    if(h->count > 0){
+        extent *last = &_ext_entries(h)[h->count - 1];
+        if(last->logic + last->len == logic && last->start + last->len == bno){
+            last->len++;
+            if(pg) pg->dirty = true;
+            w->hint = *last;
+            return true;
+        }
+    }
+    extent e = {logic, bno, 1};
+    if(!_ext_insert(w, e, 0)) return false;
+    w->hint = e;
+    return true;
+}
+
+// _bmap_one for a disk formatted with extents
+static uint _ext_bmap(bmap_walk *w, uint logic){
+    inode *ip = w->ip;
+    if(logic < ip->blocks) return _ext_lookup(w, logic);
+    assert(w->alloc && logic == ip->blocks); // a file only grows at its end
+    uint bno = _take_block(ip, w->pool);
+    if(bno == 0){
+        Error("_which_write: no enough space");
+        return 0;
+    }
+    if(!_ext_append(w, logic, bno)){
+        free_blocks(&bno, 1);
+        return 0;
+    }
+    ip->blocks++;
+    w->changed = true;
+    return bno;
+}
+
+// the nodes of the tree below h, for wipeout_inode; returns how many were put in bnos
+static int _ext_nodes(extent_hdr *h, uint *bnos){
+    if(h->depth == 0) return 0;
+    int n = 0;
+    uchar *blk = buf_get(BSIZE);
+    for(uint i = 0; i < h->count; i++){
+        uint child = _ext_entries(h)[i].start;
+        bnos[n++] = child;
+        read_block(child, blk);
+        n += _ext_nodes((extent_hdr *)blk, bnos + n);
+    }
+    buf_put(blk);
+    return n;
+}
+
+// make *slot point at a block, allocating it when the pass may; owner holds the slot, NULL
+// for the inode itself, and data blocks are counted in ip->blocks unlike index blocks
+static bool _bmap_fill(bmap_walk *w, uint *slot, index_page *owner, bool data){
+    if(*slot != 0) return true;
+    assert(w->alloc);
+    uint bno = _take_block(w->ip, w->pool);
+    if(bno == 0){
+        Error("_which_write: no enough space");
+        return false;
+    }
+    *slot = bno;
+    if(owner) owner->dirty = true;
+    if(data) w->ip->blocks++;
+    w->changed = true;
+    return true;
+}
+
+// the data block of logic, 0 when it is out of range or out of space; a pass that moves
+// through the file in order reads every index block once
+static uint _bmap_one(bmap_walk *w, uint logic){
     const uint links_per_block = BSIZE / sizeof(uint);
+    inode *ip = w->ip;
+    if(extent_format()) return _ext_bmap(w, logic);
     if(logic < NDIRECT){
-        assert(ip->addrs[logic] != 0);
+        if(!_bmap_fill(w, &ip->addrs[logic], NULL, true)) return 0;
         return ip->addrs[logic];
-    }else if(NDIRECT <= logic && logic < NDIRECT + links_per_block){
-        assert(ip->addrs[NDIRECT] != 0);
-        uint *single_indirect = (uint *)malloc(BSIZE);
-        read_block(ip->addrs[NDIRECT], (uchar *)single_indirect);
-        uint ret = single_indirect[logic - NDIRECT];
-        free(single_indirect);
-        return ret;
-    }else if(logic < NDIRECT + links_per_block + links_per_block * links_per_block){
-        assert(ip->addrs[NDIRECT + 1] != 0); //level 0 exists
-        uint *double_indirect0 = (uint *)malloc(BSIZE);
-        read_block(ip->addrs[NDIRECT + 1], (uchar *)double_indirect0);
-
+    }
+    if(logic < NDIRECT + links_per_block){
+        if(!_bmap_fill(w, &ip->addrs[NDIRECT], NULL, false)) return 0;
+        _page_load(&w->leaf, ip->addrs[NDIRECT]);
+        uint *slot = &w->leaf.links[logic - NDIRECT];
+        if(!_bmap_fill(w, slot, &w->leaf, true)) return 0;
+        return *slot;
+    }
+    if(logic < NDIRECT + links_per_block + links_per_block * links_per_block){
         uint which = (logic - NDIRECT - links_per_block) / links_per_block;
-        uint offset = (logic - NDIRECT - links_per_block) % links_per_block; 
+        uint offset = (logic - NDIRECT - links_per_block) % links_per_block;
         //which block in the second level settled in , and offset is the index in the block
+        if(!_bmap_fill(w, &ip->addrs[NDIRECT + 1], NULL, false)) return 0;
+        _page_load(&w->top, ip->addrs[NDIRECT + 1]);
+        if(!_bmap_fill(w, &w->top.links[which], &w->top, false)) return 0;
+        _page_load(&w->leaf, w->top.links[which]);
+        uint *slot = &w->leaf.links[offset];
+        if(!_bmap_fill(w, slot, &w->leaf, true)) return 0;
+        return *slot;
+    }
+    Error("bmap: logic block %u is out of range", logic);
+    return 0;
+}
 
-        assert(double_indirect0[which] != 0); //level 1 exists
-        uint *double_indirect1 = (uint *)malloc(BSIZE);
-        read_block(double_indirect0[which], (uchar *)double_indirect1);
-        uint ret = double_indirect1[offset];
+// the data blocks of logic blocks [start, start + n), which must all be allocated
+static void _bmap(inode *ip, uint start, uint n, uint *bnos){
+    bmap_walk w;
+    _bmap_begin(&w, ip, false, NULL);
+    for(uint i = 0; i < n; i++) bnos[i] = _bmap_one(&w, start + i);
+    _bmap_end(&w);
+}
 
-        free(double_indirect0);
-        free(double_indirect1);
-        return ret;
-    }else {
-        Error("_which_read: logic is out of range");
-        return 0;
+// the same, allocating the blocks that are missing; returns how many were mapped, fewer
+// than n when the disk is full. The index blocks and the inode are stored once
+static uint _bmap_alloc(inode *ip, uint start, uint n, extent_pool *pool, uint *bnos){
+    bmap_walk w;
+    _bmap_begin(&w, ip, true, pool);
+    uint i = 0;
+    while(i < n && (bnos[i] = _bmap_one(&w, start + i)) != 0) i++;
+    _bmap_end(&w);
+    return i;
+}
+
+uint _which_read(inode *ip ,uint logic){
+    uint bno;
+    _bmap(ip, logic, 1, &bno);
+    return bno;
+}
+
+uint _which_write(inode *ip, uint logic){
+    uint bno;
+    return _bmap_alloc(ip, logic, 1, NULL, &bno) ? bno : 0;
+}
+
+
+/* readahead */
+
+#define RA_SLOTS 64 // inodes whose reads are followed, by inum modulo RA_SLOTS
+
+typedef struct {
+    uint inum;
+    uint next;    // the logic block a sequential read asks for next
+    uint window;  // blocks kept read ahead of it, 0 until the reads look sequential
+    uint ra_end;  // first logic block not prefetched yet
+} ra_state;
+
+static ra_state ra_table[RA_SLOTS];
+static uint ra_min = RA_MIN_WINDOW, ra_max = RA_MAX_WINDOW;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_readahead(uint min_window, uint max_window){
+    pthread_mutex_lock(&ra_lock);
+    ra_min = max(min_window, 1);
+    ra_max = max_window;
+    memset(ra_table, 0, sizeof(ra_table));
+    pthread_mutex_unlock(&ra_lock);
+}
+
+// copy the indirect block bno if it is cached; the readahead never waits for one
+static bool _cached_page(uint bno, uint *page){
+    if(!bcache_cached(bno)) return false;
+    read_block(bno, (uchar *)page);
+    return true;
+}
+
+// _which_read without going to the disk: the data block of logic, or false with the
+// indirect block that has to be read first in *bno
+static bool _ra_map(inode *ip, uint logic, uint *page, uint *bno){
+    const uint links_per_block = BSIZE / sizeof(uint);
+    if(extent_format()){
+        extent_hdr *h = _ext_root(ip);
+        while(h->depth > 0){
+            *bno = _ext_entries(h)[max(_ext_search(h, logic), 0)].start;
+            if(!_cached_page(*bno, page)) return false;
+            h = (extent_hdr *)page;
+        }
+        extent *e = &_ext_entries(h)[max(_ext_search(h, logic), 0)];
+        *bno = e->start + logic - e->logic;
+        return true;
+    }
+    if(logic < NDIRECT){
+        *bno = ip->addrs[logic];
+        return true;
     }
+    if(logic < NDIRECT + links_per_block){
+        *bno = ip->addrs[NDIRECT];
+        if(!_cached_page(*bno, page)) return false;
+        *bno = page[logic - NDIRECT];
+        return true;
+    }
+    uint which = (logic - NDIRECT - links_per_block) / links_per_block;
+    uint offset = (logic - NDIRECT - links_per_block) % links_per_block;
+    *bno = ip->addrs[NDIRECT + 1];
+    if(!_cached_page(*bno, page)) return false;
+    *bno = page[which];
+    if(!_cached_page(*bno, page)) return false;
+    *bno = page[offset];
+    return true;
 }
 
+// called by readi after reading logic blocks [start, end]: a read that carries on where the
+// last one stopped doubles the window, up to ra_max, and the blocks up to the window
+// beyond end are queued for prefetch_blocks; any other read resets it
+static void _readahead(inode *ip, uint start, uint end){
+    uint nblocks = min((ip->fileSize + BSIZE - 1) / BSIZE, ip->blocks);
+    pthread_mutex_lock(&ra_lock);
+    ra_state *st = &ra_table[ip->inum % RA_SLOTS];
+    bool known = st->inum == ip->inum;
+    bool seq = start == 0 || (known && (start == st->next || start + 1 == st->next));
+    if(!known || !seq || start == 0){
+        *st = (ra_state){.inum = ip->inum, .next = end + 1};
+        if(!seq || ra_max == 0){
+            pthread_mutex_unlock(&ra_lock);
+            return;
+        }
+    }
+    st->next = end + 1;
+    st->window = st->window ? min(st->window * 2, ra_max) : min(ra_min, ra_max);
+    uint from = max(st->ra_end, end + 1), to = min(end + 1 + st->window, nblocks);
+    // top the window up once half of it has been consumed
+    if(st->window == 0 || from >= to || from > end + 1 + st->window / 2){
+        pthread_mutex_unlock(&ra_lock);
+        return;
+    }
+    st->ra_end = to;
+    pthread_mutex_unlock(&ra_lock);
 
-int readi(inode *ip, uchar *dst, uint off, uint n) {
+    uint *bnos = buf_get((to - from) * sizeof(uint));
+    uint *page = buf_get(BSIZE);
+    int n = 0;
+    for(uint logic = from; logic < to; logic++){
+        uint bno;
+        if(!_ra_map(ip, logic, page, &bno)){
+            // fetch the indirect block, the data behind it goes out with the next read
+            bnos[n++] = bno;
+            pthread_mutex_lock(&ra_lock);
+            if(st->inum == ip->inum && st->ra_end > logic) st->ra_end = logic;
+            pthread_mutex_unlock(&ra_lock);
+            break;
+        }
+        bnos[n++] = bno;
+    }
+    prefetch_blocks(bnos, n);
+    buf_put(page);
+    buf_put(bnos);
+}
+
+// readi, which only reads ahead for ahead, writei's partial blocks do not count as reads
+static int _readi(inode *ip, uchar *dst, uint off, uint n, bool ahead) {
     if(n == 0){
         return 0; // No data to read
     }
@@ -171,156 +1091,88 @@ int readi(inode *ip, uchar *dst, uint off, uint n) {
     int bytesRead = 0;
     uint start_block = off / BSIZE;
     uint end_block = min(ip->fileSize - 1 , off + n - 1) / BSIZE; // Calculate the end block, is this correct?
-    uchar *fileSlot = (uchar *)malloc((end_block - start_block + 1) * BSIZE);
+    uchar *fileSlot = buf_get((end_block - start_block + 1) * BSIZE);
     memset(fileSlot, 0, (end_block - start_block + 1) * BSIZE);
 
-    for(uint logic = start_block; logic <= end_block; logic ++){
-        uint bno = _which_read(ip, logic);
-        read_block(bno, fileSlot + (logic - start_block) * BSIZE);
-    }
+    uint nblocks = end_block - start_block + 1;
+    uint *bnos = buf_get(nblocks * sizeof(uint));
+    _bmap(ip, start_block, nblocks, bnos); // each index block is read once for the range
+    read_blocks(bnos, nblocks, fileSlot); // one request per MAX_RANGE blocks
+    buf_put(bnos);
+    if(ahead) _readahead(ip, start_block, end_block);
     uint left = off % BSIZE; //where the data wanted starts in fileSlot
     bytesRead = min(n, ip->fileSize - off); // the bytes to be read
     memcpy(dst, fileSlot + left, bytesRead);
-    free(fileSlot);
+    buf_put(fileSlot);
     return bytesRead;
 }
 
-uint _which_write(inode *ip, uint logic){ 
-    //this function should be called sequentially
-    //return the block number of block that waits to be written
-    //allocate a new block if the block is not allocated
-    //update the block number each time when allocate a new block
-    const uint links_per_block = BSIZE / sizeof(uint);
-    if(logic < NDIRECT){
-        if(ip->addrs[logic] == 0){
-            uint bno = allocate_data_block();
-            if(bno == 0){
-                Error("_which_write: no enough space");
-                return 0;
-            }else{
-                ip->addrs[logic] = bno;
-                ip->blocks++;
-            }
-        }
-        assert(ip->addrs[logic] != 0);
-        iupdate(ip);
-        return ip->addrs[logic];
-    }else if(NDIRECT <= logic && logic <NDIRECT + links_per_block){
-        if(ip->addrs[NDIRECT] == 0){ // the block for single indirect is not allocated yet
-            uint bno = allocate_data_block();
-            if(bno == 0){
-                Error("_which_write: no enough space");
-                return 0;
-            }else{
-                ip->addrs[NDIRECT] = bno;
-                //these are index blocks , no need to increase ip->blocks
-            }
-        }
-        assert(ip->addrs[NDIRECT] != 0);
-
-        uint *single_indirect = (uint *)malloc(BSIZE);
-        read_block(ip->addrs[NDIRECT], (uchar *)single_indirect);
-        if(single_indirect[logic - NDIRECT] == 0){
-            uint bno = allocate_data_block();
-            if(!bno){
-                Error("_which_write: no enough space");
-                free(single_indirect);
-                return 0;
-            }
-            single_indirect[logic - NDIRECT] = bno;
-            ip->blocks++; //a data block is allocated
-        }
-        assert(single_indirect[logic - NDIRECT] != 0);
-        write_block(ip->addrs[NDIRECT], (uchar *)single_indirect);
-        uint ret = single_indirect[logic - NDIRECT];
-        free(single_indirect);
-        iupdate(ip);
-        return ret;
-    }else if(logic < NDIRECT + links_per_block + links_per_block * links_per_block){
-        if(ip->addrs[NDIRECT + 1] == 0){ // 0th level indirect block is not allocated yet
-            uint bno = allocate_data_block();
-            if(bno == 0){
-                Error("_which_write: no enough space");
-                return 0;
-            }else{
-                ip->addrs[NDIRECT + 1] = bno;
-                //these are index blocks , no need to increase ip->blocks
-            }
-        }
-        assert(ip->addrs[NDIRECT + 1] != 0); //level 0 exists
-
-        uint where = (logic - NDIRECT - links_per_block) / links_per_block; //which second level block
-        uint offset = (logic - NDIRECT - links_per_block) % links_per_block;
-
-        uint *double_indirect0 = (uint *)malloc(BSIZE);
-        read_block(ip->addrs[NDIRECT + 1], (uchar *)double_indirect0);
-
-        if(double_indirect0[where] == 0){ // the corresponding second level block is not allocated 
-            uint bno = allocate_data_block();
-            if(bno == 0){
-                Error("_which_write: no enough space");
-                free(double_indirect0);
-                return 0;
-            }else{
-                double_indirect0[where] = bno;
-                //these are index blocks , no need to increase ip->blocks
-            }
-        }
-        assert(double_indirect0[where] != 0); //level 1 exists
-
-        uint *double_indirect1 = (uint *)malloc(BSIZE);
-        read_block(double_indirect0[where],(uchar *)double_indirect1);
-        if(double_indirect1[offset] == 0){ // the data block doesn't exist
-            uint bno = allocate_data_block();
-            if(bno == 0){
-                Error("_which_write: no enough space");
-                free(double_indirect0);
-                free(double_indirect1);
-                return 0;
-            }else{
-                double_indirect1[offset] = bno;
-                ip->blocks++;
-            }
-        }
-        assert(double_indirect1[offset]!=0); //data block exists
+int readi(inode *ip, uchar *dst, uint off, uint n) {
+    _ilock_shared(ip);
+    if(n == 0 || off >= ip->fileSize){
+        _iunlock(ip);
+        return 0;
+    }
+    n = min(n, ip->fileSize - off);
+    // appends still buffered are copied from memory, the disk has the rest
+    uint from = _da_overlay(ip, dst, off, n);
+    if(from > off) _readi(ip, dst, off, from - off, true);
+    _iunlock(ip);
+    return n;
+}
 
-        write_block(ip->addrs[NDIRECT + 1],(uchar *)double_indirect0);
-        write_block(double_indirect0[where], (uchar *)double_indirect1);
-        iupdate(ip);
+// give back what a write reserved and did not use
+static void _release_pool(extent_pool *pool){
+    if(pool->left == 0) return;
+    uint *bnos = buf_get(pool->left * sizeof(uint));
+    for(uint i = 0; i < pool->left; i++) bnos[i] = pool->next + i;
+    free_blocks(bnos, pool->left);
+    buf_put(bnos);
+    pool->left = 0;
+}
 
-        uint ret = double_indirect1[offset];
-        free(double_indirect0);
-        free(double_indirect1);
-        return ret;
+int writei(inode *ip, uchar *src, uint off, uint n) {
+    _ilock(ip);
+    if(off > ip->fileSize){
+        Error("writei: off too large, file size is %d, off is %d", ip->fileSize, off);
+        _iunlock(ip);
+        return -1;
+    }
+    int ret = _da_append(ip, src, off, n);
+    if(ret != 0){
+        ret = ret < 0 ? -1 : (int)n;
     }else{
-        Error("_which_write: logic block number out of range");
-        return 0;
+        // what is buffered lands first, the write may cover it
+        ret = _isync(ip) < 0 ? -1 : _writei_now(ip, src, off, n);
     }
+    _iunlock(ip);
+    return ret;
 }
 
-int writei(inode *ip, uchar *src, uint off, uint n) {
+// write through to the disk, allocating the blocks the write needs
+static int _writei_now(inode *ip, uchar *src, uint off, uint n) {
     //write into an inode from position off, n bytes
     if(off > ip->fileSize){
         Error("writei: off too large, file size is %d, off is %d", ip->fileSize, off);
         return -1;
     }
     uint start_block = off / BSIZE, end_block = (off + n - 1) / BSIZE;
-    uchar *toWrite  = (uchar *)malloc((end_block - start_block + 1) * BSIZE);
+    uchar *toWrite  = buf_get((end_block - start_block + 1) * BSIZE);
     memset(toWrite, 0, (end_block - start_block + 1) * BSIZE);
 
 
     //add prefix for src to make it fit in integer numbers of blocks
-    uchar *tmp = (uchar *)malloc(BSIZE);
-    readi(ip, tmp, start_block * BSIZE, BSIZE);
+    uchar *tmp = buf_get(BSIZE);
+    _readi(ip, tmp, start_block * BSIZE, BSIZE, false);
     memcpy(toWrite, tmp, off % BSIZE);
     memcpy(toWrite + off % BSIZE, src, n);
 
 
     //add suffix for src to make it fit in integer numbers of blocks
     uint stop_point = (off + n - 1)%BSIZE;
-    readi(ip, tmp, end_block * BSIZE, BSIZE);
+    _readi(ip, tmp, end_block * BSIZE, BSIZE, false);
     memcpy(toWrite + off % BSIZE + n, tmp + stop_point + 1, BSIZE - stop_point - 1);
-    free(tmp);
+    buf_put(tmp);
 
     uint old = ip->fileSize; //save the old file size
     bool is_overwrite = false;
@@ -328,14 +1180,17 @@ int writei(inode *ip, uchar *src, uint off, uint n) {
         ip->fileSize = start_block * BSIZE; //the newly written content will overwrite the old content
         is_overwrite = true;
     } 
-    for(uint logic = start_block ; logic <= end_block;logic++){ //logic: the logic block number
-        uint bno = _which_write(ip, logic);
-        if(bno == 0){
-            Error("writei: no enough space");
-            free(toWrite);
-            return -1;
-        }
-        write_block(bno, toWrite + (logic - start_block) * BSIZE);
+    // the blocks past the end of the file are reserved as one contiguous run,
+    // right after the file's last block when that is free
+    extent_pool pool = {0, 0, 0};
+    if(end_block + 1 > ip->blocks){
+        pool.want = end_block + 1 - max(ip->blocks, start_block);
+        pool.next = ip->blocks > 0 ? _which_read(ip, ip->blocks - 1) + 1 : data_goal(ip->inum);
+    }
+    uint nblocks = end_block - start_block + 1;
+    uint *bnos = buf_get(nblocks * sizeof(uint));
+    uint mapped = _bmap_alloc(ip, start_block, nblocks, &pool, bnos);
+    for(uint logic = start_block ; logic < start_block + mapped;logic++){ //logic: the logic block number
         if(is_overwrite){
             if(logic != end_block) ip->fileSize += BSIZE; //if it is an overwrite, we should increase the file size
             else {
@@ -344,10 +1199,22 @@ int writei(inode *ip, uchar *src, uint off, uint n) {
                 else ip->fileSize += tail; //otherwise, we should increase the file size by the tail
             }
         } 
-        Warn("writei: %s :%s writing block %d, file size is now %d",ip->type==T_FILE?"FILE":"DIRECTORY",ip->name, bno, ip->fileSize);
+        Warn("writei: %s :%s writing block %d, file size is now %d",ip->type==T_FILE?"FILE":"DIRECTORY",ip->name, bnos[logic - start_block], ip->fileSize);
+    }
+    if(mapped < nblocks){
+        Error("writei: no enough space");
+        write_blocks(bnos, mapped, toWrite); //keep what has been mapped so far
+        iupdate(ip);
+        _release_pool(&pool);
+        buf_put(bnos);
+        buf_put(toWrite);
+        return -1;
     }
 
-    free(toWrite);
+    write_blocks(bnos, nblocks, toWrite); //ship all data blocks in as few requests as possible
+    _release_pool(&pool);
+    buf_put(bnos);
+    buf_put(toWrite);
     // ip->fileSize = max(ip->fileSize, off + n); //update the file size
     assert(ip->fileSize  == max(old, off + n)); //the file size should be at least old or off + n
     iupdate(ip);
@@ -360,28 +1227,48 @@ int wipeout_inode(inode *ip){
         Error("wipeout_inode: ip is NULL");
         return E_ERROR;
     }
+    _ilock(ip);
+    _da_drop(ip->inum);
     uint total_blocks = ip->blocks;
-    for(uint i=0;i<total_blocks;i++){
-        uint bno = _which_read(ip, i);
-        free_block(bno);
-    }
+    // every block of the file is released by a single free_blocks call; an extent tree
+    // has fewer nodes than the file has blocks
+    uint *bnos = buf_get((2 * total_blocks + BSIZE / sizeof(uint) + 3) * sizeof(uint));
+    _bmap(ip, 0, total_blocks, bnos);
+    int n = total_blocks;
 
-    if(ip->addrs[NDIRECT] != 0){
-        free_block(ip->addrs[NDIRECT]);
+    if(extent_format()){
+        n += _ext_nodes(_ext_root(ip), bnos + n);
+    }else if(ip->addrs[NDIRECT] != 0){
+        bnos[n++] = ip->addrs[NDIRECT];
     }
 
-    if(ip->addrs[NDIRECT + 1] != 0){
-        uint *double_indirect0 = (uint *)malloc(BSIZE);
+    if(!extent_format() && ip->addrs[NDIRECT + 1] != 0){
+        uint *double_indirect0 = buf_get(BSIZE);
         read_block(ip->addrs[NDIRECT + 1], (uchar *)double_indirect0);
         for(uint i=0;i<BSIZE/sizeof(uint);i++){
             if(double_indirect0[i] != 0){
-                free_block(double_indirect0[i]);
+                bnos[n++] = double_indirect0[i];
             }
         }
-        free_block(ip->addrs[NDIRECT + 1]);
-        free(double_indirect0);
+        bnos[n++] = ip->addrs[NDIRECT + 1];
+        buf_put(double_indirect0);
     }
 
-    free_block(ip->inum);
+    // the inode block goes back once none of its dinodes is in use
+    pthread_mutex_lock(&ialloc_lock);
+    dinode empty;
+    memset(&empty, 0, sizeof(empty));
+    _write_dinode(ip->inum, &empty);
+    dinode *blk = buf_get(BSIZE);
+    read_block(inum_block(ip->inum), (uchar *)blk);
+    bool used = false;
+    for(uint i = 0; i < inodes_per_block(); i++) used = used || blk[i].type != 0;
+    if(!used) bnos[n++] = inum_block(ip->inum);
+    buf_put(blk);
+    free_blocks(bnos, n);
+    pthread_mutex_unlock(&ialloc_lock);
+    ip->type = 0; // the iput that follows stores nothing
+    _iunlock(ip);
+    buf_put(bnos);
     return E_SUCCESS;
 }
@@ -28,10 +28,15 @@ int handle_f(char *args) {
     ncyl = atoi(tk);
     tk = strtok(NULL, " ");
     nsec = atoi(tk);
-    if (ncyl <= 0 || nsec <= 0) {
+    tk = strtok(NULL, " ");
+    int ngroups = tk ? atoi(tk) : 0; // cylinder groups, 0 for one inode and one data region
+    char *map = tk ? strtok(NULL, " ") : NULL; // "extents" or "blocks", how files map their blocks
+    if (ncyl <= 0 || nsec <= 0 || ngroups < 0 || (map && strcmp(map, "extents") != 0 && strcmp(map, "blocks") != 0)) {
         ReplyNo("Invalid arguments");
         return 1;
     }
+    if (tk) set_format_layout(ngroups);
+    if (map) set_format_extents(strcmp(map, "extents") == 0);
     if (cmd_f(ncyl, nsec) == E_SUCCESS) {
         ReplyYes();
     } else {
@@ -272,6 +277,9 @@ FILE *log_file;
 int main(int argc, char *argv[]) {
     log_init("fs.log");
 
+    // ./FS_local [mmap:FILE:NCYL:NSEC | pread:FILE:NCYL:NSEC | ram:NCYL:NSEC], the BDS otherwise
+    if (argc > 1 && set_block_device(argv[1]) != 0) return 1;
+
     // assert(BSIZE % sizeof(dinode) == 0);
 
     // get disk info and store in global variables
@@ -9,6 +9,7 @@
 #include "../../include/log.h"
 #include "../../include/tcp_buffer.h"
 #include "../../include/tcp_utils.h"
+#include "../include/block.h"
 #include "../include/fs.h"
 #include "../include/common.h"
 #include "assert.h"
@@ -30,8 +31,10 @@ int handle_f(tcp_buffer *wb, int argc, char *args[], char *reply){
     pthread_mutex_lock(&writer);
 
     static char buf[BUFSIZE];
-    if(argc != 1){
-        sprintf(buf, "Usage: f (a single f)\n");
+    bool map_arg = argc == 3 && (strcmp(args[2], "extents") == 0 || strcmp(args[2], "blocks") == 0);
+    if(argc > 3 || (argc >= 2 && atoi(args[1]) < 0) || (argc == 3 && !map_arg)){
+        sprintf(buf, "Usage: f [ngroups] [extents|blocks] (reformat with ngroups cylinder groups, 0 for the flat layout,\n"
+                     "       files mapped by extents or by block pointers, blocks when not given)\n");
         Error("format : Invalid arguments");
         reply_with_no(wb, buf, strlen(buf) + 1);
         pthread_mutex_unlock(&writer);
@@ -39,6 +42,8 @@ int handle_f(tcp_buffer *wb, int argc, char *args[], char *reply){
         return -1;
     }
     assert(strcmp(args[0], "f") == 0);
+    if(argc >= 2) set_format_layout(atoi(args[1]));
+    if(map_arg) set_format_extents(strcmp(args[2], "extents") == 0);
     int ret = cmd_f();
     if(ret != E_SUCCESS){
         sprintf(buf, "format : format failed, only Root user can format\n");
@@ -791,12 +796,18 @@ int main(int argc, char *argv[]) {
     int FSPort=1145;
     if(argc != 4){
         fprintf(stderr, "Usage: ./FS <DiskServerAddress> <BDSPort=10356> <FSPort=12356>\n");
+        fprintf(stderr, "   or: ./FS <mmap:FILE:NCYL:NSEC | pread:FILE:NCYL:NSEC | ram:NCYL:NSEC> - <FSPort>\n");
     } else {
         FSPort = atoi(argv[3]);
-        // initialize disk-server address and port from arguments
-        BDS_port = atoi(argv[2]);
-        strncpy(BDS_addr, argv[1], sizeof(BDS_addr) - 1);
-        BDS_addr[sizeof(BDS_addr) - 1] = '\0';
+        if(strchr(argv[1], ':')){
+            // a block device in this process, no BDS
+            if(set_block_device(argv[1]) != 0) return -1;
+        }else{
+            // initialize disk-server address and port from arguments
+            BDS_port = atoi(argv[2]);
+            strncpy(BDS_addr, argv[1], sizeof(BDS_addr) - 1);
+            BDS_addr[sizeof(BDS_addr) - 1] = '\0';
+        }
         if(FSPort <= 0){
             fprintf(stderr, "Invalid port number\n");
             return -1;
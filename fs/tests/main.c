@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "../include/block.h"
 #include "../../include/log.h"
 #include "../../include/mintest.h"
 
@@ -32,7 +33,10 @@ int main(int argc, char **argv) {
             test = fs_tests;
         }
     }
+    // a second argument runs the tests on a local block device instead of the BDS
+    if (argc > 2 && set_block_device(argv[2]) != 0) return 1;
     mt_main(test);
+    flush_disk(); // the next run on the same image finds what this one wrote, not part of it
     log_close();
     return mt_fail_count;
 }
\ No newline at end of file
@@ -1,8 +1,13 @@
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "../include/bcache.h"
+#include "../include/blkdev.h"
 #include "../include/block.h"
 #include "../include/common.h"
+#include "../../include/log.h"
 #include "../../include/mintest.h"
 
 int nmeta;
@@ -24,6 +29,7 @@ void mock_format() {
             if (i + j < nmeta) buf[j / 8] |= 1 << (j % 8);  // mark as used
         write_block(BBLOCK(i), buf);
     }
+    _fetch_bitmap(); // the bitmap blocks were written behind the allocator's back
 }
 
 mt_test(test_read_write_block) {
@@ -41,6 +47,138 @@ mt_test(test_read_write_block) {
     return 0;
 }
 
+mt_test(test_read_write_blocks) {
+    // a contiguous run followed by scattered blocks, more than one request worth
+    uint n = MAX_RANGE + 6;
+    uint bnos[MAX_RANGE + 6];
+    for (uint i = 0; i < n; i++) bnos[i] = (i < MAX_RANGE) ? 100 + i : 400 + 3 * i;
+
+    uchar *write_buf = malloc(n * BSIZE), *read_buf = malloc(n * BSIZE);
+    for (uint i = 0; i < n * BSIZE; i++) write_buf[i] = (uchar)(i * 7 + i / BSIZE);
+
+    write_blocks(bnos, n, write_buf);
+    memset(read_buf, 0, n * BSIZE);
+    read_blocks(bnos, n, read_buf);
+    mt_assert(memcmp(write_buf, read_buf, n * BSIZE) == 0);
+
+    uchar one[BSIZE];
+    read_block(bnos[n - 1], one);
+    mt_assert(memcmp(one, write_buf + (n - 1) * BSIZE, BSIZE) == 0);
+    free(write_buf);
+    free(read_buf);
+    return 0;
+}
+
+mt_test(test_async_block_io) {
+    // more requests than BIO_QDEPTH, collected out of order
+    enum { NREQ = BIO_QDEPTH + 4 };
+    uchar wbuf[NREQ][2 * BSIZE], rbuf[NREQ][2 * BSIZE];
+    int tags[NREQ];
+    for (int i = 0; i < NREQ; i++) {
+        uint bnos[2] = {600 + 2 * i, 900 - 5 * i};  // scattered, so the BDS may reorder them
+        memset(wbuf[i], 'a' + i, sizeof(wbuf[i]));
+        tags[i] = submit_write_blocks(bnos, 2, wbuf[i]);
+        mt_assert(tags[i] > 0);
+        if (i >= BIO_QDEPTH / 2) mt_assert(wait_block_io(tags[i - BIO_QDEPTH / 2]) == 0);
+    }
+    for (int i = NREQ - BIO_QDEPTH / 2; i < NREQ; i++) mt_assert(wait_block_io(tags[i]) == 0);
+
+    memset(rbuf, 0, sizeof(rbuf));
+    for (int i = 0; i < BIO_QDEPTH; i++) {
+        uint bnos[2] = {600 + 2 * i, 900 - 5 * i};
+        tags[i] = submit_read_blocks(bnos, 2, rbuf[i]);
+        mt_assert(tags[i] > 0);
+    }
+    for (int i = BIO_QDEPTH - 1; i >= 0; i--) {
+        mt_assert(wait_block_io(tags[i]) == 0);
+        mt_assert(memcmp(rbuf[i], wbuf[i], sizeof(wbuf[i])) == 0);
+    }
+    mt_assert(wait_block_io(tags[0]) != 0);  // already collected
+
+    uint bad = 1u << 30;
+    mt_assert(submit_read_blocks(&bad, 1, rbuf[0]) < 0);
+
+    int status = -1;
+    uint one = 600;
+    int tag = submit_read_blocks(&one, 1, rbuf[0]);
+    int got;
+    while ((got = poll_block_io(&status)) == 0);
+    mt_assert(got == tag && status == 0);
+    mt_assert(drain_block_io() == 0);
+    return 0;
+}
+
+mt_test(test_discard_blocks) {
+    // two runs of adjacent blocks around a block that is left alone
+    uint bnos[9] = {700, 701, 702, 703, 710, 711, 712, 713, 714};
+    uchar buf[9 * BSIZE], keep[BSIZE], back[9 * BSIZE];
+    memset(buf, 'd', sizeof(buf));
+    memset(keep, 'k', sizeof(keep));
+    write_blocks(bnos, 9, buf);
+    write_block(705, keep);
+
+    discard_blocks(bnos, 9);
+    memset(back, 'x', sizeof(back));
+    read_blocks(bnos, 9, back);
+    for (int i = 0; i < sizeof(back); i++) mt_assert(back[i] == 0);
+    read_block(705, back);
+    mt_assert(memcmp(back, keep, BSIZE) == 0);
+
+    // a run longer than MAX_RANGE still goes out as one discard
+    enum { LONG_RUN = 3 * MAX_RANGE + 5 };
+    uint run[LONG_RUN];
+    uchar *data = malloc(LONG_RUN * BSIZE);
+    for (int i = 0; i < LONG_RUN; i++) run[i] = 1500 + i;
+    memset(data, 'l', LONG_RUN * BSIZE);
+    write_blocks(run, LONG_RUN, data);
+    write_block(1500 + LONG_RUN, keep);
+    discard_blocks(run, LONG_RUN);
+    memset(data, 'x', LONG_RUN * BSIZE);
+    read_blocks(run, LONG_RUN, data);
+    for (int i = 0; i < LONG_RUN * BSIZE; i++) mt_assert(data[i] == 0);
+    free(data);
+    read_block(1500 + LONG_RUN, back);
+    mt_assert(memcmp(back, keep, BSIZE) == 0);
+    return 0;
+}
+
+mt_test(test_bcache) {
+    uchar wbuf[BSIZE], rbuf[BSIZE];
+    bcache_stat st;
+    memset(wbuf, 'c', BSIZE);
+    write_block(800, wbuf);
+    mt_assert(bcache_dirty(800));
+    bcache_reset_stats();
+    for (int i = 0; i < 3; i++) {
+        read_block(800, rbuf);
+        mt_assert(memcmp(rbuf, wbuf, BSIZE) == 0);
+    }
+    bcache_get_stats(&st);
+    mt_assert(st.hits == 3 && st.misses == 0);
+
+    // the disk sees the block once it is flushed, an async read goes around the cache
+    uint bno = 800;
+    int tag = submit_read_blocks(&bno, 1, rbuf);
+    mt_assert(tag > 0 && wait_block_io(tag) == 0 && memcmp(rbuf, wbuf, BSIZE) == 0);
+    mt_assert(!bcache_dirty(800));
+
+    // reading more blocks than fit pushes the oldest ones out
+    bcache_reset_stats();
+    for (int i = 0; i <= BCACHE_NBUF; i++) read_block(i, rbuf);
+    bcache_get_stats(&st);
+    mt_assert(st.evictions >= 1 && st.misses + st.hits == BCACHE_NBUF + 1);
+
+    // bulk writes go through and keep a cached copy current
+    read_block(801, rbuf);
+    memset(wbuf, 'e', BSIZE);
+    bno = 801;
+    write_blocks(&bno, 1, wbuf);
+    mt_assert(!bcache_dirty(801));
+    read_block(801, rbuf);
+    mt_assert(memcmp(rbuf, wbuf, BSIZE) == 0);
+    return 0;
+}
+
 mt_test(test_zero_block) {
     uchar buf[BSIZE];
     memset(buf, 0xFF, BSIZE);
@@ -103,13 +241,118 @@ mt_test(test_free_block) {
     return 0;
 }
 
+mt_test(test_bitmap_resident) {
+    mock_format();
+    bcache_flush();
+    uint bno = allocate_block();
+    mt_assert(bno == nmeta);
+    // one bit flipped, one bitmap block written
+    for (int i = 0; i < sb.n_bitmap_blocks; i++) mt_assert(bcache_dirty(sb.bmapstart + i) == (sb.bmapstart + i == BBLOCK(bno)));
+
+    // the allocator trusts its own copy, not the disk, and writes it back over the disk's
+    uchar buf[BSIZE];
+    memset(buf, 0xff, BSIZE);
+    write_block(BBLOCK(bno), buf);
+    mt_assert(allocate_block() == bno + 1);
+    read_block(BBLOCK(bno), buf);
+    mt_assert((buf[(bno + 2) / 8] & (1 << ((bno + 2) % 8))) == 0);
+
+    // until it is told to reload
+    memset(buf, 0xff, BSIZE);
+    write_block(BBLOCK(bno), buf);
+    _fetch_bitmap();
+    mt_assert(allocate_block() == 0);
+    return 0;
+}
+
+mt_test(test_allocate_nearly_full) {
+    // 90% full: only every tenth block past the metadata is free
+    mock_format();
+    uchar buf[BSIZE];
+    memset(buf, 0xff, BSIZE);
+    int nfree = 0;
+    for (int b = nmeta; b < sb.size; b++) {
+        if (b % 10 == 0) {
+            buf[b / 8] &= ~(1 << (b % 8));
+            nfree++;
+        }
+    }
+    write_block(sb.bmapstart, buf);
+    _fetch_bitmap();
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint last = 0;
+    for (int i = 0; i < nfree; i++) {
+        uint bno = allocate_block();
+        mt_assert(bno % 10 == 0 && bno > last);  // next fit, in block order
+        last = bno;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    Log("test_allocate_nearly_full: %d allocations, %ld us each", nfree,
+        ((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000) / nfree);
+    mt_assert(allocate_block() == 0);
+
+    // the cursor wraps around to a block freed behind it
+    uint low = (nmeta + 9) / 10 * 10;
+    free_block(low);
+    mt_assert(allocate_block() == low);
+    return 0;
+}
+
+mt_test(test_local_devices) {
+    if (strcmp(block_device(), "bds") != 0) {
+        Log("test_local_devices: skipped, the tests run on the %s device", block_device());
+        return 0;
+    }
+    const blkdev_ops *devs[] = {&blkdev_mmap, &blkdev_pread, &blkdev_ram};
+    const char *path = "test_blkdev.img";
+    uchar wbuf[4 * BSIZE], rbuf[4 * BSIZE], zeros[2 * BSIZE];
+    memset(zeros, 0, sizeof(zeros));
+    for (int d = 0; d < 3; d++) {
+        const blkdev_ops *dev = devs[d];
+        unlink(path);
+        mt_assert(dev->open(path, 4, 16) == 0);
+        uint scattered[4] = {63, 5, 6, 40};
+        for (int i = 0; i < 4 * BSIZE; i++) wbuf[i] = i * 3 + d;
+        mt_assert(dev->write(scattered, 4, wbuf) == 0);
+        mt_assert(dev->read(scattered, 4, rbuf) == 0);
+        mt_assert(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+
+        uint past_end = 64;
+        mt_assert(dev->read(&past_end, 1, rbuf) != 0);
+        mt_assert(dev->discard(5, 2) == 0);
+        mt_assert(dev->read(scattered + 1, 2, rbuf) == 0);
+        mt_assert(memcmp(rbuf, zeros, 2 * BSIZE) == 0);
+        mt_assert(dev->flush() == 0);
+        dev->close();
+
+        if (dev != &blkdev_ram) {
+            // what was written survives reopening the image
+            mt_assert(dev->open(path, 4, 16) == 0);
+            mt_assert(dev->read(scattered, 1, rbuf) == 0);
+            mt_assert(memcmp(rbuf, wbuf, BSIZE) == 0);
+            dev->close();
+        }
+    }
+    unlink(path);
+    return 0;
+}
+
 void block_tests() {
     mock_format();
     mt_run_test(test_read_write_block);
+    mt_run_test(test_read_write_blocks);
+    mt_run_test(test_async_block_io);
+    mt_run_test(test_discard_blocks);
+    mt_run_test(test_bcache);
     mt_run_test(test_zero_block);
     mt_run_test(test_allocate_block);
     mt_run_test(test_allocate_block_all);
     mt_run_test(test_free_block);
+    mt_run_test(test_bitmap_resident);
+    mt_run_test(test_allocate_nearly_full);
+    mt_run_test(test_local_devices);
     free(sb.bitmap);
     sb.bitmap = NULL;
 }
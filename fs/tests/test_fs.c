@@ -3,10 +3,12 @@
 #include <string.h>
 #include <time.h>
 
+#include "../include/bcache.h"
 #include "../include/block.h"
 #include "../include/common.h"
 #include "../include/fs.h"
 #include "../include/inode.h"
+#include "../../include/log.h"
 #include "../../include/mintest.h"
 
 static void format() {
@@ -245,6 +247,77 @@ mt_test(test_folder_tree_with_rm) {
 }
 
 
+uint _which_read(inode *ip, uint logic);
+
+// cylinders between the inode of each file in the current directory and its first block
+static long inode_data_distance() {
+    entry *entries;
+    int n, ncyl, nsec;
+    long dist = 0;
+    get_disk_info(&ncyl, &nsec);
+    if (cmd_ls(&entries, &n) != E_SUCCESS) return -1;
+    for (int i = 0; i < n; i++) {
+        if (entries[i].type != T_FILE) continue;
+        inode *ip = iget(entries[i].inum);
+        long d = (long)_which_read(ip, 0) / nsec - (long)inum_block(ip->inum) / nsec;
+        dist += d < 0 ? -d : d;
+        iput(ip);
+    }
+    free(entries);
+    return dist;
+}
+
+// build a small tree and read it back; returns how far the files' blocks ended up from
+// their inodes, in cylinders, and logs the seek distance of the requests it took
+static long layout_workload(int ngroups) {
+    set_format_layout(ngroups);
+    format();
+    flush_disk();
+    reset_block_stats();
+    char data[8 * BSIZE], name[MAXNAME];
+    memset(data, 'L', sizeof(data));
+    long placement = 0;
+    for (int d = 0; d < 4; d++) {
+        sprintf(name, "cg%d", d);
+        if (cmd_mkdir(name, 0b1111) != E_SUCCESS || cmd_cd(name) != E_SUCCESS) return -1;
+        for (int f = 0; f < 4; f++) {
+            sprintf(name, "f%d", f);
+            if (cmd_mk(name, 0b1111) != E_SUCCESS || cmd_w(name, sizeof(data), data) != E_SUCCESS) return -1;
+            flush_disk(); // each file is committed, its inode and data blocks go out together
+        }
+        placement += inode_data_distance();
+        cmd_cd("..");
+    }
+    for (int d = 0; d < 4; d++) {
+        sprintf(name, "cg%d", d);
+        cmd_cd(name);
+        for (int f = 0; f < 4; f++) {
+            uchar *buf;
+            uint len;
+            sprintf(name, "f%d", f);
+            if (cmd_cat(name, &buf, &len) != E_SUCCESS || len != sizeof(data)) return -1;
+            free(buf);
+        }
+        cmd_cd("..");
+    }
+    flush_disk();
+    block_stat st;
+    get_block_stats(&st);
+    Log("layout_workload: %d groups, %ld requests, seek distance %ld, inodes %ld cylinders from their data",
+        ngroups, st.requests, st.seek_distance, placement);
+    return placement;
+}
+
+mt_test(test_cylinder_groups) {
+    long flat = layout_workload(0);
+    long groups = layout_workload(8);
+    set_format_layout(0); // the remaining tests get the default layout back
+    format();
+    mt_assert(flat > 0 && groups > 0);
+    mt_assert(groups < flat);
+    return 0;
+}
+
 void fs_tests() {
     mt_run_test(test_cmd_ls);
     mt_run_test(test_cmd_mk);
@@ -259,4 +332,5 @@ void fs_tests() {
     mt_run_test(test_small_file_ops);
     mt_run_test(test_folder_tree_operations);
     mt_run_test(test_folder_tree_with_rm);
+    mt_run_test(test_cylinder_groups);
 }
@@ -1,17 +1,40 @@
 #include <string.h>
 #include "../include/inode.h"
 #include "../include/block.h"
+#include "../include/bcache.h"
+#include "../include/bufpool.h"
 #include "../include/common.h"
 #include "../../include/mintest.h"
 #include "../include/fs.h"
+#include "../../include/log.h"
 #include <time.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 inline static void format() {
     cmd_login(1);
+    set_format_layout(0); // a fresh file system, not whatever the last run left on the image
     cmd_f(1024, 63);
 }
 
+// fill every free data block with junk, as on a disk that has been used before;
+// a fresh image reads back zeros and would hide blocks handed out without being cleared
+static void scribble_free_blocks() {
+    uint bnos[MAX_RANGE];
+    uchar junk[MAX_RANGE * BSIZE];
+    memset(junk, 0xa5, sizeof(junk));
+    int n = 0;
+    for (uint b = sb.data_start; b < sb.size; b++) {
+        if (block_in_use(b) || is_inode_block(b)) continue;
+        bnos[n++] = b;
+        if (n == MAX_RANGE) {
+            write_blocks(bnos, n, junk);
+            n = 0;
+        }
+    }
+    if (n > 0) write_blocks(bnos, n, junk);
+}
+
 mt_test(test_ialloc) {
     format();
     inode *ip = ialloc(T_FILE);
@@ -75,6 +98,7 @@ mt_test(test_writei) {
     int bytes_written = writei(ip, data, 0, sizeof(data));
     mt_assert(bytes_written == sizeof(data));
     mt_assert(ip->fileSize == sizeof(data));
+    isync(ip); // a small append gets its block when it is written out
     mt_assert(ip->blocks > 0);
 
     // Verify the written data
@@ -194,6 +218,531 @@ mt_test(test_random_binary_read_write) {
     return 0;
 }
 
+uint _which_read(inode *ip, uint logic);
+
+mt_test(test_extent_layout) {
+    format();
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    enum { NBLK = NDIRECT + 30 };
+    uchar *data = malloc(NBLK * BSIZE);
+    for (int i = 0; i < NBLK * BSIZE; i++) data[i] = i * 7;
+
+    // one block, then the rest in uneven appends, still laid out as one run
+    mt_assert(writei(ip, data, 0, BSIZE) == BSIZE);
+    for (uint off = BSIZE; off < NBLK * BSIZE; off += 3 * BSIZE + 100) {
+        uint n = min(3 * BSIZE + 100, NBLK * BSIZE - off);
+        mt_assert(writei(ip, data + off, off, n) == n);
+    }
+    isync(ip);
+    mt_assert(ip->blocks == NBLK);
+    for (uint i = 1; i < NBLK; i++) {
+        // the single indirect block sits between the direct blocks and the rest
+        uint gap = i == NDIRECT ? 2 : 1;
+        mt_assert(_which_read(ip, i) == _which_read(ip, i - 1) + gap);
+    }
+    mt_assert(ip->addrs[NDIRECT] == ip->addrs[NDIRECT - 1] + 1);
+
+    uchar *back = malloc(NBLK * BSIZE);
+    mt_assert(readi(ip, back, 0, NBLK * BSIZE) == NBLK * BSIZE);
+    mt_assert(memcmp(back, data, NBLK * BSIZE) == 0);
+
+    // the next file starts right after, nothing reserved was leaked
+    inode *next = ialloc(T_FILE);
+    mt_assert(writei(next, data, 0, BSIZE) == BSIZE);
+    isync(next);
+    mt_assert(_which_read(next, 0) == _which_read(ip, NBLK - 1) + 1);
+    iput(next);
+    iput(ip);
+    free(data);
+    free(back);
+    return 0;
+}
+
+mt_test(test_bufpool_hot_path) {
+    format();
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    enum { NBLK = NDIRECT + 5 }; // reaches into the single indirect block
+    uchar *data = malloc(NBLK * BSIZE), *back = malloc(NBLK * BSIZE);
+    for (int i = 0; i < NBLK * BSIZE; i++) data[i] = i * 13;
+    mt_assert(writei(ip, data, 0, NBLK * BSIZE) == NBLK * BSIZE);
+
+    // once warmed up, rewriting and reading the file takes every scratch buffer from the pool
+    uchar blk[BSIZE];
+    mt_assert(readi(ip, back, 0, NBLK * BSIZE) == NBLK * BSIZE);
+    bufpool_reset_stats();
+    for (int round = 0; round < 20; round++) {
+        mt_assert(writei(ip, data + 100, 100, NBLK * BSIZE - 200) == NBLK * BSIZE - 200);
+        mt_assert(readi(ip, back, 0, NBLK * BSIZE) == NBLK * BSIZE);
+        read_block(inum_block(ip->inum), blk);
+    }
+    bufpool_stat st;
+    bufpool_get_stats(&st);
+    Log("bufpool: %ld buffers handed out, %ld reused, %ld mallocs", st.gets, st.reuses, st.mallocs);
+    mt_assert(st.gets > 0);
+    mt_assert(st.mallocs == 0);
+    mt_assert(st.reuses == st.gets);
+    mt_assert(memcmp(back, data, NBLK * BSIZE) == 0);
+    iput(ip);
+    free(data);
+    free(back);
+    return 0;
+}
+
+mt_test(test_readahead) {
+    format();
+    scribble_free_blocks();
+    set_readahead(RA_MIN_WINDOW, RA_MAX_WINDOW);
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    enum { NBLK = NDIRECT + BSIZE / sizeof(uint) + 60, CHUNK = 2 }; // into the double indirect blocks
+    uchar *data = malloc(NBLK * BSIZE), *back = malloc(NBLK * BSIZE);
+    for (int i = 0; i < NBLK * BSIZE; i++) data[i] = i * 31 + 5;
+    mt_assert(writei(ip, data, 0, NBLK * BSIZE) == NBLK * BSIZE);
+
+    // a sequential read in small chunks finds most of the file already cached
+    bcache_stat st;
+    bcache_reset_stats();
+    for (uint b = 0; b < NBLK; b += CHUNK) {
+        uint n = min(CHUNK, NBLK - b) * BSIZE;
+        mt_assert(readi(ip, back + b * BSIZE, b * BSIZE, n) == n);
+        wait_prefetch();
+    }
+    bcache_get_stats(&st);
+    Log("readahead: %ld blocks read ahead, %ld used, %ld wasted", st.ra_fills, st.ra_useful, st.ra_wasted);
+    mt_assert(memcmp(back, data, NBLK * BSIZE) == 0);
+    mt_assert(st.ra_fills > 0);
+    mt_assert(st.ra_useful >= NBLK - 2 * RA_MIN_WINDOW);
+    mt_assert(st.ra_wasted == 0);
+
+    // jumping around the file reads nothing ahead
+    bcache_reset_stats();
+    for (uint i = 1; i < 40; i++) {
+        uint b = (1 + i * 37) % NBLK;
+        mt_assert(readi(ip, back, b * BSIZE, BSIZE) == BSIZE);
+        mt_assert(memcmp(back, data + b * BSIZE, BSIZE) == 0);
+    }
+    wait_prefetch();
+    bcache_get_stats(&st);
+    mt_assert(st.ra_fills == 0);
+
+    // nor does a sequential read with readahead off
+    set_readahead(RA_MIN_WINDOW, 0);
+    bcache_reset_stats();
+    for (uint b = 0; b < NBLK; b += CHUNK) {
+        uint n = min(CHUNK, NBLK - b) * BSIZE;
+        mt_assert(readi(ip, back + b * BSIZE, b * BSIZE, n) == n);
+    }
+    wait_prefetch();
+    bcache_get_stats(&st);
+    mt_assert(st.ra_fills == 0);
+    mt_assert(memcmp(back, data, NBLK * BSIZE) == 0);
+    set_readahead(RA_MIN_WINDOW, RA_MAX_WINDOW);
+
+    iput(ip);
+    free(data);
+    free(back);
+    return 0;
+}
+
+mt_test(test_delalloc_appends) {
+    format();
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    enum { NAPP = 300, LEN = 37, TOTAL = NAPP * LEN };
+    uchar *data = malloc(TOTAL), *back = malloc(TOTAL);
+    for (int i = 0; i < TOTAL; i++) data[i] = i * 11 + 3;
+
+    // small appends are buffered, a few allocations and writes cover all of them
+    block_stat bs;
+    da_stat ds;
+    reset_block_stats();
+    reset_da_stats();
+    for (int i = 0; i < NAPP; i++) {
+        mt_assert(writei(ip, data + i * LEN, i * LEN, LEN) == LEN);
+    }
+    mt_assert(ip->fileSize == TOTAL);
+    get_block_stats(&bs);
+    get_da_stats(&ds);
+    Log("delalloc: %ld appends, %ld flushes, %ld requests", ds.appends, ds.flushes, bs.requests);
+    mt_assert(ds.appends == NAPP);
+    mt_assert(ds.flushes > 0 && ds.flushes <= TOTAL / (DA_MAX_BYTES / 2));
+    mt_assert(bs.requests < NAPP / 10);
+
+    // the buffered tail is readable, through this inode and a fresh one, not on disk yet
+    mt_assert(readi(ip, back, 0, TOTAL) == TOTAL);
+    mt_assert(memcmp(back, data, TOTAL) == 0);
+    inode *other = iget(ip->inum);
+    mt_assert(other->fileSize == TOTAL);
+    memset(back, 0, TOTAL);
+    mt_assert(readi(other, back + 100, 100, TOTAL) == TOTAL - 100);
+    mt_assert(memcmp(back + 100, data + 100, TOTAL - 100) == 0);
+    iput(other);
+    inode *ondisk = load_iNode(ip->inum);
+    mt_assert(ondisk->fileSize < TOTAL);
+    free(ondisk);
+
+    isync(ip);
+    ondisk = load_iNode(ip->inum);
+    mt_assert(ondisk->fileSize == TOTAL);
+    free(ondisk);
+
+    // a write that is not an append sees what was buffered before it
+    mt_assert(writei(ip, data, TOTAL, LEN) == LEN);
+    mt_assert(writei(ip, data + 200, TOTAL - 10, 20) == 20);
+    mt_assert(ip->fileSize == TOTAL + LEN);
+    uchar *tail = malloc(LEN);
+    mt_assert(readi(ip, tail, TOTAL, LEN) == LEN);
+    mt_assert(memcmp(tail, data + 210, 10) == 0);
+    mt_assert(memcmp(tail + 10, data + 10, LEN - 10) == 0);
+    free(tail);
+
+    // with the buffer off every append goes straight through
+    set_delalloc(0);
+    reset_da_stats();
+    mt_assert(writei(ip, data, TOTAL + LEN, LEN) == LEN);
+    get_da_stats(&ds);
+    mt_assert(ds.appends == 0);
+    ondisk = load_iNode(ip->inum);
+    mt_assert(ondisk->fileSize == TOTAL + 2 * LEN);
+    free(ondisk);
+    set_delalloc(DA_MAX_BYTES);
+
+    iput(ip);
+    free(data);
+    free(back);
+    return 0;
+}
+
+mt_test(test_packed_inodes) {
+    format();
+    mt_assert(sb.ipb == INODES_PER_BLOCK);
+    mt_assert(sb.data_start < sb.size / 2);
+    inode *dir = ialloc(T_DIR);
+    mt_assert(dir != NULL);
+    enum { NFILE = 4 * INODES_PER_BLOCK };
+    inode *files[NFILE];
+    uint blocks[NFILE + 1];
+    int nblocks = 0;
+    blocks[nblocks++] = inum_block(dir->inum);
+    for (int i = 0; i < NFILE; i++) {
+        files[i] = ialloc_near(T_FILE, dir->inum);
+        mt_assert(files[i] != NULL);
+        int j = 0;
+        while (j < nblocks && blocks[j] != inum_block(files[i]->inum)) j++;
+        if (j == nblocks) blocks[nblocks++] = inum_block(files[i]->inum);
+    }
+    // the directory and its files share a handful of inode blocks
+    mt_assert(nblocks <= NFILE / INODES_PER_BLOCK + 1);
+
+    // hot inodes come from the inode table without touching a block
+    bcache_stat before, after;
+    itable_stat it;
+    bcache_get_stats(&before);
+    reset_itable_stats();
+    for (int i = 0; i < NFILE; i++) {
+        inode *ip = load_iNode(files[i]->inum);
+        mt_assert(ip != NULL && ip->type == T_FILE && ip->inum == files[i]->inum);
+        free(ip);
+    }
+    bcache_get_stats(&after);
+    get_itable_stats(&it);
+    mt_assert(it.hits == NFILE && it.misses == 0);
+    mt_assert(after.hits + after.misses == before.hits + before.misses);
+
+    // an inode block is freed with its last inode, a freed slot is used again
+    uint last = inum_block(files[NFILE - 1]->inum);
+    uint reuse = files[0]->inum;
+    for (int i = 0; i < NFILE; i++) {
+        bool alone = inum_block(files[i]->inum) == last;
+        if (alone || i == 0) wipeout_inode(files[i]);
+        iput(files[i]);
+    }
+    mt_assert(last != inum_block(dir->inum) && !block_in_use(last));
+    mt_assert(iget(reuse) == NULL);
+    inode *again = ialloc_near(T_FILE, dir->inum);
+    mt_assert(again != NULL && again->inum == reuse);
+    iput(again);
+    iput(dir);
+    return 0;
+}
+
+mt_test(test_icache) {
+    format();
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    uint inum = ip->inum;
+
+    // every holder of an inum shares one inode, a change is seen by all of them
+    icache_stat st;
+    reset_icache_stats();
+    inode *other = iget(inum);
+    mt_assert(other == ip);
+    uchar data[100];
+    memset(data, 'c', sizeof(data));
+    mt_assert(writei(ip, data, 0, sizeof(data)) == sizeof(data));
+    mt_assert(other->fileSize == sizeof(data));
+    iput(other);
+    iput(ip);
+
+    // after the last iput the inode stays in memory for the next lookup
+    for (int i = 0; i < 10; i++) {
+        ip = iget(inum);
+        mt_assert(ip != NULL && ip->fileSize == sizeof(data));
+        iput(ip);
+    }
+    get_icache_stats(&st);
+    mt_assert(st.hits == 11 && st.misses == 0);
+
+    // a stream of other inodes pushes it out, and it is read again
+    enum { NFILE = 200 };
+    uint inums[NFILE];
+    for (int i = 0; i < NFILE; i++) {
+        inode *f = ialloc(T_FILE);
+        mt_assert(f != NULL);
+        inums[i] = f->inum;
+        iput(f);
+    }
+    reset_icache_stats();
+    ip = iget(inum);
+    mt_assert(ip != NULL && ip->fileSize == sizeof(data));
+    iput(ip);
+    get_icache_stats(&st);
+    mt_assert(st.hits == 0 && st.misses == 1 && st.overflows == 0);
+
+    // holding more inodes than the cache has costs an allocation each, not a failure
+    inode *held[NFILE];
+    for (int i = 0; i < NFILE; i++) {
+        held[i] = iget(inums[i]);
+        mt_assert(held[i] != NULL && held[i]->inum == inums[i]);
+    }
+    get_icache_stats(&st);
+    mt_assert(st.overflows > 0);
+
+    // an inode beyond the cache is still the only one for its inum
+    inode *again = iget(inums[NFILE - 1]);
+    mt_assert(again == held[NFILE - 1]);
+    mt_assert(writei(again, data, 0, sizeof(data)) == sizeof(data));
+    mt_assert(held[NFILE - 1]->fileSize == sizeof(data));
+    iput(again);
+    for (int i = 0; i < NFILE; i++) iput(held[i]);
+
+    // a wiped out inode is gone once its last holder lets go
+    ip = iget(inum);
+    wipeout_inode(ip);
+    iput(ip);
+    mt_assert(iget(inum) == NULL);
+    return 0;
+}
+
+mt_test(test_clean_iput) {
+    format();
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    uint inum = ip->inum;
+    uchar data[3 * BSIZE];
+    memset(data, 'd', sizeof(data));
+    mt_assert(writei(ip, data, 0, sizeof(data)) == sizeof(data));
+    isync(ip);
+    iput(ip);
+    inode *ondisk = load_iNode(inum);
+    uint stamp = ondisk->modTime;
+    free(ondisk);
+
+    // lookups and reads leave the inode clean, iput has nothing to store
+    icache_stat st;
+    reset_icache_stats();
+    uchar back[sizeof(data)];
+    for (int i = 0; i < 10; i++) {
+        ip = iget(inum);
+        mt_assert(ip != NULL && !ip->dirty);
+        mt_assert(readi(ip, back, 0, sizeof(back)) == sizeof(back));
+        iput(ip);
+    }
+    get_icache_stats(&st);
+    mt_assert(st.stores == 0 && st.clean == 10);
+    ondisk = load_iNode(inum);
+    mt_assert(ondisk->modTime == stamp);
+    free(ondisk);
+
+    // a change noted with idirty is stored by the iput that follows
+    ip = iget(inum);
+    ip->linkCount = 7;
+    idirty(ip);
+    iput(ip);
+    get_icache_stats(&st);
+    mt_assert(st.stores == 1);
+    ondisk = load_iNode(inum);
+    mt_assert(ondisk->linkCount == 7);
+    free(ondisk);
+    return 0;
+}
+
+mt_test(test_bmap_range) {
+    format();
+    scribble_free_blocks();
+    set_readahead(RA_MIN_WINDOW, 0);
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    const uint lpb = BSIZE / sizeof(uint);
+    enum { NBLK = NDIRECT + BSIZE / sizeof(uint) + 3 * BSIZE / sizeof(uint) }; // three double indirect leaves
+    uchar *data = malloc(NBLK * BSIZE), *back = malloc(NBLK * BSIZE);
+    for (int i = 0; i < NBLK * BSIZE; i++) data[i] = i * 13 + 7;
+    mt_assert(writei(ip, data, 0, NBLK * BSIZE) == NBLK * BSIZE);
+
+    // one pass over the file reads each index block once, not once per data block
+    bcache_stat before, after;
+    bcache_get_stats(&before);
+    mt_assert(readi(ip, back, 0, NBLK * BSIZE) == NBLK * BSIZE);
+    bcache_get_stats(&after);
+    mt_assert(memcmp(back, data, NBLK * BSIZE) == 0);
+    long lookups = after.hits + after.misses - before.hits - before.misses;
+    long index = 1 + 1 + (NBLK - NDIRECT - lpb + lpb - 1) / lpb; // single, double level 0, leaves
+    mt_assert(lookups == NBLK + index);
+
+    // the map of a single block matches the one found for the range
+    for (uint b = 0; b < NBLK; b += 37) {
+        mt_assert(readi(ip, back, b * BSIZE, BSIZE) == BSIZE);
+        mt_assert(memcmp(back, data + b * BSIZE, BSIZE) == 0);
+    }
+    mt_assert(wipeout_inode(ip) == E_SUCCESS);
+    iput(ip);
+    free(data);
+    free(back);
+    set_readahead(RA_MIN_WINDOW, RA_MAX_WINDOW);
+    return 0;
+}
+
+mt_test(test_extent_tree) {
+    set_format_extents(true);
+    format();
+    mt_assert(extent_format());
+
+    // a file written in one go is a single extent in the inode
+    inode *seq = ialloc(T_FILE);
+    mt_assert(seq != NULL);
+    enum { NSEQ = NDIRECT + 2 * BSIZE / sizeof(uint) };
+    uchar *data = malloc(NSEQ * BSIZE), *back = malloc(NSEQ * BSIZE);
+    for (int i = 0; i < NSEQ * BSIZE; i++) data[i] = i * 17 + 3;
+    mt_assert(writei(seq, data, 0, NSEQ * BSIZE) == NSEQ * BSIZE);
+    isync(seq);
+    extent_hdr *root = (extent_hdr *)seq->addrs;
+    mt_assert(root->depth == 0 && root->count == 1);
+    mt_assert(((extent *)(root + 1))->len == NSEQ);
+    mt_assert(readi(seq, back, 0, NSEQ * BSIZE) == NSEQ * BSIZE);
+    mt_assert(memcmp(back, data, NSEQ * BSIZE) == 0);
+
+    // two files growing a block at a time in turn get an extent per block, in a tree with
+    // more leaves than the inode holds, so one index node above them
+    set_delalloc(0);
+    enum { NFRAG = 3 * NODE_EXTENTS + 5 };
+    inode *a = ialloc(T_FILE), *b = ialloc(T_FILE);
+    mt_assert(a != NULL && b != NULL);
+    for (int i = 0; i < NFRAG; i++) {
+        mt_assert(writei(a, data + i * BSIZE, i * BSIZE, BSIZE) == BSIZE);
+        mt_assert(writei(b, data + (i + 1) * BSIZE, i * BSIZE, BSIZE) == BSIZE);
+    }
+    set_delalloc(DA_MAX_BYTES);
+    root = (extent_hdr *)a->addrs;
+    mt_assert(root->depth == 2 && root->count == 1);
+
+    // a pass over the file reads each node once
+    enum { NLEAF = (NFRAG + NODE_EXTENTS - 1) / NODE_EXTENTS };
+    set_readahead(RA_MIN_WINDOW, 0);
+    bcache_stat before, after;
+    bcache_get_stats(&before);
+    mt_assert(readi(a, back, 0, NFRAG * BSIZE) == NFRAG * BSIZE);
+    bcache_get_stats(&after);
+    set_readahead(RA_MIN_WINDOW, RA_MAX_WINDOW);
+    mt_assert(memcmp(back, data, NFRAG * BSIZE) == 0);
+    mt_assert(after.hits + after.misses - before.hits - before.misses == NFRAG + 1 + NLEAF);
+    for (int i = NFRAG - 1; i >= 0; i -= 7) {
+        mt_assert(readi(b, back, i * BSIZE, BSIZE) == BSIZE);
+        mt_assert(memcmp(back, data + (i + 1) * BSIZE, BSIZE) == 0);
+    }
+
+    // wiping a file out frees its tree nodes with its data
+    uint node = ((extent *)(root + 1))[0].start;
+    uint first = _which_read(a, 0);
+    mt_assert(block_in_use(node) && block_in_use(first));
+    mt_assert(wipeout_inode(a) == E_SUCCESS);
+    mt_assert(!block_in_use(node) && !block_in_use(first));
+    mt_assert(wipeout_inode(b) == E_SUCCESS);
+    mt_assert(wipeout_inode(seq) == E_SUCCESS);
+    iput(a);
+    iput(b);
+    iput(seq);
+    free(data);
+    free(back);
+
+    // the next format maps by blocks again unless it is asked for extents too
+    set_format_layout(0);
+    format();
+    mt_assert(!extent_format());
+
+    // a superblock from before the flags has garbage where they are now
+    uchar blk[BSIZE];
+    read_block(0, blk);
+    ((superblock *)blk)->flags = SB_EXTENTS;
+    write_block(0, blk);
+    _mount_disk();
+    mt_assert(!extent_format());
+    return 0;
+}
+
+mt_test(test_delalloc_sync) {
+    format();
+    inode *ip = ialloc(T_FILE);
+    mt_assert(ip != NULL);
+    enum { LEN = 50 + BSIZE }; // the second append needs a block of its own
+    uchar data[LEN], back[LEN];
+    for (int i = 0; i < LEN; i++) data[i] = i * 7 + 1;
+
+    // buffered bytes do not wait for a sync: the flusher writes them out once they are old
+    da_stat ds;
+    reset_da_stats();
+    mt_assert(writei(ip, data, 0, 50) == 50);
+    inode *ondisk = load_iNode(ip->inum);
+    mt_assert(ondisk->fileSize == 0);
+    free(ondisk);
+    for (int i = 0; i < 40; i++) {
+        get_da_stats(&ds);
+        if (ds.flushes > 0) break;
+        usleep(100 * 1000);
+    }
+    mt_assert(ds.flushes == 1);
+    ondisk = load_iNode(ip->inum);
+    mt_assert(ondisk->fileSize == 50);
+    free(ondisk);
+
+    // with the disk full the bytes stay buffered and isync says so
+    uint *held = malloc(sb.size * sizeof(uint));
+    int nheld = 0;
+    uint got, first;
+    while ((first = allocate_data_extent(0, 1024, &got)) != 0) {
+        for (uint i = 0; i < got; i++) held[nheld++] = first + i;
+    }
+    mt_assert(writei(ip, data + 50, 50, BSIZE) == BSIZE);
+    int full = isync(ip);
+    uint size = ip->fileSize;
+    mt_assert(readi(ip, back, 0, LEN) == LEN);
+    free_blocks(held, nheld);
+    free(held);
+    mt_assert(full == -1 && size == LEN);
+    mt_assert(memcmp(back, data, LEN) == 0);
+
+    // ... until there is room again
+    mt_assert(isync(ip) == 0);
+    ondisk = load_iNode(ip->inum);
+    mt_assert(ondisk->fileSize == LEN);
+    free(ondisk);
+    mt_assert(readi(ip, back, 0, LEN) == LEN);
+    mt_assert(memcmp(back, data, LEN) == 0);
+    iput(ip);
+    return 0;
+}
+
 void inode_tests() {
     mt_run_test(test_iget);
     mt_run_test(test_ialloc);
@@ -202,4 +751,14 @@ void inode_tests() {
     mt_run_test(test_readi);
     mt_run_test(test_read_write_mixed);
     mt_run_test(test_random_binary_read_write);
+    mt_run_test(test_extent_layout);
+    mt_run_test(test_bufpool_hot_path);
+    mt_run_test(test_readahead);
+    mt_run_test(test_delalloc_appends);
+    mt_run_test(test_delalloc_sync);
+    mt_run_test(test_packed_inodes);
+    mt_run_test(test_icache);
+    mt_run_test(test_clean_iput);
+    mt_run_test(test_bmap_range);
+    mt_run_test(test_extent_tree);
 }
\ No newline at end of file
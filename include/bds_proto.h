@@ -0,0 +1,54 @@
+/* ********************************
+ * Description:  Binary framing for requests between the FS and the block device server
+ *
+ * Each binary message is one tcp_buffer frame that starts with a fixed header.
+ * Its first byte is BDS_MAGIC, which can never start a text command, so the BDS
+ * tells binary and text messages apart by looking at it and the BDC debugging
+ * client keeps using the text commands. All header fields are in network byte order.
+ ********************************/
+
+#ifndef _BDS_PROTO_
+#define _BDS_PROTO_
+
+#include <stdint.h>
+
+#define BDS_MAGIC 0xB5
+#define BDS_VERSION 1  // answered by the text command "V" when the binary protocol is spoken
+
+enum {
+    BDS_OP_INFO = 1,  // reply payload: ncyl, nsec as two uint32
+    BDS_OP_READ,      // read count blocks starting at blockno
+    BDS_OP_WRITE,     // write count blocks starting at blockno, payload is the data
+    BDS_OP_READV,     // payload: count block numbers (uint32), reply holds their data in order
+    BDS_OP_WRITEV,    // payload: count block numbers (uint32) followed by their data
+    BDS_OP_FLUSH,     // barrier: replies once every earlier write is on stable storage
+    BDS_OP_DISCARD,   // count blocks starting at blockno read back as zeros, no payload
+};
+
+#define BDS_MAX_DISCARD 65536  // blocks per discard, other requests carry at most MAX_RANGE
+
+enum {
+    BDS_OK = 0,
+    BDS_EINVAL,  // malformed request or block out of range
+    BDS_EIO,     // the disk refused the access
+};
+
+typedef struct {
+    uint8_t magic;
+    uint8_t op;
+    uint16_t flags;
+    uint32_t tag;      // echoed back in the response
+    uint32_t blockno;  // linear block number, cyl * nsec + sec
+    uint32_t count;    // number of blocks
+    uint32_t len;      // payload bytes following the header
+} bds_req_hdr;
+
+typedef struct {
+    uint8_t magic;
+    uint8_t status;
+    uint16_t flags;
+    uint32_t tag;
+    uint32_t len;  // payload bytes following the header
+} bds_resp_hdr;
+
+#endif
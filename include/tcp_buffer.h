@@ -1,7 +1,9 @@
 #ifndef _TCP_BUFFER_
 #define _TCP_BUFFER_
 
-#define TCP_BUF_SIZE 4096
+#include <sys/uio.h>
+
+#define TCP_BUF_SIZE (1 << 17)  // large enough for a full MAX_RANGE transfer plus headroom
 
 typedef struct tcp_buffer {
     int read_index;
@@ -31,6 +33,41 @@ tcp_buffer *init_buffer();
  */
 void buffer_append(tcp_buffer *buf, const char *s, int len);
 
+/**
+ * @brief Append a message gathered from several pieces
+ *
+ * Same as buffer_append, but the packet is the concatenation of iov[0..cnt),
+ * so callers don't have to assemble a header and a payload in a scratch buffer.
+ *
+ * @param  buf   buffer to be written
+ * @param  iov   pieces of the message
+ * @param  cnt   number of pieces
+ */
+void buffer_appendv(tcp_buffer *buf, const struct iovec *iov, int cnt);
+
+/**
+ * @brief Reserve room for a message
+ *
+ * Returns where the body of the next message goes, so it can be produced in
+ * place. Nothing is visible until buffer_commit is called.
+ *
+ * @param  buf      buffer to be written
+ * @param  max_len  largest body that will be committed
+ *
+ * @return char*    start of the message body, NULL if the buffer is full
+ */
+char *buffer_reserve(tcp_buffer *buf, int max_len);
+
+/**
+ * @brief Commit a reserved message
+ *
+ * Frame the first len bytes written at the pointer returned by buffer_reserve.
+ *
+ * @param  buf   buffer to be written
+ * @param  len   length of the message body
+ */
+void buffer_commit(tcp_buffer *buf, int len);
+
 /**
  * @brief  Read to buffer
  *
@@ -36,6 +36,20 @@ tcp_server server_init(int port, int num_threads, void (*on_connection)(int id),
  */
 int server_run(tcp_server server);
 
+/**
+ * @brief  Send a message to a client outside of on_recv
+ *
+ * Lets a reply be sent later, e.g. once a request that on_recv started has
+ * completed. It may be called from any thread; the message is dropped if the
+ * client has gone away.
+ *
+ * @param  server  server the client is connected to
+ * @param  id      id of the client, as passed to on_recv
+ * @param  msg     message to be sent
+ * @param  len     length of the message
+ */
+void server_send(tcp_server server, int id, const char *msg, int len);
+
 /**
  * @brief  Initialize a TCP client
  *
@@ -60,6 +74,17 @@ tcp_client client_init(const char *hostname, int port);
  */
 void client_send(tcp_client client, const char *msg, int len);
 
+/**
+ * @brief  Send a message gathered from several pieces
+ *
+ * Like client_send, the pieces are sent as one data packet.
+ *
+ * @param  client  client to send the message
+ * @param  iov     pieces of the message
+ * @param  cnt     number of pieces
+ */
+void client_sendv(tcp_client client, const struct iovec *iov, int cnt);
+
 /**
  * @brief  Receive a message from the server
  *
@@ -73,6 +98,37 @@ void client_send(tcp_client client, const char *msg, int len);
  */
 int client_recv(tcp_client client, char *buf, int max_len);
 
+/**
+ * @brief  Receive a message without copying it
+ *
+ * Wait for the next message and point msg at it inside the client's read
+ * buffer. It stays valid until client_release is called.
+ *
+ * @param  client   client to receive the message
+ * @param  msg      set to the start of the message
+ *
+ * @return int      the number of bytes received, 0 if error or closed
+ */
+int client_peek(tcp_client client, char **msg);
+
+/**
+ * @brief  Release a message returned by client_peek
+ *
+ * @param  client   client that received the message
+ * @param  len      length returned by client_peek
+ */
+void client_release(tcp_client client, int len);
+
+/**
+ * @brief  Check for a reply without consuming it
+ *
+ * @param  client      client to check
+ * @param  timeout_ms  how long to wait for data, 0 returns at once
+ *
+ * @return int         1 if a message is buffered or data arrived, 0 otherwise
+ */
+int client_poll(tcp_client client, int timeout_ms);
+
 /**
  * @brief  Destroy a TCP client
  *
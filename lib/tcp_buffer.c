@@ -2,9 +2,11 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 tcp_buffer *init_buffer() {
@@ -68,6 +70,36 @@ void buffer_append(tcp_buffer *buf, const char *s, int len) {
     recycle_write(buf, len + 4);
 }
 
+void buffer_appendv(tcp_buffer *buf, const struct iovec *iov, int cnt) {
+    int len = 0;
+    for (int i = 0; i < cnt; i++) len += iov[i].iov_len;
+    char *p = buffer_reserve(buf, len);
+    if (p == NULL) return;
+    for (int i = 0; i < cnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    buffer_commit(buf, len);
+}
+
+char *buffer_reserve(tcp_buffer *buf, int max_len) {
+    int writeable = TCP_BUF_SIZE - buf->write_index;
+    if (max_len < 0) {
+        fprintf(stderr, "invalid length: len cannot be negative\n");
+        return NULL;
+    }
+    if (writeable < max_len + 4) {
+        fprintf(stderr, "write buffer full\n");
+        return NULL;
+    }
+    return &buf->buf[buf->write_index + 4];
+}
+
+void buffer_commit(tcp_buffer *buf, int len) {
+    *(int *)&buf->buf[buf->write_index] = htonl(len);
+    recycle_write(buf, len + 4);
+}
+
 int read_to_buffer(tcp_buffer *buf, int sockfd) {
     int read_all = 0;
     int close_flag = 0;
@@ -106,7 +138,13 @@ int read_to_buffer(tcp_buffer *buf, int sockfd) {
 void send_buffer(tcp_buffer *buf, int sockfd) {
     while (buf->write_index > buf->read_index) {
         int readable = buf->write_index - buf->read_index;
-        int ret = send(sockfd, &buf->buf[buf->read_index], readable, 0);
+        int ret = send(sockfd, &buf->buf[buf->read_index], readable, MSG_NOSIGNAL);
+        if (ret < 0 && (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)) {
+            // non-blocking socket is full, wait until the peer drains it
+            struct pollfd pfd = {.fd = sockfd, .events = POLLOUT};
+            poll(&pfd, 1, -1);
+            continue;
+        }
         if (ret <= 0) {
             perror("send()");
             break;
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +25,9 @@ struct tcp_server_pool {     // Represents a pool of connected descriptors
     int maxi;                // High water index into client array
     int connfd[FD_SETSIZE];  // Set of active descriptors
     pthread_mutex_t mutex[FD_SETSIZE];
+    pthread_mutex_t wlock[FD_SETSIZE];  // guards write_buf, replies may come from other threads
+    pthread_mutex_t set_lock;  // guards read_set and maxfd, worker threads put their client back
+    int wake[2];               // pipe that interrupts select when a client is put back
     struct tcp_buffer *read_buf[FD_SETSIZE];
     struct tcp_buffer *write_buf[FD_SETSIZE];
 };
@@ -49,10 +53,21 @@ void init_pool(int listenfd, struct tcp_server_pool *p) {
     p->maxi = 1;
     for (int i = 0; i < FD_SETSIZE; i++) p->connfd[i] = -1;
     for (int i = 0; i < FD_SETSIZE; i++) pthread_mutex_init(&p->mutex[i], NULL);
+    for (int i = 0; i < FD_SETSIZE; i++) pthread_mutex_init(&p->wlock[i], NULL);
 
     p->maxfd = listenfd;
     FD_ZERO(&p->read_set);
     FD_SET(listenfd, &p->read_set);
+
+    pthread_mutex_init(&p->set_lock, NULL);
+    if (pipe(p->wake) < 0) {
+        perror("pipe()");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(p->wake[0], F_SETFL, fcntl(p->wake[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(p->wake[1], F_SETFL, fcntl(p->wake[1], F_GETFL, 0) | O_NONBLOCK);
+    FD_SET(p->wake[0], &p->read_set);
+    if (p->wake[0] > p->maxfd) p->maxfd = p->wake[0];
 }
 
 /* Add a new connection to the pool */
@@ -67,8 +82,10 @@ void add_conn(int connfd, struct tcp_server_pool *p, void (*on_connection)(int))
             p->write_buf[i] = init_buffer();
             if (on_connection) on_connection(i);
             printf("New client: %d\n", connfd);
+            pthread_mutex_lock(&p->set_lock);
             FD_SET(connfd, &p->read_set);
             if (connfd > p->maxfd) p->maxfd = connfd;
+            pthread_mutex_unlock(&p->set_lock);
             if (i > p->maxi) p->maxi = i;
             break;
         }
@@ -111,7 +128,9 @@ void handle_read(void *arg_p) {
             int len = ntohl(*(int *)s);
             // if the message is complete
             if (readable >= len + 4) {
+                pthread_mutex_lock(&p->wlock[i]);
                 if (server->on_recv(i, write_buf, s + 4, len) < 0) close_flag = 1;
+                pthread_mutex_unlock(&p->wlock[i]);
                 recycle_read(read_buf, len + 4);
             } else
                 break;
@@ -119,16 +138,28 @@ void handle_read(void *arg_p) {
     }
 
     // write
+    pthread_mutex_lock(&p->wlock[i]);
     send_buffer(write_buf, connfd);
+    pthread_mutex_unlock(&p->wlock[i]);
 
     if (count < 0 || close_flag) {
         printf("client %d exited\n", connfd);
+        // cleanup runs first so that it can wait for replies still on their way
+        if (server->cleanup) server->cleanup(i);
+        pthread_mutex_lock(&p->wlock[i]);
         free(p->read_buf[i]);
         free(p->write_buf[i]);
-        if (server->cleanup) server->cleanup(i);
-        close(connfd);
-        FD_CLR(connfd, &p->read_set);
         p->connfd[i] = -1;
+        pthread_mutex_unlock(&p->wlock[i]);
+        close(connfd);
+    } else {
+        // hand the client back to select
+        pthread_mutex_lock(&p->set_lock);
+        FD_SET(connfd, &p->read_set);
+        pthread_mutex_unlock(&p->set_lock);
+        if (write(p->wake[1], "", 1) < 0) {
+            // the pipe is full, select wakes up anyway
+        }
     }
 
     // locked in server_run, before the task is added
@@ -136,6 +167,17 @@ void handle_read(void *arg_p) {
     pthread_mutex_unlock(&p->mutex[i]);
 }
 
+/* Send a message to a client from outside on_recv */
+void server_send(tcp_server_ *server, int id, const char *msg, int len) {
+    struct tcp_server_pool *p = &server->pool;
+    pthread_mutex_lock(&p->wlock[id]);
+    if (p->connfd[id] >= 0) {
+        buffer_append(p->write_buf[id], msg, len);
+        send_buffer(p->write_buf[id], p->connfd[id]);
+    }
+    pthread_mutex_unlock(&p->wlock[id]);
+}
+
 /* Initialize a server */
 tcp_server_ *server_init(int port, int num_threads, void (*on_connection)(int id),
                          int (*on_recv)(int id, tcp_buffer *write_buf, char *msg, int len), void (*cleanup)(int id)) {
@@ -193,9 +235,19 @@ tcp_server_ *server_init(int port, int num_threads, void (*on_connection)(int id
 /* Start the server loop, never returns */
 int server_run(tcp_server_ *server) {
     while (1) {
-        server->pool.ready_set = server->pool.read_set;
+        struct tcp_server_pool *p = &server->pool;
+        pthread_mutex_lock(&p->set_lock);
+        p->ready_set = p->read_set;
+        int maxfd = p->maxfd;
+        pthread_mutex_unlock(&p->set_lock);
         // wait for a client to be ready
-        server->pool.nready = select(server->pool.maxfd + 1, &server->pool.ready_set, NULL, NULL, NULL);
+        p->nready = select(maxfd + 1, &p->ready_set, NULL, NULL, NULL);
+        if (p->nready < 0) continue;
+        if (FD_ISSET(p->wake[0], &p->ready_set)) {
+            char drain[64];
+            while (read(p->wake[0], drain, sizeof(drain)) > 0);
+            p->nready--;
+        }
         // if listenfd is ready, a new client is connecting
         if (FD_ISSET(server->listenfd, &server->pool.ready_set)) {
             // handle new client
@@ -213,8 +265,6 @@ int server_run(tcp_server_ *server) {
             add_conn(connfd, &server->pool, server->on_connection);
         }
 
-        struct tcp_server_pool *p = &server->pool;
-
         // handle all readable clients
         for (int i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
             int connfd = p->connfd[i];
@@ -223,6 +273,10 @@ int server_run(tcp_server_ *server) {
                 // if the mutex is locked, skip
                 if (pthread_mutex_trylock(&p->mutex[i]) == 0) {
                     p->nready--;
+                    // keep select from reporting it again while a worker is busy with it
+                    pthread_mutex_lock(&p->set_lock);
+                    FD_CLR(connfd, &p->read_set);
+                    pthread_mutex_unlock(&p->set_lock);
                     handle_read_args *arg = malloc(sizeof(handle_read_args));
                     arg->server = server;
                     arg->i = i;
@@ -273,16 +327,57 @@ void client_send(tcp_client_ *client, const char *msg, int len) {
     send_buffer(client->write_buf, client->sockfd);
 }
 
+/* Send a message made of several pieces */
+void client_sendv(tcp_client_ *client, const struct iovec *iov, int cnt) {
+    buffer_appendv(client->write_buf, iov, cnt);
+    send_buffer(client->write_buf, client->sockfd);
+}
+
+/* Wait for a complete message and leave it in the read buffer */
+int client_peek(tcp_client_ *client, char **msg) {
+    tcp_buffer *read_buf = client->read_buf;
+    while (1) {
+        int readable = read_buf->write_index - read_buf->read_index;
+        char *s = &read_buf->buf[read_buf->read_index];
+        if (readable >= 4) {
+            int len = ntohl(*(int *)s);
+            if (readable >= len + 4) {
+                *msg = s + 4;
+                return len;
+            }
+        }
+        if (read_to_buffer(read_buf, client->sockfd) <= 0) {
+            printf("Connection closed\n");
+            return 0;
+        }
+    }
+}
+
+void client_release(tcp_client_ *client, int len) { recycle_read(client->read_buf, len + 4); }
+
+/* Check whether a message is buffered or data is waiting on the socket */
+int client_poll(tcp_client_ *client, int timeout_ms) {
+    tcp_buffer *read_buf = client->read_buf;
+    int readable = read_buf->write_index - read_buf->read_index;
+    if (readable >= 4 && readable >= ntohl(*(int *)&read_buf->buf[read_buf->read_index]) + 4) return 1;
+    struct pollfd pfd = {.fd = client->sockfd, .events = POLLIN};
+    return poll(&pfd, 1, timeout_ms) > 0;
+}
+
 /* Receive a message from the server */
 int client_recv(tcp_client_ *client, char *buf, int max_len) {
     tcp_buffer *read_buf = client->read_buf;
     // read all data from the socket
+    int buffered = read_buf->write_index > read_buf->read_index; // replies may already be queued
     while (1) {
-        int count = read_to_buffer(read_buf, client->sockfd);
-        if (count <= 0) {
-            printf("Connection closed\n");
-            return 0;
+        if (!buffered) {
+            int count = read_to_buffer(read_buf, client->sockfd);
+            if (count <= 0) {
+                printf("Connection closed\n");
+                return 0;
+            }
         }
+        buffered = 0;
         int readable = read_buf->write_index - read_buf->read_index;
         char *s = &read_buf->buf[read_buf->read_index];
         // the first 4 bytes is the length of the message